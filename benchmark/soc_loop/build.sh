@@ -0,0 +1,42 @@
+#!/bin/bash
+# Build the SoC loop prefetch microbenchmark with only a C++17 compiler, i.e., without meson,
+# DOCA or rdma-core, so that it runs on any Linux box
+
+script_dir=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
+lib_dir=$script_dir/../../lib
+build_dir=$script_dir/build
+CXX=${CXX:-g++}
+
+log() {
+  echo -e "\033[37m [NICC Build Log] $1 \033[0m"
+}
+
+error() {
+  echo -e "\033[31m [NICC Build Err] $1 \033[0m"
+  exit 1
+}
+
+if [ "$1" = "-c" ]; then
+  log ">> cleaning soc_loop benchmark..."
+  rm -rf $build_dir
+  exit 0
+fi
+
+# generate the headers configured by meson in the full build, with errors and warnings enabled
+mkdir -p $build_dir/include
+sed -e 's/@nicc_print_error@/1/' -e 's/@nicc_print_warn@/1/' -e 's/@nicc_print_log@/0/' \
+    -e 's/@nicc_print_debug@/0/' -e 's/@nicc_print_with_color@/1/' \
+    $lib_dir/log/log.h.in > $build_dir/include/log.h
+sed -e 's/@nicc_runtime_debug_check@/0/' $lib_dir/log/debug.h.in > $build_dir/include/debug.h
+# common.h includes doca_error.h, which the loops do not use
+if ! echo '#include <doca_error.h>' | $CXX -x c++ -E - &> /dev/null; then
+  echo '#pragma once' > $build_dir/include/doca_error.h
+fi
+
+log ">> building soc_loop benchmark..."
+$CXX -O2 -std=c++17 -pthread -Wall -Wno-attributes -Wno-unused-function -I$build_dir/include -I$lib_dir -I$lib_dir/common \
+  $script_dir/soc_loop_bench.cc -o $build_dir/soc_loop_bench
+if [ $? -ne 0 ]; then
+  error ">>>> building soc_loop benchmark failed"
+fi
+log "successfully built $build_dir/soc_loop_bench"
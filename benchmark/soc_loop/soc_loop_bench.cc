@@ -0,0 +1,356 @@
+/**
+ * \brief Microbenchmark of software prefetching in the SoC dispatcher and worker loops
+ *        (lib/wrapper/soc/src/soc_wrapper.cc), reporting the cycles per packet of
+ *          - the rx stage, which writes the length of the received buffers into their descriptors
+ *          - the dispatch stage, which walks the rx ring, takes ownership of the buffers and
+ *            hashes their flows into bursts
+ *          - the worker stage, which runs a handler reading the headers and the payload
+ *        for several prefetch distances, with the packet buffers of the ring laid out in
+ *        order or shuffled. Caches are flushed before every pass over the ring, as packets
+ *        written by the NIC are cold. Results are printed as JSON, see benchmark.md
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "common.h"
+#include "log.h"
+#include "common/timer.h"
+#include "common/buffer.h"
+
+using namespace nicc;
+
+namespace {
+
+/**
+ * ----------------------Configuration----------------------
+ */
+struct bench_config {
+    size_t nb_passes = 200;             /// passes over the ring per run
+    size_t flush_size = MB(64);         /// memory walked to flush the caches before each pass
+    int cpu = -1;                       /// cpu to pin to, unpinned if unset
+    const char *output = nullptr;       /// output file, stdout if unset
+};
+
+/// Entries of the rx ring, matching RDMA_SoC_QP::kNumRxRingEntries
+static constexpr size_t kRingSize = 2048;
+/// Size of a packet buffer, matching Channel_SoC::kRecvMbufSize
+static constexpr size_t kBufSize = 4096;
+/// Size of the dispatch bursts, matching SoCWrapper::kQueueBurstSize
+static constexpr size_t kBurstSize = 32;
+/// Size of the rx bursts, matching SoCWrapper::kRxBatchSize
+static constexpr size_t kRxBurstSize = 128;
+/// Bytes of payload the handler reads
+static constexpr size_t kPayloadReadSize = 128;
+/// Prefetch distances measured, 0 is the baseline without prefetching
+static constexpr size_t kDistances[] = { 0, 1, 2, 4, 8, 16 };
+
+/**
+ * ----------------------JSON output----------------------
+ */
+class bench_json {
+ public:
+    explicit bench_json(FILE *out) : _out(out) {}
+
+    void begin_object(const char *key = nullptr) { this->__open(key, '{'); }
+    void end_object() { this->__close('}'); }
+    void begin_array(const char *key = nullptr) { this->__open(key, '['); }
+    void end_array() { this->__close(']'); }
+
+    void field_u64(const char *key, uint64_t value) {
+        this->__key(key);
+        fprintf(_out, "%lu", value);
+    }
+    void field_f64(const char *key, double value) {
+        this->__key(key);
+        fprintf(_out, "%.3f", value);
+    }
+    void field_str(const char *key, const char *value) {
+        this->__key(key);
+        fprintf(_out, "\"%s\"", value);
+    }
+
+ private:
+    void __key(const char *key) {
+        if (!_first.empty()) {
+            if (!_first.back()) fputc(',', _out);
+            _first.back() = false;
+            fprintf(_out, "\n%*s", static_cast<int>(2 * _first.size()), "");
+        }
+        if (key != nullptr) fprintf(_out, "\"%s\": ", key);
+    }
+    void __open(const char *key, char c) {
+        this->__key(key);
+        fputc(c, _out);
+        _first.push_back(true);
+    }
+    void __close(char c) {
+        bool empty = _first.back();
+        _first.pop_back();
+        if (!empty) fprintf(_out, "\n%*s", static_cast<int>(2 * _first.size()), "");
+        fputc(c, _out);
+        if (_first.empty()) fputc('\n', _out);
+    }
+
+    FILE *_out;
+    std::vector<bool> _first;
+};
+
+static bool pin_self(int cpu) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+        NICC_WARN("failed to pin the thread to cpu %d", cpu);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * ----------------------Ring----------------------
+ */
+/**
+ * \brief an rx ring laid out like the one of Channel_SoC, i.e., contiguous Buffer
+ *        descriptors indexed by ring slot and one packet buffer per descriptor
+ */
+struct bench_ring {
+    std::vector<Buffer> descs;
+    uint8_t *data = nullptr;
+    uint32_t byte_len[kRingSize];       /// stands for the recv wcs
+
+    explicit bench_ring(bool shuffled) : descs(kRingSize) {
+        std::vector<size_t> slots(kRingSize);
+        std::iota(slots.begin(), slots.end(), 0);
+        if (shuffled) {
+            std::shuffle(slots.begin(), slots.end(), std::mt19937(42));
+        }
+        data = static_cast<uint8_t*>(aligned_alloc(kBufSize, kRingSize * kBufSize));
+        for (size_t i = 0; i < kRingSize; i++) {
+            Buffer *m = &descs[i];
+            m->buf_ = data + slots[i] * kBufSize;
+            m->class_size_ = kBufSize;
+            m->state_ = Buffer::kPOSTED;
+            this->__fill_pkt(m->buf_, i);
+            byte_len[i] = 64 + kPayloadReadSize + i % 512;
+        }
+    }
+    ~bench_ring() { free(data); }
+
+ private:
+    void __fill_pkt(uint8_t *pkt, size_t i) {
+        memset(pkt, 0, kBufSize);
+        struct iphdr *iph = reinterpret_cast<struct iphdr*>(pkt + 14);
+        struct udphdr *uh = reinterpret_cast<struct udphdr*>(pkt + 14 + sizeof(struct iphdr));
+        iph->saddr = htonl(0x0a000001 + i % 64);
+        iph->daddr = htonl(0x0a000101);
+        uh->source = htons(static_cast<uint16_t>(1024 + i));
+        uh->dest = htons(4791);
+        struct ws_hdr *wsh = reinterpret_cast<struct ws_hdr*>(pkt + 14 + sizeof(struct iphdr) + sizeof(struct udphdr));
+        wsh->seg_flags_ = kWsSegFirst;
+        wsh->segment_num_ = 1;
+        for (size_t j = 0; j < kPayloadReadSize; j++) {
+            pkt[64 + j] = static_cast<uint8_t>(i + j);
+        }
+    }
+};
+
+/// the flow hash of SoCWrapper::__get_flow_hash over the 5-tuple
+static inline uint64_t get_flow_hash(Buffer *pkt) {
+    struct iphdr *iph = reinterpret_cast<struct iphdr*>(pkt->get_iph());
+    struct udphdr *uh = reinterpret_cast<struct udphdr*>(pkt->get_uh());
+    uint64_t addrs = (static_cast<uint64_t>(iph->saddr) << 32) | iph->daddr;
+    uint64_t ports = (static_cast<uint64_t>(uh->source) << 16) | uh->dest;
+    uint64_t hash = addrs * 0x9e3779b97f4a7c15ULL ^ ports * 0xc2b2ae3d27d4eb4fULL;
+    hash ^= hash >> 29;
+    hash ^= hash >> 17;
+    return hash;
+}
+
+static void flush_caches(std::vector<uint8_t> &flush_area) {
+    for (size_t i = 0; i < flush_area.size(); i += kCacheLineSize) {
+        flush_area[i]++;
+    }
+}
+
+/**
+ * ----------------------Loops----------------------
+ */
+/// rx stage of SoCWrapper::__rx_burst, set the length of each received buffer
+static void rx_stage(bench_ring &ring, size_t distance) {
+    for (size_t base = 0; base < kRingSize; base += kRxBurstSize) {
+        for (size_t i = base; i < base + kRxBurstSize; i++) {
+            if (distance > 0) {
+                prefetch_write(&ring.descs[(i + distance) % kRingSize]);
+            }
+            ring.descs[i].length_ = ring.byte_len[i];
+        }
+    }
+}
+
+/// dispatch stage of SoCWrapper::__dispatch_rx_pkts with rss dispatch, gather bursts by
+/// ring slot and hash the flow of each packet
+static uint64_t dispatch_stage(bench_ring &ring, size_t distance, Buffer **worker_queue) {
+    Buffer *burst[kBurstSize];
+    uint64_t buckets = 0;
+    size_t nb_queued = 0;
+    for (size_t base = 0; base < kRingSize; base += kBurstSize) {
+        for (size_t i = 0; i < kBurstSize; i++) {
+            Buffer *ring_entry = &ring.descs[base + i];
+            if (distance > 0) {
+                prefetch_write(&ring.descs[(base + i + distance) % kRingSize]);
+                ring_entry->prefetch_hdrs();
+            }
+            ring_entry->state_ = Buffer::kAPP_OWNED_BUF;
+            burst[i] = ring_entry;
+        }
+        for (size_t i = 0; i < kBurstSize; i++) {
+            buckets += get_flow_hash(burst[i]) % 128;
+            worker_queue[nb_queued++] = burst[i];
+        }
+    }
+    return buckets;
+}
+
+/// worker stage of SoCWrapper::__handle_worker_rx_msgs, a handler reads the headers and
+/// the start of the payload of each message and answers in place
+static uint64_t worker_stage(Buffer **msgs, size_t distance) {
+    uint64_t sum = 0;
+    for (size_t base = 0; base < kRingSize; base += kBurstSize) {
+        Buffer **burst = &msgs[base];
+        for (size_t i = 0; i < std::min(kBurstSize, distance); i++) {
+            burst[i]->prefetch_hdrs();
+        }
+        for (size_t i = 0; i < kBurstSize; i++) {
+            if (distance > 0 && i + distance < kBurstSize) {
+                burst[i + distance]->prefetch_hdrs();
+            }
+            Buffer *m = burst[i];
+            struct udphdr *uh = reinterpret_cast<struct udphdr*>(m->get_uh());
+            sum += reinterpret_cast<struct ws_hdr*>(m->get_ws_hdr())->segment_num_;
+            for (size_t j = 0; j < kPayloadReadSize; j += 8) {
+                sum += *reinterpret_cast<uint64_t*>(m->get_buf() + 64 + j);
+            }
+            std::swap(uh->source, uh->dest);
+            m->state_ = Buffer::kFREE_BUF;
+        }
+    }
+    return sum;
+}
+
+struct loop_result {
+    double rx_cycles = 0.0;         /// cycles per packet of each stage
+    double dispatch_cycles = 0.0;
+    double worker_cycles = 0.0;
+};
+
+static loop_result run_loop(const bench_config &config, bool shuffled, size_t distance) {
+    loop_result result;
+    bench_ring ring(shuffled);
+    std::vector<uint8_t> flush_area(config.flush_size, 0);
+    std::vector<Buffer*> worker_queue(kRingSize);
+    size_t rx_tsc = 0, dispatch_tsc = 0, worker_tsc = 0;
+    volatile uint64_t sink = 0;
+
+    for (size_t pass = 0; pass < config.nb_passes; pass++) {
+        /// the NIC wrote new packets, nothing of the ring is cached
+        flush_caches(flush_area);
+        size_t start = rdtsc();
+        rx_stage(ring, distance);
+        size_t rx_end = rdtsc();
+        sink += dispatch_stage(ring, distance, worker_queue.data());
+        size_t dispatch_end = rdtsc();
+        rx_tsc += rx_end - start;
+        dispatch_tsc += dispatch_end - rx_end;
+
+        /// the worker runs on another core, whose caches hold neither the descriptors nor the packets
+        flush_caches(flush_area);
+        start = rdtsc();
+        sink += worker_stage(worker_queue.data(), distance);
+        worker_tsc += rdtsc() - start;
+    }
+    _unused(sink);
+    const double nb_pkts = static_cast<double>(config.nb_passes * kRingSize);
+    result.rx_cycles = rx_tsc / nb_pkts;
+    result.dispatch_cycles = dispatch_tsc / nb_pkts;
+    result.worker_cycles = worker_tsc / nb_pkts;
+    return result;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-p passes] [-f flush_mb] [-c cpu] [-o output.json]\n"
+        "  -p  passes over the ring per run (default 200)\n"
+        "  -f  memory walked to flush the caches before each pass, in MB (default 64)\n"
+        "  -c  cpu to pin to (default: unpinned)\n"
+        "  -o  write the JSON results to a file instead of stdout\n", prog);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    bench_config config;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:f:c:o:h")) != -1) {
+        switch (opt) {
+        case 'p': config.nb_passes = strtoul(optarg, nullptr, 10); break;
+        case 'f': config.flush_size = MB(strtoul(optarg, nullptr, 10)); break;
+        case 'c': config.cpu = atoi(optarg); break;
+        case 'o': config.output = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config.nb_passes == 0 || config.flush_size == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (config.cpu >= 0) pin_self(config.cpu);
+
+    FILE *out = stdout;
+    if (config.output != nullptr && (out = fopen(config.output, "w")) == nullptr) {
+        NICC_ERROR("failed to open %s: %s", config.output, strerror(errno));
+        return 1;
+    }
+
+    const double freq_ghz = measure_rdtsc_freq();
+    bench_json json(out);
+
+    json.begin_object();
+    json.begin_object("config");
+    json.field_f64("tsc_freq_ghz", freq_ghz);
+    json.field_u64("ring_size", kRingSize);
+    json.field_u64("passes", config.nb_passes);
+    json.field_u64("flush_mb", config.flush_size / MB(1));
+    json.end_object();
+
+    json.begin_array("loops");
+    for (bool shuffled : { false, true }) {
+        double baseline = 0.0;
+        for (size_t distance : kDistances) {
+            loop_result result = run_loop(config, shuffled, distance);
+            double total = result.rx_cycles + result.dispatch_cycles + result.worker_cycles;
+            if (distance == 0) baseline = total;
+            json.begin_object();
+            json.field_str("layout", shuffled ? "shuffled" : "sequential");
+            json.field_u64("prefetch_distance", distance);
+            json.field_f64("rx_cycles_per_pkt", result.rx_cycles);
+            json.field_f64("dispatch_cycles_per_pkt", result.dispatch_cycles);
+            json.field_f64("worker_cycles_per_pkt", result.worker_cycles);
+            json.field_f64("total_cycles_per_pkt", total);
+            json.field_f64("speedup", baseline / total);
+            json.end_object();
+        }
+    }
+    json.end_array();
+    json.end_object();
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
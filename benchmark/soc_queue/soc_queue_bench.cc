@@ -0,0 +1,763 @@
+/**
+ * \brief Microbenchmark of the SHM queues used between the SoC dispatcher and workers
+ *        (lib/common/soc_shm_queue.h), reporting
+ *          - single-item and burst throughput of the SPSC and MPSC queues
+ *          - round-trip latency percentiles for same-core, SMT-sibling and cross-core pairs
+ *          - wake-up latency through the futex doorbell
+ *          - behaviour of the MPSC queue and the work-stealing deque under contention
+ *          - a check that the MPSC queue never reports full under producer contention while
+ *            it has room, which fails the benchmark
+ *        Results are printed as JSON, see benchmark.md for the usage
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "log.h"
+#include "common/timer.h"
+#include "common/soc_shm_queue.h"
+
+using namespace nicc;
+
+namespace {
+
+/**
+ * ----------------------Configuration----------------------
+ */
+struct bench_config {
+    size_t nb_items = 4 * 1000 * 1000;  /// items moved per throughput run
+    size_t nb_rtt_samples = 100000;     /// round trips per latency run
+    size_t nb_doorbell_samples = 10000; /// wake-ups per doorbell run
+    size_t max_threads = 4;             /// maximum producers / thieves in contention runs
+    std::vector<int> cpus;              /// cpus the benchmark may use
+    const char *output = nullptr;       /// output file, stdout if unset
+};
+
+/// Size of the bursts, matching SoCWrapper::kQueueBurstSize
+static constexpr size_t kBurstSize = 32;
+/// Number of items the owner keeps in its deque, matching SoCWrapper::kWsDequeWindow
+static constexpr size_t kWsDequeWindow = 4 * kBurstSize;
+/// Round trips discarded before the latency is sampled
+static constexpr size_t kRttWarmupNum = 1000;
+/// Time the pinger lets the ponger fall asleep in the doorbell run
+static constexpr size_t kDoorbellIdleUs = 50;
+
+/**
+ * ----------------------JSON output----------------------
+ */
+class bench_json {
+ public:
+    explicit bench_json(FILE *out) : _out(out) {}
+
+    void begin_object(const char *key = nullptr) { this->__open(key, '{'); }
+    void end_object() { this->__close('}'); }
+    void begin_array(const char *key = nullptr) { this->__open(key, '['); }
+    void end_array() { this->__close(']'); }
+
+    void field_u64(const char *key, uint64_t value) {
+        this->__key(key);
+        fprintf(_out, "%lu", value);
+    }
+    void field_f64(const char *key, double value) {
+        this->__key(key);
+        fprintf(_out, "%.3f", value);
+    }
+    void field_str(const char *key, const char *value) {
+        this->__key(key);
+        fprintf(_out, "\"%s\"", value);
+    }
+    void field_cpus(const char *key, const std::vector<int> &cpus) {
+        this->begin_array(key);
+        for (int cpu : cpus) this->field_u64(nullptr, cpu);
+        this->end_array();
+    }
+
+ private:
+    void __key(const char *key) {
+        if (!_first.empty()) {
+            if (!_first.back()) fputc(',', _out);
+            _first.back() = false;
+            fprintf(_out, "\n%*s", static_cast<int>(2 * _first.size()), "");
+        }
+        if (key != nullptr) fprintf(_out, "\"%s\": ", key);
+    }
+    void __open(const char *key, char c) {
+        this->__key(key);
+        fputc(c, _out);
+        _first.push_back(true);
+    }
+    void __close(char c) {
+        bool empty = _first.back();
+        _first.pop_back();
+        if (!empty) fprintf(_out, "\n%*s", static_cast<int>(2 * _first.size()), "");
+        fputc(c, _out);
+        if (_first.empty()) fputc('\n', _out);
+    }
+
+    FILE *_out;
+    std::vector<bool> _first;
+};
+
+/**
+ * ----------------------Threads and topology----------------------
+ */
+static bool pin_self(int cpu) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+        NICC_WARN("failed to pin the thread to cpu %d", cpu);
+        return false;
+    }
+    return true;
+}
+
+/// Spin politely, and give up the cpu when the peer thread runs on the same cpu
+static inline void bench_relax(bool shared_cpu) {
+    if (shared_cpu) {
+        sched_yield();
+    } else {
+        cpu_relax();
+    }
+}
+
+/// Parse a cpu list such as "0-3,8,10-11"
+static std::vector<int> parse_cpu_list(const char *list) {
+    std::vector<int> cpus;
+    const char *c = list;
+    while (*c != '\0') {
+        char *end;
+        long first = strtol(c, &end, 10), last;
+        if (end == c) break;
+        last = first;
+        if (*end == '-') {
+            c = end + 1;
+            last = strtol(c, &end, 10);
+        }
+        for (long cpu = first; cpu <= last; cpu++) cpus.push_back(static_cast<int>(cpu));
+        c = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0') break;
+    }
+    return cpus;
+}
+
+static std::vector<int> get_allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuset) != 0) {
+        cpus.push_back(0);
+        return cpus;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpuset)) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static std::vector<int> get_smt_siblings(int cpu) {
+    char path[128], list[256] = { 0 };
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    FILE *file = fopen(path, "r");
+    if (file == nullptr) return std::vector<int>(1, cpu);
+    if (fgets(list, sizeof(list), file) == nullptr) list[0] = '\0';
+    fclose(file);
+    std::vector<int> siblings = parse_cpu_list(list);
+    if (siblings.empty()) siblings.push_back(cpu);
+    return siblings;
+}
+
+/**
+ * \brief cpu pairs of each placement, a pair of -1 means not available on this box
+ */
+struct bench_topology {
+    std::pair<int, int> same_core = { -1, -1 };
+    std::pair<int, int> smt_sibling = { -1, -1 };
+    std::pair<int, int> cross_core = { -1, -1 };
+
+    explicit bench_topology(const std::vector<int> &cpus) {
+        same_core = { cpus[0], cpus[0] };
+        for (int cpu : cpus) {
+            std::vector<int> siblings = get_smt_siblings(cpu);
+            for (int other : cpus) {
+                if (other == cpu) continue;
+                bool is_sibling = std::find(siblings.begin(), siblings.end(), other) != siblings.end();
+                if (is_sibling && smt_sibling.first < 0) smt_sibling = { cpu, other };
+                if (!is_sibling && cross_core.first < 0) cross_core = { cpu, other };
+            }
+        }
+    }
+
+    /// The best pair for throughput runs: separate cores, then SMT siblings, then one cpu
+    std::pair<int, int> get_throughput_pair() const {
+        if (cross_core.first >= 0) return cross_core;
+        if (smt_sibling.first >= 0) return smt_sibling;
+        return same_core;
+    }
+};
+
+/**
+ * \brief start all benchmark threads at once
+ */
+struct bench_barrier {
+    std::atomic<size_t> nb_ready{0};
+    std::atomic<bool> start{false};
+
+    void wait(bool shared_cpu) {
+        nb_ready.fetch_add(1, std::memory_order_acq_rel);
+        while (!start.load(std::memory_order_acquire)) bench_relax(shared_cpu);
+    }
+    void release(size_t nb_threads, bool shared_cpu) {
+        while (nb_ready.load(std::memory_order_acquire) < nb_threads) bench_relax(shared_cpu);
+        start.store(true, std::memory_order_release);
+    }
+};
+
+static inline uint8_t* to_item(uint64_t value) {
+    return reinterpret_cast<uint8_t*>(static_cast<uintptr_t>(value));
+}
+static inline uint64_t from_item(uint8_t *item) {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(item));
+}
+
+/**
+ * ----------------------Throughput----------------------
+ */
+struct throughput_result {
+    double seconds = 0.0;
+    size_t nb_items = 0;
+    size_t nb_producer_stalls = 0;  /// enqueues that moved fewer items than requested
+    size_t nb_consumer_polls = 0;   /// dequeues that found the queue empty
+    size_t nb_errors = 0;           /// items out of order, lost or duplicated
+    size_t nb_stolen = 0;           /// ws deque only
+};
+
+static void report_throughput(bench_json &json, const char *queue, size_t burst, size_t nb_producers,
+                              const std::vector<int> &cpus, const throughput_result &result) {
+    json.begin_object();
+    json.field_str("queue", queue);
+    json.field_u64("burst", burst);
+    json.field_u64("producers", nb_producers);
+    json.field_cpus("cpus", cpus);
+    json.field_u64("items", result.nb_items);
+    json.field_f64("mops", result.nb_items / result.seconds / 1e6);
+    json.field_f64("ns_per_item", result.seconds * 1e9 / result.nb_items);
+    json.field_u64("producer_stalls", result.nb_producer_stalls);
+    json.field_u64("consumer_empty_polls", result.nb_consumer_polls);
+    json.field_u64("errors", result.nb_errors);
+    json.end_object();
+}
+
+static throughput_result run_spsc_throughput(size_t nb_items, size_t burst, std::pair<int, int> pair) {
+    throughput_result result;
+    soc_shm_lock_free_queue *queue = new soc_shm_lock_free_queue();
+    bench_barrier barrier;
+    const bool shared_cpu = pair.first == pair.second;
+
+    std::thread producer([&]() {
+        uint8_t *items[kBurstSize];
+        uint64_t next = 1;
+        pin_self(pair.first);
+        barrier.wait(shared_cpu);
+        while (next <= nb_items) {
+            size_t n = std::min<size_t>(burst, nb_items - next + 1), nb_enqueue;
+            for (size_t i = 0; i < n; i++) items[i] = to_item(next + i);
+            nb_enqueue = (burst == 1) ? queue->enqueue(items[0]) : queue->enqueue_burst(items, n);
+            if (nb_enqueue < n) {
+                result.nb_producer_stalls++;
+                bench_relax(shared_cpu);
+            }
+            next += nb_enqueue;
+        }
+    });
+
+    pin_self(pair.second);
+    uint8_t *items[kBurstSize];
+    uint64_t expected = 1;
+    barrier.release(1, shared_cpu);
+    ChronoTimer timer;
+    while (expected <= nb_items) {
+        size_t nb_dequeue;
+        if (burst == 1) {
+            items[0] = queue->dequeue();
+            nb_dequeue = items[0] != nullptr;
+        } else {
+            nb_dequeue = queue->dequeue_burst(items, burst);
+        }
+        if (nb_dequeue == 0) {
+            result.nb_consumer_polls++;
+            bench_relax(shared_cpu);
+            continue;
+        }
+        for (size_t i = 0; i < nb_dequeue; i++) {
+            if (from_item(items[i]) != expected + i) result.nb_errors++;
+        }
+        expected += nb_dequeue;
+    }
+    result.seconds = timer.get_sec();
+    result.nb_items = nb_items;
+    producer.join();
+    delete queue;
+    return result;
+}
+
+static throughput_result run_mpsc_throughput(size_t nb_items, size_t burst, size_t nb_producers,
+                                             const std::vector<int> &cpus) {
+    throughput_result result;
+    soc_shm_mpsc_queue *queue = new soc_shm_mpsc_queue();
+    bench_barrier barrier;
+    const bool shared_cpu = std::set<int>(cpus.begin(), cpus.end()).size() < cpus.size();
+    const size_t nb_items_per_producer = nb_items / nb_producers;
+    std::vector<size_t> nb_stalls(nb_producers, 0);
+    std::vector<std::thread> producers;
+
+    // items carry the producer id in the upper bits, each producer's items must arrive in order
+    for (size_t p = 0; p < nb_producers; p++) {
+        producers.emplace_back([&, p]() {
+            uint8_t *items[kBurstSize];
+            uint64_t next = 1;
+            pin_self(cpus[p + 1]);
+            barrier.wait(shared_cpu);
+            while (next <= nb_items_per_producer) {
+                size_t n = std::min<size_t>(burst, nb_items_per_producer - next + 1), nb_enqueue;
+                for (size_t i = 0; i < n; i++) items[i] = to_item(((p + 1) << 40) | (next + i));
+                nb_enqueue = queue->enqueue_burst(items, n);
+                if (nb_enqueue < n) {
+                    nb_stalls[p]++;
+                    bench_relax(shared_cpu);
+                }
+                next += nb_enqueue;
+            }
+        });
+    }
+
+    pin_self(cpus[0]);
+    uint8_t *items[kBurstSize];
+    std::vector<uint64_t> expected(nb_producers, 1);
+    size_t nb_received = 0;
+    barrier.release(nb_producers, shared_cpu);
+    ChronoTimer timer;
+    while (nb_received < nb_items_per_producer * nb_producers) {
+        size_t nb_dequeue = queue->dequeue_burst(items, burst);
+        if (nb_dequeue == 0) {
+            result.nb_consumer_polls++;
+            bench_relax(shared_cpu);
+            continue;
+        }
+        for (size_t i = 0; i < nb_dequeue; i++) {
+            uint64_t value = from_item(items[i]);
+            size_t p = (value >> 40) - 1;
+            if (p >= nb_producers || (value & ((1ULL << 40) - 1)) != expected[p]) {
+                result.nb_errors++;
+                continue;
+            }
+            expected[p]++;
+        }
+        nb_received += nb_dequeue;
+    }
+    result.seconds = timer.get_sec();
+    result.nb_items = nb_received;
+    for (std::thread &producer : producers) producer.join();
+    for (size_t nb_stall : nb_stalls) result.nb_producer_stalls += nb_stall;
+    delete queue;
+    return result;
+}
+
+/**
+ * \brief producers keep at most half of the MPSC queue in flight between them, so the queue
+ *        is never full and every enqueue that moves nothing is a false full report
+ * \return the number of false full reports
+ */
+static size_t run_mpsc_false_full_check(size_t nb_items, size_t nb_producers, const std::vector<int> &cpus) {
+    soc_shm_mpsc_queue *queue = new soc_shm_mpsc_queue();
+    bench_barrier barrier;
+    const bool shared_cpu = std::set<int>(cpus.begin(), cpus.end()).size() < cpus.size();
+    const size_t nb_items_per_producer = nb_items / nb_producers;
+    const size_t window = std::max<size_t>(1, soc_shm_mpsc_queue::kCapacity / 2 / nb_producers);
+    std::unique_ptr<std::atomic<size_t>[]> nb_consumed(new std::atomic<size_t>[nb_producers]);
+    std::atomic<size_t> nb_false_full{0};
+    std::vector<std::thread> producers;
+
+    for (size_t p = 0; p < nb_producers; p++) nb_consumed[p].store(0, std::memory_order_relaxed);
+    for (size_t p = 0; p < nb_producers; p++) {
+        producers.emplace_back([&, p]() {
+            uint8_t *items[kBurstSize];
+            size_t nb_sent = 0;
+            pin_self(cpus[p + 1]);
+            barrier.wait(shared_cpu);
+            while (nb_sent < nb_items_per_producer) {
+                size_t room = window - (nb_sent - nb_consumed[p].load(std::memory_order_acquire));
+                size_t n = std::min<size_t>({ kBurstSize, room, nb_items_per_producer - nb_sent });
+                if (n == 0) {
+                    bench_relax(shared_cpu);
+                    continue;
+                }
+                for (size_t i = 0; i < n; i++) items[i] = to_item(p);
+                size_t nb_enqueue = queue->enqueue_burst(items, n);
+                if (nb_enqueue == 0) nb_false_full.fetch_add(1, std::memory_order_relaxed);
+                nb_sent += nb_enqueue;
+            }
+        });
+    }
+
+    pin_self(cpus[0]);
+    uint8_t *items[kBurstSize];
+    std::vector<size_t> expected(nb_producers, 0);
+    size_t nb_received = 0;
+    barrier.release(nb_producers, shared_cpu);
+    while (nb_received < nb_items_per_producer * nb_producers) {
+        size_t nb_dequeue = queue->dequeue_burst(items, kBurstSize);
+        if (nb_dequeue == 0) {
+            bench_relax(shared_cpu);
+            continue;
+        }
+        for (size_t i = 0; i < nb_dequeue; i++) {
+            size_t p = from_item(items[i]);
+            nb_consumed[p].store(++expected[p], std::memory_order_release);
+        }
+        nb_received += nb_dequeue;
+    }
+    for (std::thread &producer : producers) producer.join();
+    delete queue;
+    return nb_false_full.load(std::memory_order_relaxed);
+}
+
+/**
+ * \brief the owner refills its deque up to kWsDequeWindow and pops bursts, exactly like a
+ *        SoCWrapper worker, while nb_thieves siblings steal from it
+ */
+static throughput_result run_ws_deque_throughput(size_t nb_items, size_t nb_thieves, const std::vector<int> &cpus) {
+    throughput_result result;
+    soc_shm_ws_deque *deque = new soc_shm_ws_deque();
+    bench_barrier barrier;
+    const bool shared_cpu = std::set<int>(cpus.begin(), cpus.end()).size() < cpus.size();
+    std::atomic<size_t> nb_consumed{0};
+    std::atomic<uint64_t> sum_consumed{0};
+    std::vector<size_t> nb_stolen(nb_thieves, 0), nb_polls(nb_thieves, 0);
+    std::vector<std::thread> thieves;
+
+    for (size_t k = 0; k < nb_thieves; k++) {
+        thieves.emplace_back([&, k]() {
+            uint8_t *items[kBurstSize];
+            pin_self(cpus[k + 1]);
+            barrier.wait(shared_cpu);
+            while (nb_consumed.load(std::memory_order_relaxed) < nb_items) {
+                size_t n = deque->steal_burst(items, kBurstSize);
+                if (n == 0) {
+                    nb_polls[k]++;
+                    bench_relax(shared_cpu);
+                    continue;
+                }
+                uint64_t sum = 0;
+                for (size_t i = 0; i < n; i++) sum += from_item(items[i]);
+                sum_consumed.fetch_add(sum, std::memory_order_relaxed);
+                nb_consumed.fetch_add(n, std::memory_order_relaxed);
+                nb_stolen[k] += n;
+            }
+        });
+    }
+
+    pin_self(cpus[0]);
+    uint8_t *items[kBurstSize];
+    uint64_t next = 1;
+    barrier.release(nb_thieves, shared_cpu);
+    ChronoTimer timer;
+    while (nb_consumed.load(std::memory_order_relaxed) < nb_items) {
+        if (next <= nb_items && deque->get_size() < kWsDequeWindow) {
+            size_t n = std::min<size_t>(kBurstSize, nb_items - next + 1);
+            for (size_t i = 0; i < n; i++) items[i] = to_item(next + i);
+            next += deque->push_burst(items, n);
+        }
+        size_t n = deque->pop_burst(items, kBurstSize);
+        if (n == 0) {
+            result.nb_consumer_polls++;
+            bench_relax(shared_cpu);
+            continue;
+        }
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++) sum += from_item(items[i]);
+        sum_consumed.fetch_add(sum, std::memory_order_relaxed);
+        nb_consumed.fetch_add(n, std::memory_order_relaxed);
+    }
+    result.seconds = timer.get_sec();
+    for (std::thread &thief : thieves) thief.join();
+
+    result.nb_items = nb_consumed.load();
+    if (result.nb_items != nb_items) result.nb_errors++;
+    if (sum_consumed.load() != static_cast<uint64_t>(nb_items) * (nb_items + 1) / 2) result.nb_errors++;
+    for (size_t k = 0; k < nb_thieves; k++) {
+        result.nb_stolen += nb_stolen[k];
+        result.nb_producer_stalls += nb_polls[k];
+    }
+    delete deque;
+    return result;
+}
+
+/**
+ * ----------------------Latency----------------------
+ */
+/// fields of a latency run, the caller opens and closes the JSON object
+static void report_latency(bench_json &json, const char *queue, const char *placement,
+                           std::pair<int, int> pair, std::vector<uint64_t> &samples, double freq_ghz) {
+    json.field_str("queue", queue);
+    json.field_str("placement", placement);
+    if (pair.first < 0) {
+        json.field_str("skipped", "no such cpu pair among the allowed cpus");
+        return;
+    }
+    json.field_cpus("cpus", std::vector<int>{ pair.first, pair.second });
+    json.field_u64("samples", samples.size());
+    if (!samples.empty()) {
+        std::sort(samples.begin(), samples.end());
+        uint64_t sum = 0;
+        for (uint64_t sample : samples) sum += sample;
+        auto percentile = [&](double p) {
+            return to_nsec(samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))], freq_ghz);
+        };
+        json.field_f64("mean_ns", to_nsec(sum / samples.size(), freq_ghz));
+        json.field_f64("min_ns", to_nsec(samples.front(), freq_ghz));
+        json.field_f64("p50_ns", percentile(0.50));
+        json.field_f64("p90_ns", percentile(0.90));
+        json.field_f64("p99_ns", percentile(0.99));
+        json.field_f64("p999_ns", percentile(0.999));
+        json.field_f64("max_ns", to_nsec(samples.back(), freq_ghz));
+    }
+}
+
+/**
+ * \brief ping-pong a single item over a pair of SPSC queues, one round trip per sample
+ */
+static std::vector<uint64_t> run_spsc_rtt(size_t nb_samples, std::pair<int, int> pair) {
+    std::vector<uint64_t> samples;
+    soc_shm_lock_free_queue *ping_queue = new soc_shm_lock_free_queue();
+    soc_shm_lock_free_queue *pong_queue = new soc_shm_lock_free_queue();
+    bench_barrier barrier;
+    const bool shared_cpu = pair.first == pair.second;
+    const size_t nb_rounds = kRttWarmupNum + nb_samples;
+
+    std::thread ponger([&]() {
+        pin_self(pair.second);
+        barrier.wait(shared_cpu);
+        for (size_t i = 0; i < nb_rounds; i++) {
+            uint8_t *item;
+            while ((item = ping_queue->dequeue()) == nullptr) bench_relax(shared_cpu);
+            while (!pong_queue->enqueue(item)) bench_relax(shared_cpu);
+        }
+    });
+
+    pin_self(pair.first);
+    samples.reserve(nb_samples);
+    barrier.release(1, shared_cpu);
+    for (size_t i = 0; i < nb_rounds; i++) {
+        size_t start = rdtsc();
+        while (!ping_queue->enqueue(to_item(i + 1))) bench_relax(shared_cpu);
+        while (pong_queue->dequeue() == nullptr) bench_relax(shared_cpu);
+        if (i >= kRttWarmupNum) samples.push_back(rdtsc() - start);
+    }
+    ponger.join();
+    delete ping_queue;
+    delete pong_queue;
+    return samples;
+}
+
+/**
+ * \brief the ponger sleeps on the doorbell of its queue between items, each sample is the
+ *        round trip of an item that had to wake it up
+ */
+static std::vector<uint64_t> run_doorbell_rtt(size_t nb_samples, std::pair<int, int> pair,
+                                              size_t *nb_doorbell_wakes) {
+    std::vector<uint64_t> samples;
+    soc_shm_lock_free_queue *ping_queue = new soc_shm_lock_free_queue();
+    soc_shm_lock_free_queue *pong_queue = new soc_shm_lock_free_queue();
+    bench_barrier barrier;
+    const bool shared_cpu = pair.first == pair.second;
+    const size_t nb_rounds = kRttWarmupNum / 10 + nb_samples;
+    *nb_doorbell_wakes = 0;
+
+    std::thread ponger([&]() {
+        pin_self(pair.second);
+        barrier.wait(shared_cpu);
+        for (size_t i = 0; i < nb_rounds; i++) {
+            uint8_t *item;
+            while ((item = ping_queue->dequeue()) == nullptr) {
+                uint32_t seq = ping_queue->doorbell_.prepare_wait();
+                if (!ping_queue->is_empty()) {
+                    ping_queue->doorbell_.cancel_wait();
+                    continue;
+                }
+                if (ping_queue->doorbell_.commit_wait(seq, 1000 * 1000)) (*nb_doorbell_wakes)++;
+            }
+            while (!pong_queue->enqueue(item)) bench_relax(shared_cpu);
+        }
+    });
+
+    pin_self(pair.first);
+    samples.reserve(nb_samples);
+    barrier.release(1, shared_cpu);
+    for (size_t i = 0; i < nb_rounds; i++) {
+        struct timespec ts = { 0, static_cast<long>(kDoorbellIdleUs * 1000) };
+        nanosleep(&ts, nullptr);
+        size_t start = rdtsc();
+        while (!ping_queue->enqueue(to_item(i + 1))) bench_relax(shared_cpu);
+        ping_queue->doorbell_.ring();
+        while (pong_queue->dequeue() == nullptr) bench_relax(shared_cpu);
+        if (i >= kRttWarmupNum / 10) samples.push_back(rdtsc() - start);
+    }
+    ponger.join();
+    delete ping_queue;
+    delete pong_queue;
+    return samples;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-n items] [-s rtt_samples] [-d doorbell_samples] [-t max_threads] [-c cpu_list] [-o output.json]\n"
+        "  -n  items moved per throughput run (default 4000000)\n"
+        "  -s  round trips sampled per latency run (default 100000)\n"
+        "  -d  wake-ups sampled in the doorbell run (default 10000)\n"
+        "  -t  maximum producers / thieves in the contention runs (default 4)\n"
+        "  -c  cpus to use, e.g. 0-3,8 (default: the affinity of the process)\n"
+        "  -o  write the JSON results to a file instead of stdout\n", prog);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    bench_config config;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:d:t:c:o:h")) != -1) {
+        switch (opt) {
+        case 'n': config.nb_items = strtoul(optarg, nullptr, 10); break;
+        case 's': config.nb_rtt_samples = strtoul(optarg, nullptr, 10); break;
+        case 'd': config.nb_doorbell_samples = strtoul(optarg, nullptr, 10); break;
+        case 't': config.max_threads = strtoul(optarg, nullptr, 10); break;
+        case 'c': config.cpus = parse_cpu_list(optarg); break;
+        case 'o': config.output = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config.cpus.empty()) config.cpus = get_allowed_cpus();
+    if (config.cpus.empty() || config.nb_items == 0 || config.max_threads == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (config.output != nullptr && (out = fopen(config.output, "w")) == nullptr) {
+        NICC_ERROR("failed to open %s: %s", config.output, strerror(errno));
+        return 1;
+    }
+
+    const double freq_ghz = measure_rdtsc_freq();
+    const bench_topology topology(config.cpus);
+    const std::pair<int, int> pair = topology.get_throughput_pair();
+    const std::vector<int> pair_cpus = { pair.second, pair.first };   // consumer first
+    bench_json json(out);
+
+    /// cpus of a run with one consumer and nb_peers other threads, wrapping around when short of cpus
+    auto get_run_cpus = [&](size_t nb_peers) {
+        std::vector<int> cpus;
+        for (size_t i = 0; i <= nb_peers; i++) cpus.push_back(config.cpus[i % config.cpus.size()]);
+        return cpus;
+    };
+
+    json.begin_object();
+    json.begin_object("host");
+    json.field_u64("nb_cpus", std::thread::hardware_concurrency());
+    json.field_cpus("allowed_cpus", config.cpus);
+    json.field_f64("tsc_freq_ghz", freq_ghz);
+    json.field_u64("queue_capacity", kWsQueueSize);
+    json.end_object();
+
+    json.begin_object("config");
+    json.field_u64("items", config.nb_items);
+    json.field_u64("rtt_samples", config.nb_rtt_samples);
+    json.field_u64("doorbell_samples", config.nb_doorbell_samples);
+    json.field_u64("max_threads", config.max_threads);
+    json.end_object();
+
+    json.begin_array("throughput");
+    for (size_t burst : { static_cast<size_t>(1), static_cast<size_t>(8), kBurstSize }) {
+        report_throughput(json, "spsc", burst, 1, pair_cpus, run_spsc_throughput(config.nb_items, burst, pair));
+    }
+    for (size_t burst : { static_cast<size_t>(1), static_cast<size_t>(8), kBurstSize }) {
+        report_throughput(json, "mpsc", burst, 1, pair_cpus, run_mpsc_throughput(config.nb_items, burst, 1, pair_cpus));
+    }
+    json.end_array();
+
+    json.begin_array("latency");
+    for (const auto &placement : { std::make_pair("same_core", topology.same_core),
+                                   std::make_pair("smt_sibling", topology.smt_sibling),
+                                   std::make_pair("cross_core", topology.cross_core) }) {
+        std::vector<uint64_t> samples;
+        if (placement.second.first >= 0) samples = run_spsc_rtt(config.nb_rtt_samples, placement.second);
+        json.begin_object();
+        report_latency(json, "spsc", placement.first, placement.second, samples, freq_ghz);
+        json.end_object();
+    }
+    {
+        size_t nb_doorbell_wakes = 0;
+        std::vector<uint64_t> samples = run_doorbell_rtt(config.nb_doorbell_samples, pair, &nb_doorbell_wakes);
+        json.begin_object();
+        report_latency(json, "spsc_doorbell", pair == topology.same_core ? "same_core"
+                                            : (pair == topology.smt_sibling ? "smt_sibling" : "cross_core"),
+                       pair, samples, freq_ghz);
+        json.field_u64("doorbell_wakes", nb_doorbell_wakes);
+        json.end_object();
+    }
+    json.end_array();
+
+    json.begin_array("contention");
+    for (size_t nb_producers = 1; nb_producers <= config.max_threads; nb_producers *= 2) {
+        std::vector<int> cpus = get_run_cpus(nb_producers);
+        report_throughput(json, "mpsc", kBurstSize, nb_producers, cpus,
+                          run_mpsc_throughput(config.nb_items, kBurstSize, nb_producers, cpus));
+    }
+    size_t nb_false_full = 0;
+    for (size_t nb_producers = 2; nb_producers <= std::max<size_t>(2, config.max_threads); nb_producers *= 2) {
+        std::vector<int> cpus = get_run_cpus(nb_producers);
+        size_t nb_run_false_full = run_mpsc_false_full_check(config.nb_items, nb_producers, cpus);
+        json.begin_object();
+        json.field_str("queue", "mpsc_false_full_check");
+        json.field_u64("producers", nb_producers);
+        json.field_cpus("cpus", cpus);
+        json.field_u64("false_full", nb_run_false_full);
+        json.end_object();
+        nb_false_full += nb_run_false_full;
+    }
+    for (size_t nb_thieves = 0; nb_thieves <= config.max_threads; nb_thieves = nb_thieves ? nb_thieves * 2 : 1) {
+        std::vector<int> cpus = get_run_cpus(nb_thieves);
+        throughput_result result = run_ws_deque_throughput(config.nb_items, nb_thieves, cpus);
+        json.begin_object();
+        json.field_str("queue", "ws_deque");
+        json.field_u64("thieves", nb_thieves);
+        json.field_cpus("cpus", cpus);
+        json.field_u64("items", result.nb_items);
+        json.field_f64("mops", result.nb_items / result.seconds / 1e6);
+        json.field_f64("stolen_ratio", static_cast<double>(result.nb_stolen) / result.nb_items);
+        json.field_u64("owner_empty_polls", result.nb_consumer_polls);
+        json.field_u64("thief_empty_polls", result.nb_producer_stalls);
+        json.field_u64("errors", result.nb_errors);
+        json.end_object();
+    }
+    json.end_array();
+    json.end_object();
+
+    if (out != stdout) fclose(out);
+    if (nb_false_full > 0) {
+        NICC_ERROR("the MPSC queue reported full %lu times while it was not", nb_false_full);
+        return 1;
+    }
+    return 0;
+}
@@ -2,10 +2,12 @@
 #include "common.h"
 #include "log.h"
 #include "common/buffer.h"
+#include <atomic>
 
 // 用户定义的状态类
 struct MyAppState {
-    int message_counter;
+    // read by soc_merge_handler on the dispatcher while the worker updates it
+    std::atomic<int> message_counter;
     char processing_buffer[1024];
     double processing_time_sum;
     bool is_initialized;
@@ -22,7 +24,7 @@ extern "C" {
 nicc::user_state_info soc_init_handler() {
     // User allocates their own state here
     MyAppState* state = new MyAppState();
-    state->message_counter = 0;
+    state->message_counter.store(0, std::memory_order_relaxed);
     state->processing_time_sum = 0.0;
     state->is_initialized = true;
     
@@ -40,7 +42,7 @@ void soc_cleanup_handler(void* user_state) {
     if (user_state) {
         MyAppState* state = static_cast<MyAppState*>(user_state);
         NICC_LOG("Cleaning up MyAppState: processed %d messages, total time=%.3f", 
-                 state->message_counter, state->processing_time_sum);
+                 state->message_counter.load(std::memory_order_relaxed), state->processing_time_sum);
         delete state;
     }
 }
@@ -59,12 +61,13 @@ nicc::nicc_retval_t soc_msg_handler(nicc::Buffer* msg, void* user_state) {
         return nicc::NICC_ERROR;
     }
     
-    // Increment message counter
-    state->message_counter++;
+    // Increment message counter, only this worker writes it
+    int message_counter = state->message_counter.load(std::memory_order_relaxed) + 1;
+    state->message_counter.store(message_counter, std::memory_order_relaxed);
     
     // Process message logic (example: simple echo and modify content)
     NICC_LOG("Processing message #%d, length=%u", 
-             state->message_counter, msg->length_);
+             message_counter, msg->length_);
     
     // Do some processing in user buffer
     if (msg->length_ < sizeof(state->processing_buffer)) {
@@ -79,12 +82,51 @@ nicc::nicc_retval_t soc_msg_handler(nicc::Buffer* msg, void* user_state) {
     return nicc::NICC_SUCCESS;
 }
 
+// SoC burst message handler - processes a burst of messages (optional)
+// When defined, the wrapper calls it instead of soc_msg_handler, once per burst
+void soc_msg_burst_handler(nicc::Buffer** msgs, nicc::nicc_retval_t* retvals, uint16_t nb_msgs, void* user_state) {
+    MyAppState* state = static_cast<MyAppState*>(user_state);
+    
+    // check the state once for the whole burst
+    if (!state || !state->is_initialized) {
+        NICC_WARN("user_state not properly initialized");
+        for (uint16_t i = 0; i < nb_msgs; i++) retvals[i] = nicc::NICC_ERROR;
+        return;
+    }
+    
+    for (uint16_t i = 0; i < nb_msgs; i++) {
+        // prefetch the payload of the next message while processing this one
+        if (i + 1 < nb_msgs) __builtin_prefetch(msgs[i + 1]->get_buf());
+        
+        if (msgs[i]->length_ < sizeof(state->processing_buffer)) {
+            memcpy(state->processing_buffer, msgs[i]->get_buf(), msgs[i]->length_);
+        }
+        retvals[i] = nicc::NICC_SUCCESS;
+    }
+    
+    state->message_counter.store(state->message_counter.load(std::memory_order_relaxed) + nb_msgs,
+                                 std::memory_order_relaxed);
+    state->processing_time_sum += 0.001 * nb_msgs; // Assume processing time
+}
+
+// SoC merge handler - folds the states of all workers into a global view (optional)
+// Each worker has its own MyAppState, the handler only reads them while the workers run,
+// so it only reads their atomic fields
+void soc_merge_handler(void* const* user_states, uint16_t nb_states) {
+    long total_messages = 0;
+    for (uint16_t i = 0; i < nb_states; i++) {
+        const MyAppState* state = static_cast<const MyAppState*>(user_states[i]);
+        total_messages += state->message_counter.load(std::memory_order_relaxed);
+    }
+    NICC_LOG("SoC kernel merged %u worker states: processed %ld messages", nb_states, total_messages);
+}
+
 // SoC packet handler - processes packets (optional)
 nicc::nicc_retval_t soc_pkt_handler(nicc::Buffer* pkt, void* user_state) {
     if (!user_state) return nicc::NICC_ERROR;
     
     MyAppState* state = static_cast<MyAppState*>(user_state);
-    NICC_LOG("Processing packet, total messages so far: %d", state->message_counter);
+    NICC_LOG("Processing packet, total messages so far: %d", state->message_counter.load(std::memory_order_relaxed));
     return nicc::NICC_SUCCESS;
 }
 
@@ -95,4 +137,6 @@ nicc::nicc_retval_t soc_pkt_handler(nicc::Buffer* pkt, void* user_state) {
 // - soc_init_handler()
 // - soc_msg_handler()
 // - soc_cleanup_handler()  
-// - soc_pkt_handler() 
\ No newline at end of file
+// - soc_pkt_handler() 
+// and may implement soc_msg_burst_handler() to handle messages in bursts, and
+// soc_merge_handler() to fold the per-worker states into a global view
\ No newline at end of file
@@ -80,6 +80,8 @@ struct user_state_info {
 #define _unused(x) ((void)(x))  // Make production build happy
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
+#define prefetch_read(x) __builtin_prefetch((x), 0, 3)
+#define prefetch_write(x) __builtin_prefetch((x), 1, 3)
 
 #define KB(x) (static_cast<size_t>(x) << 10)
 #define MB(x) (static_cast<size_t>(x) << 20)
@@ -97,7 +99,10 @@ static constexpr size_t kMaxPhyPorts = 2;
 static constexpr size_t kMaxNumaNodes = 2;
 static constexpr size_t kMaxQueuesPerPort = 1;
 static constexpr size_t kHugepageSize = (2 * 1024 * 1024);  ///< Hugepage size
+static constexpr size_t kCacheLineSize = 64;                 ///< Cache line size of both x86 and Arm (BF3) cores
 static constexpr uint8_t kSoCWorkspaceMaxNum = 16;    // max number of workspaces in SoC, including dispatcher and worker
+static constexpr uint8_t kSoCMaxTrafficClasses = 4;   // max number of traffic classes on the SoC dispatcher-to-worker path
+static constexpr uint16_t kSoCRssRetaSize = 128;      // number of buckets of the SoC dispatcher's RSS indirection table
 static constexpr uint16_t kDPAWorkspaceMaxNum = 128;    // max number of workspaces in DPA, including dispatcher and worker
 
 // return values
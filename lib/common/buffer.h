@@ -6,6 +6,33 @@
 #include <netinet/udp.h>
 
 namespace nicc {
+class RDMA_SoC_QP;
+
+/// Length of an Ethernet header without VLAN tags
+static constexpr uint16_t kEthHdrLen = 14;
+
+/// Headers of a received packet, parsed once by the SoC dispatcher so that kernels
+/// don't parse them again. Until parsed, the offsets describe an untagged IPv4/UDP packet.
+struct pkt_meta {
+  static constexpr uint8_t kPARSED = 0x1;  ///< L3/L4 headers were found, the 5-tuple is valid
+  static constexpr uint8_t kVLAN = 0x2;    ///< Packet carries one or two VLAN tags
+  static constexpr uint8_t kIPV6 = 0x4;    ///< L3 header is IPv6, otherwise IPv4
+
+  uint16_t l3_offset_ = kEthHdrLen;                                   ///< Offset of the IP header
+  uint16_t l4_offset_ = kEthHdrLen + sizeof(struct iphdr);            ///< Offset of the UDP/TCP header
+  uint16_t ws_hdr_offset_ = kEthHdrLen + sizeof(struct iphdr) + sizeof(struct udphdr);  ///< Offset of the ws header
+  uint16_t ether_type_ = 0;  ///< Ethertype after the VLAN tags, in host byte order
+  uint8_t l4_proto_ = 0;     ///< IP protocol, or IPv6 next header
+  uint8_t tos_ = 0;          ///< IPv4 TOS, or IPv6 traffic class
+  uint8_t flags_ = 0;
+  uint16_t sport_ = 0;       ///< Source port, in network byte order
+  uint16_t dport_ = 0;       ///< Destination port, in network byte order
+  uint32_t saddr_[IP6_ADDR_SIZE / 4] = {};  ///< Source address, an IPv4 one in the first word and the rest zero
+  uint32_t daddr_[IP6_ADDR_SIZE / 4] = {};  ///< Destination address, same layout as saddr_
+  uint64_t flow_hash_ = 0;   ///< Hash of the 5-tuple
+  uint64_t rx_tsc_ = 0;      ///< TSC of the poll which received the packet
+};
+
 /// A class to hold a fixed-size buffer. The size of the buffer is read-only
 /// after the Buffer is created.
 class Buffer {
@@ -50,21 +77,35 @@ class Buffer {
 
   uint8_t* get_buf() { return buf_; }
   uint8_t* get_buf_offset(size_t offset) { return buf_ + offset; }
-  uint8_t* get_ws_payload() { return buf_ + 14 + sizeof(struct iphdr) + sizeof(struct udphdr) + sizeof(struct ws_hdr);}
-  uint8_t* get_ws_hdr() { return buf_ + 14 + sizeof(struct iphdr) + sizeof(struct udphdr); }
-  uint8_t* get_uh() { return buf_ + 14 + sizeof(struct iphdr); }
-  uint8_t* get_iph() { return buf_ + 14; }
+  uint8_t* get_ws_payload() { return buf_ + meta_.ws_hdr_offset_ + sizeof(struct ws_hdr); }
+  uint8_t* get_ws_hdr() { return buf_ + meta_.ws_hdr_offset_; }
+  uint8_t* get_uh() { return buf_ + meta_.l4_offset_; }
+  uint8_t* get_iph() { return buf_ + meta_.l3_offset_; }
+  const pkt_meta& get_meta() const { return meta_; }
   
   void set_length(uint32_t length) { length_ = length; }
 
+  /// Prefetch the headers of the packet, eth/ip/udp and ws headers share the first cache line
+  void prefetch_hdrs() { prefetch_read(buf_); }
+
   /// The backing memory of this Buffer. The Buffer is invalid if this is null.
   uint8_t *buf_;
   size_t class_size_;  ///< The allocator's class size
   uint32_t lkey_;      ///< The memory registration lkey
   uint32_t length_ = 0;    ///< The length of the buffer
   /// Using for RX
-  Buffer *next_;       ///< Next Buffer
+  RDMA_SoC_QP *rx_qp_ = nullptr;  ///< RX QP whose free stack the Buffer returns to once released
   uint8_t state_ = kFREE_BUF;  /// 0: owned by nic; 1: owned by app; 2: free, waiting for post_recv
+  /// Using for multi-packet messages, the segments are chained from the first one without copy
+  Buffer *msg_next_ = nullptr;  ///< Next segment of the message
+  uint16_t msg_nb_segs_ = 1;    ///< Number of segments of the message, only valid on the first one
+  /// Using for ordered channels, tagged by the SoC dispatcher and restored on the tx collect path
+  uint32_t order_seq_ = 0;      ///< Sequence number within the flow
+  uint16_t order_flow_ = 0;     ///< Flow slot the sequence number belongs to
+  /// Using for external worker processes, so that the buffers of a crashed one are reclaimed
+  int32_t holder_pid_ = 0;      ///< Worker process holding the Buffer, 0 once back at the dispatcher
+  /// Using for RX, filled by the SoC dispatcher before the packet is handed to a worker
+  pkt_meta meta_;
 };
 
 }  // namespace nicc
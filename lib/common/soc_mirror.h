@@ -0,0 +1,130 @@
+#pragma once
+#include "common.h"
+#include "log.h"
+#include <atomic>
+#include <thread>
+
+#include "common/math_utils.h"
+#include "common/timer.h"
+
+namespace nicc {
+/// largest number of bytes of a packet copied into the mirror ring
+static constexpr uint32_t kSoCMirrorMaxSnaplen = 2048;
+/// number of records of the mirror ring, packets sampled while it is full are lost
+static constexpr size_t kSoCMirrorRingSize = 1024;
+
+/**
+ * \brief A packet copied by the sampling tap, with its original length and the TSC at which
+ * it was sampled
+ */
+struct soc_mirror_record {
+    uint64_t tsc_;
+    uint32_t orig_len_;
+    uint32_t cap_len_;
+    uint8_t data_[kSoCMirrorMaxSnaplen];
+};
+
+/**
+ * \brief A lock-free ring of copied packets between the SoC dispatcher, which samples them,
+ * and the drain thread, which writes them to a pcap file.
+ * \note   [1] the ring is single-producer/single-consumer, with the same free-running indices
+ *         and cached remote views as soc_shm_lock_free_queue, but it holds records by value,
+ *         so the packet buffers return to the datapath right away
+ *         [2] the producer never waits, a sample which finds the ring full is counted and lost
+ */
+struct soc_mirror_ring {
+    static constexpr size_t kCapacity = kSoCMirrorRingSize;
+    static constexpr size_t kMask = kSoCMirrorRingSize - 1;
+    static_assert(is_power_of_two<size_t>(kSoCMirrorRingSize), "The size of mirror ring is not power of two.");
+
+    /* ========== producer side ========== */
+    alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+    size_t cached_head_ = 0;    /// producer's view of head_
+    size_t nb_lost_ = 0;        /// samples lost as the ring was full
+    /* ========== consumer side ========== */
+    alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+    /* ========== records ========== */
+    alignas(kCacheLineSize) soc_mirror_record records_[kSoCMirrorRingSize];
+
+    public:
+    /**
+     * \brief  copy a packet into the ring (producer only)
+     * \param  pkt       the packet
+     * \param  len       length of the packet
+     * \param  snaplen   largest number of bytes copied
+     * \param  tsc       TSC of the sample
+     * \return whether the packet was copied
+     */
+    inline bool push(const uint8_t *pkt, uint32_t len, uint32_t snaplen, uint64_t tsc) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (unlikely(tail - cached_head_ == kCapacity)) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ == kCapacity) {
+                nb_lost_++;
+                return false;
+            }
+        }
+        soc_mirror_record &record = records_[tail & kMask];
+        record.tsc_ = tsc;
+        record.orig_len_ = len;
+        record.cap_len_ = len < snaplen ? len : snaplen;
+        memcpy(record.data_, pkt, record.cap_len_);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * \brief  get the oldest record, which stays valid until release (consumer only)
+     * \return the record, or nullptr if the ring is empty
+     */
+    inline const soc_mirror_record* front() {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) return nullptr;
+        return &records_[head & kMask];
+    }
+
+    /**
+     * \brief  hand the record returned by front back to the producer (consumer only)
+     */
+    inline void release() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+/**
+ * \brief Sampling tap of a SoC dispatcher, the dispatcher copies sampled packets into the ring
+ * and a low-priority drain thread writes them to a pcap file
+ */
+struct soc_mirror {
+    soc_mirror_ring ring_;
+    std::thread *drain_thread_ = nullptr;
+    std::atomic<bool> stop_{false};
+    /// set by the drain thread once a write falls short, the dispatcher stops sampling
+    std::atomic<bool> failed_{false};
+    FILE *file_ = nullptr;
+    size_t nb_written_ = 0;
+    /// wall clock of the pcap timestamps, anchored at a TSC
+    uint64_t base_tsc_ = 0;
+    uint64_t base_ns_ = 0;
+    double freq_ghz_ = 0.0;
+};
+
+/**
+ * \brief Create a sampling tap, open its pcap file and start its drain thread, which runs
+ * with the lowest scheduling priority
+ * \param path      path of the pcap file, created with mode 0600, an existing file or link
+ *                  is never overwritten
+ * \param snaplen   largest number of bytes of a packet in the file
+ * \param freq_ghz  TSC frequency, for the timestamps of the packets
+ * \return the tap, or nullptr on failure
+ */
+soc_mirror* soc_mirror_start(const char *path, uint32_t snaplen, double freq_ghz);
+
+/**
+ * \brief Stop the drain thread of a sampling tap once it has written all copied packets, and
+ * close its pcap file
+ * \param mirror    the tap, freed on return
+ */
+void soc_mirror_stop(soc_mirror *mirror);
+
+} // namespace nicc
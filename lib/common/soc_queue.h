@@ -1,67 +1,14 @@
 #pragma once
 #include "common.h"
 #include <infiniband/verbs.h>
-#include <vector>
+#include <atomic>
 
 #include "common/math_utils.h"
 #include "common/buffer.h"
 #include "common/iphdr.h"
-// #include "common/ethhdr.h"
+#include "common/soc_shm_queue.h"
 
 namespace nicc {
-#define kWsQueueSize 1024
-
-/**
- * \brief A lock-free queue for transferring buffer ownership within 
- * a component block, e.g., SoC cores in a same component block.
- * Typically, we adopt pipeline-parallelism within a component block, 
- * where each core can be an application or a dispatcher.
- * For TX direction, application is producer, and dispatcher is consumer. Application 
- * can only operate on the tail of the queue, and dispatcher can only operate
- * on the head of the queue.
- * For RX, dispatcher is producer, and application is consumer. Similarly, 
- * dispatcher can only operate on the tail of the queue, and application can
- * only operate on the head of the queue.q
- */
-struct soc_shm_lock_free_queue {
-    uint8_t* queue_[kWsQueueSize];
-    volatile size_t head_ = 0;
-    volatile size_t tail_ = 0;
-    const size_t mask_ = kWsQueueSize - 1;  // Assuming kWsQueueSize is a power of 2
-    public:
-    soc_shm_lock_free_queue() {
-        rt_assert(is_power_of_two<size_t>(kWsQueueSize), "The size of Ws Queue is not power of two.");
-        memset(queue_, 0, sizeof(queue_));
-    }
-    inline bool enqueue(uint8_t *pkt) {
-        size_t next_tail = (tail_ + 1) & mask_;
-        if (next_tail == head_) return false;
-        queue_[tail_] = pkt;
-        tail_ = next_tail;
-        return true;
-    }
-    inline uint8_t* dequeue() {
-        if (head_ == tail_) return nullptr;
-        uint8_t* ret = queue_[head_];
-        head_ = (head_ + 1) & mask_;
-        return ret;
-    }
-    inline void reset_head() {
-        head_ = 0;
-    }
-    inline void reset_tail() {
-        tail_ = 0;
-    }
-    inline size_t get_size() {
-        return (tail_ - head_) & mask_;
-    }
-    inline bool is_empty() {
-        return head_ == tail_;
-    }
-    inline bool is_full() {
-        return (((tail_ + 1) & mask_) == head_);
-    }
-};
 
 /**
  * \brief A RDMA-based SoC queue pair for transferring buffers between different component blocks.
@@ -80,14 +27,27 @@ class RDMA_SoC_QP {
     }
 
     size_t get_rx_worker_queue_size() {
-      return this->_disp_worker_queue->get_size();
+      size_t size = 0;
+      for (uint8_t w = 0; w < kSoCWorkspaceMaxNum; w++) {
+        for (uint8_t i = 0; i < kSoCMaxTrafficClasses; i++) {
+          if (this->_disp_worker_queues[w][i] != nullptr) size += this->_disp_worker_queues[w][i]->get_size();
+        }
+      }
+      return size;
     }
     size_t get_tx_worker_queue_size() {
       return this->_collect_worker_queue->get_size();
     }
 
+    /// Return a released rx buffer of this QP to its free stack, dispatcher only
+    inline void push_free_buf(Buffer *m) {
+      m->state_ = Buffer::kFREE_BUF;
+      this->_free_bufs[this->_nb_free_bufs++] = m;
+    }
+
  public:
     static constexpr size_t kNumRxRingEntries = 2048;
+    static_assert(kRecycleQueueSize >= kNumRxRingEntries, "The recycle queue can't hold every rx buffer of its QP.");
     static_assert(is_power_of_two<size_t>(kNumRxRingEntries), "The num of RX ring entries is not power of two.");
     static constexpr size_t kNumTxRingEntries = 2048;
     static_assert(is_power_of_two<size_t>(kNumTxRingEntries), "The num of TX ring entries is not power of two.");
@@ -98,6 +58,9 @@ class RDMA_SoC_QP {
 
     struct ibv_cq *_send_cq = nullptr;
     struct ibv_cq *_recv_cq = nullptr;
+    /// completion channel of the recv CQ, non-blocking, for sleeping until packets arrive
+    struct ibv_comp_channel *_recv_comp_channel = nullptr;
+    bool _recv_cq_armed = false;        /// the recv CQ requested a completion event
     struct ibv_qp *_qp = nullptr;
     size_t _qp_id = SIZE_MAX;
     size_t _remote_qp_id = SIZE_MAX;
@@ -110,6 +73,8 @@ class RDMA_SoC_QP {
     struct ibv_wc _send_wc[kNumTxRingEntries];
     size_t _send_head = 0;
     size_t _send_tail = 0;
+    size_t _nb_send_unsignaled = 0;     /// send WRs posted since the last signaled one
+    size_t _nb_send_signaled = 0;       /// signaled send WRs whose completion is not reaped yet
 
     Buffer *_sw_ring[kNumTxRingEntries];
     Buffer *_tx_queue[kNumTxRingEntries];
@@ -119,12 +84,26 @@ class RDMA_SoC_QP {
     struct ibv_sge _recv_sgl[kNumRxRingEntries];
     struct ibv_wc _recv_wc[kNumRxRingEntries];
     size_t _recv_head = 0;
+    /// rx buffer bound to each recv wr by the last post, read back in completion order
     Buffer *_rx_ring[kNumRxRingEntries];
     size_t _ring_head = 0;
+    /// released rx buffers, popped in bulk when recvs are posted; LIFO, so the buffers
+    /// posted next are likely still in cache
+    Buffer *_free_bufs[kNumRxRingEntries];
+    size_t _nb_free_bufs = 0;
+    size_t _nb_posted_recvs = 0;        /// recv wrs posted but not completed yet
 
     // idx for ownership transfer between dispatcher and worker
-    soc_shm_lock_free_queue* _collect_worker_queue = nullptr;
-    soc_shm_lock_free_queue* _disp_worker_queue = nullptr;
+    soc_shm_mpsc_queue* _collect_worker_queue = nullptr;     /// fan-in of all workers feeding this QP
+    soc_shm_recycle_queue* _recycle_worker_queue = nullptr;  /// rx buffers of this QP released by the workers
+    /// one queue per worker and traffic class, class 0 has the highest priority and carries the doorbell
+    soc_shm_lock_free_queue* _disp_worker_queues[kSoCWorkspaceMaxNum][kSoCMaxTrafficClasses] = {};
+    /// RSS indirection table of the dispatcher, flow hash bucket -> worker, reprogrammable
+    /// by the control plane while the dispatcher runs
+    std::atomic<uint16_t> _rss_reta[kSoCRssRetaSize] = {};
+    /// stealable rx deques of the workers fed by this QP, only used by unordered blocks
+    std::atomic<soc_shm_ws_deque*> _worker_ws_deques[kSoCWorkspaceMaxNum] = {};
+    std::atomic<size_t> _nb_worker_ws_deques{0};
     size_t _free_send_wr_num = kNumTxRingEntries;
     size_t _wait_for_disp = 0;
 };
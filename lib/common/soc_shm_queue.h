@@ -0,0 +1,487 @@
+#pragma once
+#include "common.h"
+#include <vector>
+#include <atomic>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "common/math_utils.h"
+#include "common/buffer.h"
+#include "common/iphdr.h"
+#include "common/timer.h"
+// #include "common/ethhdr.h"
+
+namespace nicc {
+#define kWsQueueSize 1024
+/// the rx ring of the QP towards the prior block, the only one whose buffers reach the
+/// workers, see RDMA_SoC_QP::kNumRxRingEntries
+#define kRecycleQueueSize 2048
+
+/**
+ * \brief A futex-based doorbell, letting an idle consumer of a SHM queue sleep until
+ * its producer publishes new items. Works across processes, as the futex is not private.
+ * \note   [1] the consumer announces itself in nb_waiters_ before re-checking the queue,
+ *         and the producer checks nb_waiters_ after publishing, both separated by a
+ *         seq_cst fence, so either the consumer sees the items or the producer sees
+ *         the waiter; the producer never enters the kernel when nobody sleeps
+ *         [2] ring_tsc_ records when the last wake-up was issued, for measuring the
+ *         wake-up latency on the consumer side
+ */
+struct soc_shm_doorbell {
+    alignas(kCacheLineSize) std::atomic<uint32_t> seq_{0};
+    std::atomic<uint32_t> nb_waiters_{0};
+    std::atomic<size_t> ring_tsc_{0};
+
+    public:
+    /**
+     * \brief  wake the sleeping consumer, if any (producer only, after publishing)
+     */
+    inline void ring() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (likely(nb_waiters_.load(std::memory_order_relaxed) == 0)) return;
+        ring_tsc_.store(rdtsc(), std::memory_order_relaxed);
+        seq_.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq_), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+
+    /**
+     * \brief  announce the consumer is going to sleep, the queue must be re-checked afterwards
+     * \return the sequence to pass to commit_wait
+     */
+    inline uint32_t prepare_wait() {
+        uint32_t seq = seq_.load(std::memory_order_acquire);
+        nb_waiters_.fetch_add(1, std::memory_order_seq_cst);
+        return seq;
+    }
+
+    /**
+     * \brief  withdraw from prepare_wait, as the queue turned out to be non-empty
+     */
+    inline void cancel_wait() {
+        nb_waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief  sleep until the producer rings or timeout_us expires
+     * \param  seq         the sequence returned by prepare_wait
+     * \param  timeout_us  upper bound of the sleep
+     * \return whether the consumer was woken by the producer
+     */
+    inline bool commit_wait(uint32_t seq, size_t timeout_us) {
+        struct timespec ts;
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (timeout_us % 1000000) * 1000;
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq_), FUTEX_WAIT, seq, &ts, nullptr, 0);
+        nb_waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return seq_.load(std::memory_order_acquire) != seq;
+    }
+};
+
+/**
+ * \brief A lock-free queue for transferring buffer ownership within 
+ * a component block, e.g., SoC cores in a same component block.
+ * Typically, we adopt pipeline-parallelism within a component block, 
+ * where each core can be an application or a dispatcher.
+ * For TX direction, application is producer, and dispatcher is consumer. Application 
+ * can only operate on the tail of the queue, and dispatcher can only operate
+ * on the head of the queue.
+ * For RX, dispatcher is producer, and application is consumer. Similarly, 
+ * dispatcher can only operate on the tail of the queue, and application can
+ * only operate on the head of the queue.
+ * \note   [1] the queue is single-producer/single-consumer; head and tail are free-running
+ *         counters (masked on access), published with release and observed with acquire
+ *         [2] producer and consumer indices live on separate cache lines, and each side
+ *         keeps a cached copy of the remote index, so the shared line is only touched
+ *         when the cached view says the queue is full (producer) or empty (consumer)
+ *         [3] enqueue_burst / dequeue_burst move up to n pointers per synchronization
+ *         [4] the producer rings doorbell_ after publishing, so that an idle consumer may sleep
+ *         [5] the consumer publishes in retired_ how far it has finished the dequeued items,
+ *         so that the producer knows when none of the items it enqueued is still in flight
+ */
+struct soc_shm_lock_free_queue {
+    static constexpr size_t kCapacity = kWsQueueSize;
+    static constexpr size_t kMask = kWsQueueSize - 1;
+    static_assert(is_power_of_two<size_t>(kWsQueueSize), "The size of Ws Queue is not power of two.");
+
+    /* ========== producer side ========== */
+    alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+    size_t cached_head_ = 0;    /// producer's view of head_
+    /* ========== consumer side ========== */
+    alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+    size_t cached_tail_ = 0;    /// consumer's view of tail_
+    std::atomic<size_t> retired_{0};    /// items before this position are finished by the consumer
+    /* ========== slots ========== */
+    alignas(kCacheLineSize) uint8_t* queue_[kWsQueueSize];
+    /* ========== consumer wake-up ========== */
+    soc_shm_doorbell doorbell_;
+
+    public:
+    soc_shm_lock_free_queue() {
+        memset(queue_, 0, sizeof(queue_));
+    }
+
+    /**
+     * \brief  enqueue up to n pointers (producer only)
+     * \param  pkts    pointers to be enqueued
+     * \param  n       number of pointers
+     * \return the number of pointers actually enqueued, in [0, n]
+     */
+    inline size_t enqueue_burst(uint8_t* const* pkts, size_t n) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t free_slots = kCapacity - (tail - cached_head_);
+        if (free_slots < n) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            free_slots = kCapacity - (tail - cached_head_);
+            if (free_slots == 0) return 0;
+            if (n > free_slots) n = free_slots;
+        }
+        for (size_t i = 0; i < n; i++) {
+            queue_[(tail + i) & kMask] = pkts[i];
+        }
+        tail_.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * \brief  dequeue up to n pointers (consumer only)
+     * \param  pkts    [out] array receiving the dequeued pointers
+     * \param  n       capacity of pkts
+     * \return the number of pointers actually dequeued, in [0, n]
+     */
+    inline size_t dequeue_burst(uint8_t** pkts, size_t n) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        size_t avail = cached_tail_ - head;
+        if (avail < n) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            avail = cached_tail_ - head;
+            if (avail == 0) return 0;
+            if (n > avail) n = avail;
+        }
+        for (size_t i = 0; i < n; i++) {
+            pkts[i] = queue_[(head + i) & kMask];
+        }
+        head_.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    inline bool enqueue(uint8_t *pkt) {
+        return this->enqueue_burst(&pkt, 1) == 1;
+    }
+    inline uint8_t* dequeue() {
+        uint8_t *pkt = nullptr;
+        this->dequeue_burst(&pkt, 1);
+        return pkt;
+    }
+    /**
+     * \brief  mark every dequeued item as finished (consumer only)
+     */
+    inline void retire() {
+        retired_.store(head_.load(std::memory_order_relaxed), std::memory_order_release);
+    }
+    /**
+     * \brief  whether the consumer finished every item before a position
+     * \param  pos   a position returned by get_tail
+     */
+    inline bool is_retired(size_t pos) {
+        return static_cast<ptrdiff_t>(retired_.load(std::memory_order_acquire) - pos) >= 0;
+    }
+    /// \note  the position of the next item to be enqueued, only accurate on the producer
+    inline size_t get_tail() {
+        return tail_.load(std::memory_order_relaxed);
+    }
+    /// \note  only safe while neither side is running
+    inline void reset_head() {
+        head_.store(0, std::memory_order_relaxed);
+        retired_.store(0, std::memory_order_relaxed);
+        cached_tail_ = 0;
+    }
+    /// \note  only safe while neither side is running
+    inline void reset_tail() {
+        tail_.store(0, std::memory_order_relaxed);
+        cached_head_ = 0;
+    }
+    /// \note  a snapshot, may be stale by the time it is returned when called from a third core
+    inline size_t get_size() {
+        // load head first so that the (later) tail is never behind it
+        const size_t head = head_.load(std::memory_order_acquire);
+        const size_t size = tail_.load(std::memory_order_acquire) - head;
+        return size > kCapacity ? kCapacity : size;
+    }
+    inline bool is_empty() {
+        return this->get_size() == 0;
+    }
+    inline bool is_full() {
+        return this->get_size() >= kCapacity;
+    }
+};
+
+/**
+ * \brief A lock-free multi-producer/single-consumer queue for fanning buffers of
+ * several workers into one dispatcher, i.e., the TX direction of a component block
+ * with more than one worker core.
+ * \note   [1] producers claim a run of slots with a single CAS on tail_, fill the
+ *         slots, and publish each slot by storing its sequence number (pos + 1)
+ *         [2] the consumer walks slots from head_ until it meets one that has not
+ *         been published yet, so a slow producer only delays the slots it claimed
+ *         and those behind them, and never blocks other producers
+ *         [3] head_ is released after the slots are read, producers never claim
+ *         beyond head_ + kCapacity, hence a slot is never overwritten before consumed
+ */
+template <size_t kSize>
+struct soc_shm_mpsc_queue_t {
+    static constexpr size_t kCapacity = kSize;
+    static constexpr size_t kMask = kSize - 1;
+    static_assert(is_power_of_two<size_t>(kSize), "The size of MPSC Queue is not power of two.");
+
+    struct slot_t {
+        std::atomic<size_t> seq_;   /// pos + 1 once the slot of position pos is published
+        uint8_t* pkt_;
+    };
+
+    /* ========== producers side ========== */
+    alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+    /* ========== consumer side ========== */
+    alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+    /* ========== slots ========== */
+    alignas(kCacheLineSize) slot_t queue_[kSize];
+
+    public:
+    soc_shm_mpsc_queue_t() {
+        for (size_t i = 0; i < kCapacity; i++) {
+            queue_[i].seq_.store(i, std::memory_order_relaxed);
+            queue_[i].pkt_ = nullptr;
+        }
+    }
+
+    /**
+     * \brief  enqueue up to n pointers (any producer)
+     * \param  pkts    pointers to be enqueued
+     * \param  n       number of pointers
+     * \return the number of pointers actually enqueued, in [0, n]
+     */
+    inline size_t enqueue_burst(uint8_t* const* pkts, size_t n) {
+        size_t tail = tail_.load(std::memory_order_acquire);
+        size_t nb_claim;
+        while (true) {
+            const size_t head = head_.load(std::memory_order_acquire);
+            const size_t used = tail - head;
+            if (unlikely(used > kCapacity)) {
+                // other producers moved tail and the consumer moved head past our stale
+                // view of it, the queue is not full, take a fresh tail and look again
+                tail = tail_.load(std::memory_order_acquire);
+                continue;
+            }
+            // head is loaded after tail, so a full queue seen here was full at that moment
+            if (used == kCapacity) return 0;
+            nb_claim = n > kCapacity - used ? kCapacity - used : n;
+            if (tail_.compare_exchange_weak(tail, tail + nb_claim,
+                                            std::memory_order_relaxed, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        for (size_t i = 0; i < nb_claim; i++) {
+            slot_t &slot = queue_[(tail + i) & kMask];
+            slot.pkt_ = pkts[i];
+            slot.seq_.store(tail + i + 1, std::memory_order_release);
+        }
+        return nb_claim;
+    }
+
+    /**
+     * \brief  dequeue up to n published pointers (consumer only)
+     * \param  pkts    [out] array receiving the dequeued pointers
+     * \param  n       capacity of pkts
+     * \return the number of pointers actually dequeued, in [0, n]
+     */
+    inline size_t dequeue_burst(uint8_t** pkts, size_t n) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        size_t nb_dequeue = 0;
+        for (; nb_dequeue < n; nb_dequeue++) {
+            slot_t &slot = queue_[(head + nb_dequeue) & kMask];
+            if (slot.seq_.load(std::memory_order_acquire) != head + nb_dequeue + 1) break;
+            pkts[nb_dequeue] = slot.pkt_;
+        }
+        if (nb_dequeue > 0) {
+            head_.store(head + nb_dequeue, std::memory_order_release);
+        }
+        return nb_dequeue;
+    }
+
+    inline bool enqueue(uint8_t *pkt) {
+        return this->enqueue_burst(&pkt, 1) == 1;
+    }
+    inline uint8_t* dequeue() {
+        uint8_t *pkt = nullptr;
+        this->dequeue_burst(&pkt, 1);
+        return pkt;
+    }
+    /**
+     * \brief  skip the slot at the head if it is claimed but not published, for a producer
+     *         which died between claiming and publishing it (consumer only)
+     * \note   the caller must know that the producer of the slot is gone, a live producer
+     *         publishing the slot afterwards would lose its pointer
+     * \return whether the slot was skipped
+     */
+    inline bool skip_unpublished() {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (tail_.load(std::memory_order_acquire) == head) return false;
+        if (queue_[head & kMask].seq_.load(std::memory_order_acquire) == head + 1) return false;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    /// position of the next slot to be dequeued, positions only grow (consumer only)
+    inline size_t get_head() {
+        return head_.load(std::memory_order_relaxed);
+    }
+    /// position of the next slot to be claimed, positions only grow
+    inline size_t get_tail() {
+        return tail_.load(std::memory_order_acquire);
+    }
+    /// \note  counts claimed slots, including those not yet published by their producer
+    inline size_t get_size() {
+        const size_t head = head_.load(std::memory_order_acquire);
+        const size_t size = tail_.load(std::memory_order_acquire) - head;
+        return size > kCapacity ? kCapacity : size;
+    }
+    inline bool is_empty() {
+        return this->get_size() == 0;
+    }
+    inline bool is_full() {
+        return this->get_size() >= kCapacity;
+    }
+};
+/// fan-in of the workers towards the dispatcher
+typedef soc_shm_mpsc_queue_t<kWsQueueSize> soc_shm_mpsc_queue;
+/// rx buffers released by the workers, back to the dispatcher; it holds every rx buffer of the
+/// QP feeding the workers, so a worker never waits for room to release one
+typedef soc_shm_mpsc_queue_t<kRecycleQueueSize> soc_shm_recycle_queue;
+
+/**
+ * \brief A bounded work-stealing deque (Chase-Lev) for balancing RX messages among
+ * the workers of a component block which does not require packet order.
+ * The owner worker pushes and pops at the bottom, while idle sibling workers
+ * steal batches from the top.
+ * \note   [1] a thief claims at most kMaxStealBurst items starting at top_ with a single
+ *         CAS, so whatever bottom_ it observed, a claim never reaches beyond
+ *         top_ + kMaxStealBurst
+ *         [2] the owner pops a burst from the bottom without any CAS as long as the
+ *         burst stays clear of that range; otherwise it claims from the top with a
+ *         CAS, exactly like a thief
+ *         [3] pops at the bottom are LIFO, the owner should keep only a bounded
+ *         window of items in the deque so that the oldest ones do not starve
+ */
+struct soc_shm_ws_deque {
+    static constexpr size_t kCapacity = kWsQueueSize;
+    static constexpr size_t kMask = kWsQueueSize - 1;
+    static_assert(is_power_of_two<size_t>(kWsQueueSize), "The size of Ws Queue is not power of two.");
+    /// Maximum number of items a thief claims at once
+    static constexpr size_t kMaxStealBurst = 32;
+
+    /* ========== thieves side ========== */
+    alignas(kCacheLineSize) std::atomic<size_t> top_{0};
+    /* ========== owner side ========== */
+    alignas(kCacheLineSize) std::atomic<size_t> bottom_{0};
+    /* ========== slots ========== */
+    alignas(kCacheLineSize) uint8_t* queue_[kWsQueueSize];
+
+    public:
+    soc_shm_ws_deque() {
+        memset(queue_, 0, sizeof(queue_));
+    }
+
+    /**
+     * \brief  push up to n pointers at the bottom (owner only)
+     * \return the number of pointers actually pushed, in [0, n]
+     */
+    inline size_t push_burst(uint8_t* const* pkts, size_t n) {
+        const size_t b = bottom_.load(std::memory_order_relaxed);
+        const size_t t = top_.load(std::memory_order_acquire);
+        const size_t free_slots = kCapacity - (b - t);
+        if (n > free_slots) n = free_slots;
+        for (size_t i = 0; i < n; i++) {
+            queue_[(b + i) & kMask] = pkts[i];
+        }
+        bottom_.store(b + n, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * \brief  pop up to n pointers (owner only)
+     * \param  pkts    [out] array receiving the popped pointers
+     * \param  n       capacity of pkts
+     * \return the number of pointers actually popped, in [0, n]
+     */
+    inline size_t pop_burst(uint8_t** pkts, size_t n) {
+        const size_t b = bottom_.load(std::memory_order_relaxed);
+        size_t t = top_.load(std::memory_order_relaxed);
+        if (b == t || n == 0) return 0;
+
+        /* fast path: reserve [b - n, b) and check it is clear of any thief claim */
+        if (b - t >= n + kMaxStealBurst) {
+            const size_t nb = b - n;
+            bottom_.store(nb, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            t = top_.load(std::memory_order_relaxed);
+            if (static_cast<ptrdiff_t>(nb - t) >= static_cast<ptrdiff_t>(kMaxStealBurst)) {
+                for (size_t i = 0; i < n; i++) {
+                    pkts[i] = queue_[(nb + i) & kMask];
+                }
+                return n;
+            }
+            /* thieves got closer meanwhile, give the reservation back */
+            bottom_.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        /* slow path: claim from the top like a thief */
+        t = top_.load(std::memory_order_acquire);
+        while (static_cast<ptrdiff_t>(b - t) > 0) {
+            const size_t nb_claim = (n > b - t) ? b - t : n;
+            for (size_t i = 0; i < nb_claim; i++) {
+                pkts[i] = queue_[(t + i) & kMask];
+            }
+            if (top_.compare_exchange_strong(t, t + nb_claim,
+                                             std::memory_order_seq_cst, std::memory_order_acquire)) {
+                return nb_claim;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * \brief  steal up to n pointers from the top (any worker other than the owner)
+     * \param  pkts    [out] array receiving the stolen pointers
+     * \param  n       capacity of pkts
+     * \return the number of pointers actually stolen, in [0, min(n, kMaxStealBurst)]
+     */
+    inline size_t steal_burst(uint8_t** pkts, size_t n) {
+        size_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const size_t b = bottom_.load(std::memory_order_acquire);
+        if (static_cast<ptrdiff_t>(b - t) <= 0) return 0;
+        // leave at least half of the observed items to the owner
+        size_t nb_steal = (b - t + 1) / 2;
+        if (nb_steal > n) nb_steal = n;
+        if (nb_steal > kMaxStealBurst) nb_steal = kMaxStealBurst;
+        for (size_t i = 0; i < nb_steal; i++) {
+            pkts[i] = queue_[(t + i) & kMask];
+        }
+        if (!top_.compare_exchange_strong(t, t + nb_steal,
+                                          std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return 0;
+        }
+        return nb_steal;
+    }
+
+    inline size_t get_size() {
+        const size_t t = top_.load(std::memory_order_acquire);
+        const size_t b = bottom_.load(std::memory_order_acquire);
+        return static_cast<ptrdiff_t>(b - t) > 0 ? b - t : 0;
+    }
+    inline bool is_empty() {
+        return this->get_size() == 0;
+    }
+};
+} // namespace nicc
@@ -0,0 +1,147 @@
+#pragma once
+#include "common.h"
+#include "log.h"
+#include <atomic>
+#include <string>
+#include <errno.h>
+#include <signal.h>
+
+#include "common/math_utils.h"
+#include "common/buffer.h"
+#include "common/soc_shm_queue.h"
+
+namespace nicc {
+#define kSoCShmSegmentMagic 0x4e494343534f4332ULL   // "NICCSOC2"
+
+/**
+ * \brief Derive the SysV SHM key of a named segment, so that the runtime and the
+ * external worker processes agree on the key without exchanging it.
+ * \param name  name of the segment
+ * \return a positive SHM key
+ */
+static inline int shm_key_from_name(const char *name) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash ^= static_cast<uint8_t>(*c);
+        hash *= 16777619u;
+    }
+    hash &= 0x7fffffff;
+    return hash == 0 ? 1 : static_cast<int>(hash);
+}
+
+/**
+ * \brief Whether a process still exists, to tell the worker slots of crashed external
+ * worker processes, which never detach, from those of live ones
+ * \param pid  the process
+ * \return false only if the process is known to be gone
+ */
+static inline bool soc_shm_pid_alive(int32_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/**
+ * \brief Name of the SHM segment of a SoC component block
+ * \param block_name  name of the component block
+ * \return the segment name
+ */
+static inline std::string soc_shm_segment_name(const char *block_name) {
+    return std::string("nicc_soc_") + block_name;
+}
+
+/**
+ * \brief Header of a named hugepage segment shared between the SoC dispatcher and the
+ * worker processes of a component block. The segment contains, in order,
+ *      - this header
+ *      - the worker rx queues (dispatcher -> worker), one per worker and traffic class
+ *      - the worker tx queue (workers -> dispatcher)
+ *      - the worker recycle queue (rx buffers released by workers -> dispatcher)
+ *      - the Buffer descriptors of the rx rings
+ *      - the packet memory region, starting at ctrl_area_size_
+ * \note   [1] every process maps the segment at the address chosen by the creator, so
+ *         Buffer pointers and the packet pointers inside them are valid everywhere
+ *         and the handoff is exactly as cheap as between threads
+ *         [2] only offsets are stored, for sanity checks on attach
+ */
+struct soc_shm_segment_hdr {
+    uint64_t magic_;
+    size_t buffer_desc_size_;         /// sizeof(Buffer) of the creator, external workers must match
+    uintptr_t base_addr_;             /// address the segment is mapped at in every process
+    size_t size_;                     /// total size of the segment
+    size_t ctrl_area_size_;           /// size of the control area, hugepage aligned
+    size_t worker_rx_queue_offset_;
+    size_t worker_tx_queue_offset_;
+    size_t worker_recycle_queue_offset_;
+    size_t buffer_descs_offset_;
+    size_t nb_buffer_descs_;
+    /// pid of the external worker process in each worker slot, 0 if the slot is free; the
+    /// slot of a process which died without detaching is taken over by the next one
+    std::atomic<int32_t> worker_pids_[kSoCWorkspaceMaxNum];
+    /// workers and traffic class scheduling of the block, set by the runtime before it starts the block
+    uint16_t nb_workers_;
+    uint8_t nb_traffic_classes_;
+    uint8_t class_sched_;
+    uint32_t class_quantum_[kSoCMaxTrafficClasses];
+    uint32_t reassembly_timeout_us_;  /// 0 if every packet is a message of its own
+    bool enable_backpressure_;        /// workers wait for room in the tx queue instead of dropping
+    bool is_unordered_;               /// the block doesn't require packet order
+    double batch_deadline_us_;        /// longest time a worker holds pending messages for a batch
+    uint8_t route_of_retval_[UINT8_MAX + 1];   /// route of each handler return value
+
+    /// Size of the control area holding nb_buffer_descs Buffer descriptors
+    static inline size_t get_ctrl_area_size(size_t nb_buffer_descs) {
+        size_t size = round_up<kCacheLineSize>(sizeof(soc_shm_segment_hdr));
+        size += kSoCWorkspaceMaxNum * kSoCMaxTrafficClasses * round_up<kCacheLineSize>(sizeof(soc_shm_lock_free_queue));
+        size += round_up<kCacheLineSize>(sizeof(soc_shm_mpsc_queue));
+        size += round_up<kCacheLineSize>(sizeof(soc_shm_recycle_queue));
+        size += nb_buffer_descs * sizeof(Buffer);
+        return round_up<kHugepageSize>(size);
+    }
+
+    inline uint8_t* get_base() {
+        return reinterpret_cast<uint8_t*>(this);
+    }
+    inline soc_shm_lock_free_queue* get_worker_rx_queue(uint16_t worker_id, uint8_t traffic_class) {
+        return reinterpret_cast<soc_shm_lock_free_queue*>(
+            this->get_base() + this->worker_rx_queue_offset_
+                + (worker_id * kSoCMaxTrafficClasses + traffic_class)
+                    * round_up<kCacheLineSize>(sizeof(soc_shm_lock_free_queue))
+        );
+    }
+    inline soc_shm_mpsc_queue* get_worker_tx_queue() {
+        return reinterpret_cast<soc_shm_mpsc_queue*>(this->get_base() + this->worker_tx_queue_offset_);
+    }
+    inline soc_shm_recycle_queue* get_worker_recycle_queue() {
+        return reinterpret_cast<soc_shm_recycle_queue*>(this->get_base() + this->worker_recycle_queue_offset_);
+    }
+    inline Buffer* get_buffer_descs() {
+        return reinterpret_cast<Buffer*>(this->get_base() + this->buffer_descs_offset_);
+    }
+    inline uint8_t* get_data_area() {
+        return this->get_base() + this->ctrl_area_size_;
+    }
+};
+
+/**
+ * \brief  lay out a freshly created segment, called by the creator only
+ * \param  base             start address of the segment
+ * \param  size             total size of the segment
+ * \param  nb_buffer_descs  number of Buffer descriptors to reserve
+ * \return the segment header, or nullptr if the segment is too small
+ */
+soc_shm_segment_hdr* soc_shm_init_segment(uint8_t *base, size_t size, size_t nb_buffer_descs);
+
+/**
+ * \brief  attach to a named segment created by the runtime, at the creator's address
+ * \param  name  name of the segment
+ * \return the segment header, or nullptr on failure
+ */
+soc_shm_segment_hdr* soc_shm_attach_segment(const char *name);
+
+/**
+ * \brief  detach from a segment attached by soc_shm_attach_segment
+ * \param  hdr  the segment header
+ */
+void soc_shm_detach_segment(soc_shm_segment_hdr *hdr);
+
+} // namespace nicc
@@ -0,0 +1,136 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "common/soc_mirror.h"
+
+namespace nicc {
+
+/// pcap file format, with nanosecond timestamps
+#define kPcapMagicNs 0xa1b23c4dU
+#define kPcapLinkTypeEthernet 1
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+static void __soc_mirror_drain_func(soc_mirror *mirror) {
+    /// the tap must never take a core from the datapath
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    if (unlikely(pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)) {
+        NICC_WARN("failed to lower the priority of the mirror drain thread");
+    }
+
+    while (true) {
+        /// read the flag before draining, so that every record pushed before the stop is written
+        bool stop = mirror->stop_.load(std::memory_order_acquire);
+        const soc_mirror_record *record;
+        size_t nb_drained = 0;
+        while ((record = mirror->ring_.front()) != nullptr) {
+            uint64_t ns = mirror->base_ns_ + static_cast<uint64_t>(
+                to_nsec(record->tsc_ - mirror->base_tsc_, mirror->freq_ghz_));
+            pcap_record_hdr hdr;
+            hdr.ts_sec = static_cast<uint32_t>(ns / 1000000000ULL);
+            hdr.ts_nsec = static_cast<uint32_t>(ns % 1000000000ULL);
+            hdr.incl_len = record->cap_len_;
+            hdr.orig_len = record->orig_len_;
+            /// once a write falls short the file is unusable, keep releasing records so the
+            /// ring never stalls, but stop writing them
+            if (likely(!mirror->failed_.load(std::memory_order_relaxed))) {
+                if (unlikely(fwrite(&hdr, sizeof(hdr), 1, mirror->file_) != 1
+                        || fwrite(record->data_, 1, record->cap_len_, mirror->file_) != record->cap_len_)) {
+                    NICC_WARN("failed to write mirror pcap file: %s, the mirror tap is disabled", strerror(errno));
+                    mirror->failed_.store(true, std::memory_order_relaxed);
+                } else {
+                    nb_drained++;
+                }
+            }
+            mirror->ring_.release();
+        }
+        mirror->nb_written_ += nb_drained;
+        if (stop) {
+            break;
+        }
+        if (nb_drained == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    fflush(mirror->file_);
+}
+
+soc_mirror* soc_mirror_start(const char *path, uint32_t snaplen, double freq_ghz) {
+    soc_mirror *mirror;
+    pcap_file_hdr hdr;
+    struct timespec ts;
+    int fd;
+
+    NICC_CHECK_POINTER(path);
+    /// the default path lives in a world-writable directory, never follow or reuse a file
+    /// planted there by someone else, and keep the captured packets private
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (unlikely(fd < 0)) {
+        NICC_WARN("failed to create mirror pcap file %s: %s", path, strerror(errno));
+        return nullptr;
+    }
+    NICC_CHECK_POINTER(mirror = new soc_mirror());
+    mirror->file_ = fdopen(fd, "wb");
+    if (unlikely(mirror->file_ == nullptr)) {
+        NICC_WARN("failed to open mirror pcap file %s: %s", path, strerror(errno));
+        close(fd);
+        delete mirror;
+        return nullptr;
+    }
+    hdr.magic = kPcapMagicNs;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = snaplen;
+    hdr.linktype = kPcapLinkTypeEthernet;
+    if (unlikely(fwrite(&hdr, sizeof(hdr), 1, mirror->file_) != 1)) {
+        NICC_WARN("failed to write mirror pcap file %s: %s", path, strerror(errno));
+        fclose(mirror->file_);
+        delete mirror;
+        return nullptr;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    mirror->base_tsc_ = rdtsc();
+    mirror->base_ns_ = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+    mirror->freq_ghz_ = freq_ghz;
+    NICC_CHECK_POINTER(mirror->drain_thread_ = new std::thread(__soc_mirror_drain_func, mirror));
+    NICC_LOG("Started mirror tap to %s: snaplen(%u)", path, snaplen);
+    return mirror;
+}
+
+void soc_mirror_stop(soc_mirror *mirror) {
+    NICC_CHECK_POINTER(mirror);
+    mirror->stop_.store(true, std::memory_order_release);
+    if (mirror->drain_thread_ != nullptr) {
+        mirror->drain_thread_->join();
+        delete mirror->drain_thread_;
+        mirror->drain_thread_ = nullptr;
+    }
+    NICC_LOG("Stopped mirror tap: written packets(%lu), lost packets(%lu)",
+             mirror->nb_written_, mirror->ring_.nb_lost_);
+    fclose(mirror->file_);
+    delete mirror;
+}
+
+} // namespace nicc
@@ -0,0 +1,113 @@
+#include <new>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include "common/soc_shm_segment.h"
+
+namespace nicc {
+
+soc_shm_segment_hdr* soc_shm_init_segment(uint8_t *base, size_t size, size_t nb_buffer_descs) {
+    soc_shm_segment_hdr *hdr;
+    size_t offset;
+    size_t ctrl_area_size = soc_shm_segment_hdr::get_ctrl_area_size(nb_buffer_descs);
+
+    if (unlikely(base == nullptr || size <= ctrl_area_size)) {
+        NICC_WARN("SHM segment too small: size(%lu), ctrl_area_size(%lu)", size, ctrl_area_size);
+        return nullptr;
+    }
+
+    hdr = new (base) soc_shm_segment_hdr();
+    hdr->buffer_desc_size_ = sizeof(Buffer);
+    hdr->base_addr_ = reinterpret_cast<uintptr_t>(base);
+    hdr->size_ = size;
+    hdr->ctrl_area_size_ = ctrl_area_size;
+    hdr->nb_buffer_descs_ = nb_buffer_descs;
+    for (size_t i = 0; i < kSoCWorkspaceMaxNum; i++) {
+        hdr->worker_pids_[i].store(0, std::memory_order_relaxed);
+    }
+    hdr->nb_workers_ = 1;
+    hdr->nb_traffic_classes_ = 1;
+    hdr->class_sched_ = 0;
+    memset(hdr->class_quantum_, 0, sizeof(hdr->class_quantum_));
+    hdr->reassembly_timeout_us_ = 0;
+    hdr->enable_backpressure_ = false;
+    hdr->is_unordered_ = false;
+    hdr->batch_deadline_us_ = 2.0;
+    memset(hdr->route_of_retval_, 0, sizeof(hdr->route_of_retval_));
+
+    offset = round_up<kCacheLineSize>(sizeof(soc_shm_segment_hdr));
+    hdr->worker_rx_queue_offset_ = offset;
+    for (size_t i = 0; i < kSoCWorkspaceMaxNum * kSoCMaxTrafficClasses; i++) {
+        new (base + offset) soc_shm_lock_free_queue();
+        offset += round_up<kCacheLineSize>(sizeof(soc_shm_lock_free_queue));
+    }
+    hdr->worker_tx_queue_offset_ = offset;
+    new (base + offset) soc_shm_mpsc_queue();
+    offset += round_up<kCacheLineSize>(sizeof(soc_shm_mpsc_queue));
+    hdr->worker_recycle_queue_offset_ = offset;
+    new (base + offset) soc_shm_recycle_queue();
+    offset += round_up<kCacheLineSize>(sizeof(soc_shm_recycle_queue));
+    hdr->buffer_descs_offset_ = offset;
+
+    /// publish the layout last, attachers check the magic first
+    std::atomic_thread_fence(std::memory_order_release);
+    hdr->magic_ = kSoCShmSegmentMagic;
+    return hdr;
+}
+
+soc_shm_segment_hdr* soc_shm_attach_segment(const char *name) {
+    int shm_key, shm_id;
+    uint8_t *probe, *base;
+    uintptr_t base_addr;
+
+    NICC_CHECK_POINTER(name);
+    shm_key = shm_key_from_name(name);
+    shm_id = shmget(shm_key, 0, 0);
+    if (unlikely(shm_id == -1)) {
+        NICC_WARN("failed to find SHM segment %s: key(%d), %s", name, shm_key, strerror(errno));
+        return nullptr;
+    }
+
+    /// map anywhere first to learn the address used by the creator
+    probe = static_cast<uint8_t*>(shmat(shm_id, nullptr, SHM_RDONLY));
+    if (unlikely(probe == reinterpret_cast<uint8_t*>(-1))) {
+        NICC_WARN("failed to map SHM segment %s: key(%d), %s", name, shm_key, strerror(errno));
+        return nullptr;
+    }
+    if (unlikely(reinterpret_cast<soc_shm_segment_hdr*>(probe)->magic_ != kSoCShmSegmentMagic)) {
+        NICC_WARN("SHM segment %s is not initialized by the runtime: key(%d)", name, shm_key);
+        shmdt(probe);
+        return nullptr;
+    }
+    /// workers read the descriptors in place, a process built with another Buffer layout
+    /// would misread every one of them
+    if (unlikely(reinterpret_cast<soc_shm_segment_hdr*>(probe)->buffer_desc_size_ != sizeof(Buffer))) {
+        NICC_WARN("SHM segment %s holds Buffer descriptors of %lu bytes, this process expects %lu bytes: key(%d)",
+                  name, reinterpret_cast<soc_shm_segment_hdr*>(probe)->buffer_desc_size_, sizeof(Buffer), shm_key);
+        shmdt(probe);
+        return nullptr;
+    }
+    base_addr = reinterpret_cast<soc_shm_segment_hdr*>(probe)->base_addr_;
+    shmdt(probe);
+
+    base = static_cast<uint8_t*>(shmat(shm_id, reinterpret_cast<void*>(base_addr), 0));
+    if (unlikely(base == reinterpret_cast<uint8_t*>(-1))) {
+        NICC_WARN("failed to map SHM segment %s at %p, the address range is taken in this process: %s",
+                  name, reinterpret_cast<void*>(base_addr), strerror(errno));
+        return nullptr;
+    }
+
+    soc_shm_segment_hdr *hdr = reinterpret_cast<soc_shm_segment_hdr*>(base);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    NICC_LOG("Attached SHM segment %s at %p: size(%lu MB)", name, base, hdr->size_ / MB(1));
+    return hdr;
+}
+
+void soc_shm_detach_segment(soc_shm_segment_hdr *hdr) {
+    NICC_CHECK_POINTER(hdr);
+    if (unlikely(shmdt(hdr) != 0)) {
+        NICC_WARN("failed to detach SHM segment at %p: %s", hdr, strerror(errno));
+    }
+}
+
+} // namespace nicc
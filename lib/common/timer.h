@@ -30,6 +30,17 @@ static inline size_t rdtsc() {
 #error "Unsupported CPU architecture for rdtsc()"
 #endif
 
+/// Hint the core that we are busy-waiting
+#if defined(__aarch64__) || defined(__arm__)
+static inline void cpu_relax() {
+  asm volatile("yield" ::: "memory");
+}
+#elif defined(__x86_64__) || defined(__i386__)
+static inline void cpu_relax() {
+  asm volatile("pause" ::: "memory");
+}
+#endif
+
 /// An alias for rdtsc() to distinguish calls on the critical path
 static const auto &dpath_rdtsc = rdtsc;
 
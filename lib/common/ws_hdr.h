@@ -2,8 +2,19 @@
 
 #include "common.h"
 namespace nicc {
+/// ws_hdr::seg_flags_, set on the first segment of a message, only a first segment starts a
+/// message under reassembly
+static constexpr uint8_t kWsSegFirst = 0x1;
+
 struct ws_hdr {
     uint8_t workload_type_;
+    uint8_t seg_flags_;
+    /// id of the message within its flow, the same on all its segments
+    uint16_t msg_id_;
+    /// number of segments of the message from this one on, i.e., n on the first of n
+    /// segments and 1 on the last; with reassembly, a message is a first segment carrying
+    /// kWsSegFirst followed by segments of the same msg_id_ counting down by one, a first
+    /// segment with 0 or 1 is a single-packet message
     size_t segment_num_;
 };
-} // namespace nicc
\ No newline at end of file
+} // namespace nicc
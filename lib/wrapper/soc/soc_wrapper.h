@@ -1,16 +1,102 @@
 #pragma once
+#include <algorithm>
+#include <net/ethernet.h>
+#include <netinet/tcp.h>
 #include "common.h"
 #include "log.h"
 #include "common/soc_queue.h"
+#include "common/soc_shm_segment.h"
+#include "common/soc_mirror.h"
 #include "common/timer.h"
 
 namespace nicc {
 
 // SoC user function type definitions
-typedef user_state_info (*soc_init_handler_t)();       // init handler allocates and returns user_state with size
+// init handler allocates and returns user_state with size; it runs once on every worker thread,
+// after the thread is pinned, so each worker owns a private user_state local to its core
+typedef user_state_info (*soc_init_handler_t)();
 typedef nicc_retval_t (*soc_pkt_handler_t)(Buffer* pkt, void* user_state);  
 typedef nicc_retval_t (*soc_msg_handler_t)(Buffer* msg, void* user_state);
+// optional burst message handler, handles nb_msgs (at most kAppRxMsgBatchSize) messages and
+// stores the result of msgs[i] into retvals[i]; preferred over soc_msg_handler_t when registered
+typedef void (*soc_msg_burst_handler_t)(Buffer** msgs, nicc_retval_t* retvals, uint16_t nb_msgs, void* user_state);
 typedef void (*soc_cleanup_handler_t)(void* user_state);   // cleanup handler frees user_state
+// optional merge handler, folds the user_states of the nb_states workers of the block into a
+// global view, e.g., sums up counters; it runs on the dispatcher while the workers keep updating
+// their user_states, so it must only read them, and must not keep the pointers after returning;
+// the fields it reads must be atomics, read and written with relaxed ordering at least
+typedef void (*soc_merge_handler_t)(void* const* user_states, uint16_t nb_states);
+
+/// stop barrier of the workers of a block and the dispatcher running its merge handler, the
+/// final merge runs once every worker has stopped and before any of them frees its user_state
+struct soc_merge_barrier_t {
+    uint16_t nb_workers = 0;                /// pure worker threads of the block, set before they start
+    std::atomic<uint16_t> nb_stopped{0};    /// workers which have stopped
+    std::atomic<bool> merged{false};        /// the final merge is done, the workers may clean up
+};
+
+/**
+ * ----------------------Asynchronous message handlers----------------------
+ */
+/// status returned by an asynchronous message handler
+enum soc_async_status_t : uint8_t {
+    kSoC_Async_Done = 0,    /// the message is handled, ctx->retval holds the result
+    kSoC_Async_Pending      /// the handler awaits an operation, resume it once the operation completes
+};
+/// completion check of an operation awaited by an asynchronous handler, e.g., polling the
+/// CQ of an RDMA read or the progress engine of an accelerator job; true once it completed
+typedef bool (*soc_async_poll_t)(void* arg);
+/// size of the locals an asynchronous handler keeps across its resumptions
+static constexpr size_t kSoCAsyncLocalsSize = 64;
+
+/**
+ * \brief  state of an asynchronous message handler across its resumptions, the handler is a
+ *         stackless coroutine, which keeps its resume point in step and its locals in locals
+ *         instead of on the stack; the worker interleaves many such in-flight messages and
+ *         resumes each of them once the operation it awaits has completed
+ * \note   write the handler with the SOC_ASYNC_* macros below, e.g.,
+ *              soc_async_status_t soc_async_msg_handler(Buffer* msg, soc_async_ctx* ctx, void* user_state) {
+ *                  my_locals *l = reinterpret_cast<my_locals*>(ctx->locals);
+ *                  SOC_ASYNC_BEGIN(ctx);
+ *                  if (!is_slow_path(msg)) SOC_ASYNC_RETURN(ctx, NICC_SUCCESS);
+ *                  l->job = submit_job(msg);
+ *                  SOC_AWAIT(ctx, soc_async_wait_for(ctx, job_done, l->job));
+ *                  SOC_AWAIT(ctx, soc_async_wait_us(ctx, 10.0));
+ *                  SOC_ASYNC_END(ctx, NICC_SUCCESS);
+ *              }
+ *         handlers complete out of order, so messages of a flow may leave out of order, and
+ *         they are refused on blocks which require packet order; messages still in flight
+ *         when the worker stops are given kAsyncDrainMs to complete, then dropped
+ */
+struct soc_async_ctx {
+    uint32_t step;                  /// resume point, 0 on the first call
+    nicc_retval_t retval;           /// result of the handled message
+    alignas(8) uint8_t locals[kSoCAsyncLocalsSize];  /// locals of the handler
+    /* ========== awaited operation, set by soc_async_wait_* ========== */
+    size_t wake_tsc;                /// resume once rdtsc() reaches it, 0 if unused
+    soc_async_poll_t poll;          /// resume once poll(poll_arg) returns true, nullptr if unused
+    void *poll_arg;
+    double freq_ghz;                /// TSC frequency, set by the wrapper
+};
+typedef soc_async_status_t (*soc_async_msg_handler_t)(Buffer* msg, soc_async_ctx* ctx, void* user_state);
+
+/// await a timer of us microseconds
+static inline void soc_async_wait_us(soc_async_ctx *ctx, double us) {
+    ctx->wake_tsc = rdtsc() + us_to_cycles(us, ctx->freq_ghz);
+    ctx->wake_tsc += (ctx->wake_tsc == 0);
+}
+/// await an operation whose completion poll(arg) reports
+static inline void soc_async_wait_for(soc_async_ctx *ctx, soc_async_poll_t poll, void *arg) {
+    ctx->poll = poll;
+    ctx->poll_arg = arg;
+}
+
+#define SOC_ASYNC_BEGIN(ctx)    switch ((ctx)->step) { case 0:
+/// the resume point is numbered by __COUNTER__, so that awaits sharing a line stay apart
+#define SOC_AWAIT(ctx, op)      SOC_AWAIT_AT(ctx, op, __COUNTER__ + 1)
+#define SOC_AWAIT_AT(ctx, op, n) do { op; (ctx)->step = (n); return kSoC_Async_Pending; case (n):; } while (0)
+#define SOC_ASYNC_RETURN(ctx, ret) do { (ctx)->retval = (ret); return kSoC_Async_Done; } while (0)
+#define SOC_ASYNC_END(ctx, ret) } SOC_ASYNC_RETURN(ctx, ret)
 
 /**
  * \brief Wrapper for executing SoC functions, created and initialized by ComponentBlock_SoC
@@ -23,14 +109,58 @@ class SoCWrapper {
     static constexpr uint16_t kAppTxMsgBatchSize = 32;
     static constexpr uint16_t kAppRxMsgBatchSize = 32;
 
-    /// Minimal number of buffered packets for collect_tx_pkts
+    /// Largest batch of buffered packets waited for before flushing to the next block
     static constexpr size_t kTxBatchSize = 32;
     /// Maximum number of transmitted packets for tx_burst
     static constexpr size_t kTxPostSize = 32;
+    /// Maximum number of messages in flight in the asynchronous message handler of a worker
+    static constexpr size_t kAsyncMaxInflight = 64;
+    /// Number of buffers ahead of the current one whose descriptor and headers are prefetched
+    /// in the dispatcher and worker loops, 0 disables prefetching
+    static constexpr size_t kPrefetchDistance = 4;
+    /// Only every kTxSignalInterval-th send WR and the last one of each post list ask for a completion
+    static constexpr size_t kTxSignalInterval = 32;
     /// Minimal number of buffered packets before dispatching
     static constexpr size_t kRxBatchSize = 128;
     /// Maximum number of packets received in rx_burst
     static constexpr size_t kRxPostSize = 32;
+    /// Maximum number of buffers moved through a SHM queue per synchronization
+    static constexpr size_t kQueueBurstSize = 32;
+    /// Maximum number of messages a worker keeps in its stealable rx deque
+    static constexpr size_t kWsDequeWindow = 4 * kQueueBurstSize;
+    /// Number of consecutive packets sent to the worker picked by power of two choices
+    static constexpr size_t kP2cPickSize = 4;
+    /// Number of pause/yield instructions per back-off round of an idle thread
+    static constexpr size_t kIdleRelaxNum = 64;
+    /// Number of messages a worker reassembles at the same time, one per flow
+    static constexpr size_t kReassemblySlotNum = 32;
+    static_assert(is_power_of_two<size_t>(kReassemblySlotNum), "The num of reassembly slots is not power of two.");
+    /// Maximum number of segments of a message, larger messages are dropped
+    static constexpr size_t kReassemblyMaxSegs = 64;
+    /// Number of flow slots of the reorder stage, flows sharing a slot are ordered together
+    static constexpr size_t kReorderFlowNum = 64;
+    static_assert(is_power_of_two<size_t>(kReorderFlowNum), "The num of reorder flow slots is not power of two.");
+    /// Maximum number of packets a flow may be ahead of its oldest missing packet, which must
+    /// cover a round of round-robin bursts over all workers
+    static constexpr size_t kReorderWindow = 512;
+    static_assert(is_power_of_two<size_t>(kReorderWindow), "The reorder window is not power of two.");
+    /// Time a flow waits for a missing packet, which a worker may have dropped, in us
+    static constexpr double kReorderTimeoutUs = 100.0;
+    /// Fixed-point shift of the egress token buckets, tokens are bytes << kShaperShift
+    static constexpr size_t kShaperShift = 24;
+    /// Time the messages in flight in the async handler are given to complete once the worker stops, in ms
+    static constexpr double kAsyncDrainMs = 10.0;
+    /// Time a stopping worker waits for room in the recycle queue, in ms
+    static constexpr double kStopFlushMs = 10.0;
+    /// Interval between two liveness checks of the external worker processes, in ms
+    static constexpr double kExtWorkerCheckMs = 100.0;
+    /// Time the slots claimed by a dead external worker process are waited for before they
+    /// are skipped, much longer than any live producer takes to publish its slots, in ms
+    static constexpr double kExtWorkerGraceMs = 100.0;
+    /// Most VLAN tags walked by the packet parser, i.e., QinQ
+    static constexpr size_t kMaxVlanTags = 2;
+    /// Ethertype of an 802.1ad service tag, the outer tag of QinQ
+    static constexpr uint16_t kEthTypeQinQ = 0x88a8;
 /**
  * ----------------------Public Structures----------------------
  */ 
@@ -40,6 +170,121 @@ class SoCWrapper {
         kSoC_Dispatcher = 0x01,     /// The thread will communicate with other component blocks
         kSoC_Worker = 0x02          /// The thread will execute the app function
     };
+    /**
+     * \brief   packet field which selects the traffic class of a message
+     */
+    enum soc_class_field_t : uint8_t {
+        kSoC_ClassField_WsType = 0,     /// ws_hdr::workload_type_
+        kSoC_ClassField_Dscp            /// DSCP of the IPv4 header
+    };
+    /**
+     * \brief   scheduling among the traffic classes on the worker side
+     */
+    enum soc_class_sched_t : uint8_t {
+        kSoC_ClassSched_Strict = 0,     /// always serve the lowest non-empty class first
+        kSoC_ClassSched_DRR             /// deficit round robin, weighted by class_quantum
+    };
+    /**
+     * \brief   how the dispatcher picks the worker of a packet
+     */
+    enum soc_dispatch_policy_t : uint8_t {
+        kSoC_Dispatch_RoundRobin = 0,   /// bursts go to the workers in turn
+        kSoC_Dispatch_FlowHash,         /// RSS, the 5-tuple hash selects a worker through the indirection table
+        kSoC_Dispatch_LeastLoaded       /// power of two choices, the shorter queue of two random workers,
+                                        /// only for blocks which don't require packet order
+    };
+    /**
+     * \brief   why a packet is dropped, counted per wrapper
+     */
+    enum soc_drop_reason_t : uint8_t {
+        kSoC_Drop_WorkerQueueFull = 0,  /// dispatcher, the rx queue of the worker or its class is full
+        kSoC_Drop_TxQueueFull,          /// worker, the fan-in queue towards the dispatcher is full
+        kSoC_Drop_Reassembly,           /// worker, segment of a message which can not be completed
+        kSoC_Drop_Route,                /// worker, the return value of the handler routes the message to drop
+        kSoC_Drop_Stopped,              /// worker, the message is still held when the wrapper stops
+        kSoC_Drop_NumReasons
+    };
+    /**
+     * \brief   where a worker sends a handled message, by the return value of the handler
+     */
+    enum soc_route_t : uint8_t {
+        kSoC_Route_Default = 0,         /// no ctrl_path entry, forwarded to the next block
+        kSoC_Route_Next,                /// forwarded to the next block
+        kSoC_Route_Drop                 /// dropped, the buffers return to the rx ring
+    };
+    /**
+     * \brief   token-bucket egress shaping of a QP of the channel
+     */
+    struct soc_shaper_config_t {
+        double rate_gbps = 0.0;         /// sustained rate, 0 disables shaping
+        double burst_kb = 64.0;         /// bucket depth, at least one MTU
+    };
+    /**
+     * \brief   per-block configuration of the SoCWrapper, parsed from the data_path
+     *          section of the component in dp_spec.json
+     */
+    struct SoCWrapperConfig {
+        /// the block doesn't require packet order ("order": "false"), messages may leave
+        /// the workers in another order than they arrived
+        bool is_unordered = false;
+        /// balance rx messages among workers by stealing, only for unordered blocks
+        bool enable_work_stealing = false;
+        /// number of workers fed by the dispatcher, each with its own rx queues
+        uint16_t nb_workers = 1;
+        soc_dispatch_policy_t dispatch_policy = kSoC_Dispatch_FlowHash;
+        /// initial RSS indirection table, repeated over the kSoCRssRetaSize buckets;
+        /// buckets are spread evenly over the workers if rss_reta_size is 0
+        uint16_t rss_reta_size = 0;
+        uint16_t rss_reta[kSoCRssRetaSize] = { 0 };
+        /// workers run as separate processes attached to the SHM segment of the block,
+        /// the runtime only runs the dispatcher
+        bool external_workers = false;
+        /// idle wait strategy: spin for idle_spin_us, then back off with pause/yield for
+        /// idle_backoff_us, then sleep at most idle_sleep_us per round, which bounds the
+        /// wake-up latency; workers are woken earlier by the dispatcher
+        bool enable_idle_wait = false;
+        /// the sleeping dispatcher waits for completion events of its recv CQs instead of
+        /// polling them, so idle_sleep_us only bounds the latency of worker results and
+        /// can be much longer
+        bool enable_cq_event = false;
+        double idle_spin_us = 50.0;
+        double idle_backoff_us = 200.0;
+        double idle_sleep_us = 100.0;
+        /// traffic classes of the dispatcher-to-worker path, class 0 has the highest priority
+        uint8_t nb_traffic_classes = 1;
+        soc_class_field_t class_field = kSoC_ClassField_WsType;
+        soc_class_sched_t class_sched = kSoC_ClassSched_Strict;
+        uint8_t class_of_field[UINT8_MAX + 1] = { 0 };                  /// field value -> class
+        uint32_t class_quantum[kSoCMaxTrafficClasses] = { 32, 32, 32, 32 };   /// DRR quantum, in messages
+        /// messages span several packets, which workers reassemble before calling the handlers;
+        /// every message must start with a segment carrying kWsSegFirst, see ws_hdr, and
+        /// messages still incomplete after reassembly_timeout_us are dropped
+        bool enable_reassembly = false;
+        double reassembly_timeout_us = 1000.0;
+        /// overloaded workers hold their packets instead of dropping them: the dispatcher keeps
+        /// the rx buffers, which are then not reposted, so RNR flow control of the RC QP pushes
+        /// back on the sender; workers wait for room in the fan-in queue
+        bool enable_backpressure = false;
+        /// workers and the tx path wait for a batch as large as the current load sustains,
+        /// but never hold pending messages for longer than batch_deadline_us
+        double batch_deadline_us = 2.0;
+        /// period of the merge handler on the dispatcher, 0 only merges once the block stops
+        double merge_interval_ms = 1000.0;
+        /// return value of the message handlers -> soc_route_t, compiled from the retval
+        /// entries of the ctrl_path section when the block starts
+        uint8_t route_of_retval[UINT8_MAX + 1] = { 0 };
+        /// egress shaping of the dispatcher, packets over the rate stay in the tx queue of the
+        /// QP, so the tx path stops collecting from the workers instead of dropping
+        soc_shaper_config_t shaper_next;    /// towards the next block, e.g., the local host
+        soc_shaper_config_t shaper_prior;   /// back towards the prior block
+        /// sampling tap of the dispatcher, copies every N-th packet received on a QP, 0 for
+        /// none, into a ring drained to the pcap file at mirror_path by a low-priority thread
+        uint32_t mirror_sample_next = 0;    /// packets from the next block
+        uint32_t mirror_sample_prior = 0;   /// packets from the prior block
+        double mirror_rate_pps = 0.0;       /// at most this many samples per second and QP, 0 unlimited
+        uint32_t mirror_snaplen = 128;      /// bytes copied per packet, at most kSoCMirrorMaxSnaplen
+        char mirror_path[128] = { 0 };
+    };
     /**
      * \brief   local SoCWrapper context for executing SoC functions, including
      *                - function state ptr
@@ -56,17 +301,26 @@ class SoCWrapper {
         /// e.g. function state ptr
         /// e.g. event handler ptr
         /// lock-free queue
+        SoCWrapperConfig config;            /// per-block wrapper configuration
+        uint16_t worker_id;                 /// index of the worker among the workers of the block
+        soc_shm_segment_hdr *shm_segment;   /// SHM segment attached by an external worker process, otherwise nullptr
+        soc_shm_segment_hdr *worker_shm_segment;    /// SHM segment the external workers of a dispatcher attach to, otherwise nullptr
         
         /* ========== user defined handlers and state ========== */
         soc_init_handler_t init_handler;    /// user defined init handler
         soc_pkt_handler_t pkt_handler;      /// user defined packet handler  
         soc_msg_handler_t msg_handler;      /// user defined message handler
+        soc_msg_burst_handler_t msg_burst_handler; /// user defined burst message handler, optional
         soc_cleanup_handler_t cleanup_handler; /// user defined cleanup handler
+        soc_merge_handler_t merge_handler;  /// user defined merge handler, optional
+        soc_async_msg_handler_t async_msg_handler; /// user defined asynchronous message handler, optional
         void* user_state;                   /// user defined state object (allocated by user in init_handler)
         size_t user_state_size;             /// size of user_state (for future reschedule support)
-        
-        /* ========== routing for packet forwarding ========== */
-        // ComponentRouting_SoC* routing;      /// routing component for packet forwarding decisions
+        /// user_state of each worker of the block, shared by all contexts of the block and
+        /// published by the workers for the merge handler, nullptr without merge handler
+        std::atomic<void*> *worker_user_states;
+        /// shared by all contexts of the block, nullptr without merge handler
+        soc_merge_barrier_t *merge_barrier;
     };
 
 /**
@@ -75,13 +329,32 @@ class SoCWrapper {
  public:
     /**
      * \brief Constructor, ComponentBlock_SoC calls this when allocating a thread for SoCWrapper.
-     *        For dispatcher, 
+     *        A block runs either a single thread of both types, or one dispatcher thread
+     *        and config.nb_workers worker threads (or external worker processes), each
+     *        worker consuming its own rx queues selected by context->worker_id
      * \param type  type of the SoCWrapper
      * \param context context of the SoCWrapper, registered by the ComponentBlock_SoC
      */
     SoCWrapper(soc_wrapper_type_t type, SoCWrapperContext *context);
     ~SoCWrapper();  
 
+    /**
+     * \brief Attach an external worker process to a SoC component block run by the runtime.
+     *        On success, constructing a kSoC_Worker SoCWrapper with the context runs the
+     *        worker in this process, on the same queues and buffers as the dispatcher.
+     *        Each attached process takes a free worker slot of the block.
+     * \param block_name  name of the component block
+     * \param context     [out] context of the worker, handlers must be filled by the caller
+     * \return NICC_SUCCESS for successful attachment
+     */
+    static nicc_retval_t attach_worker(const char *block_name, SoCWrapperContext *context);
+
+    /**
+     * \brief Detach an external worker process attached by attach_worker
+     * \param context     context of the worker
+     */
+    static void detach_worker(SoCWrapperContext *context);
+
 /**
  * ----------------------Internel Methonds----------------------
  */ 
@@ -102,17 +375,129 @@ class SoCWrapper {
      */
     void __run(double seconds);
 
+    /**
+     * \brief Fold the user_states of the workers with the user defined merge handler
+     */
+    void __merge_user_states();
+
+    /**
+     * \brief Look for external worker processes which died without detaching, and recover
+     *        one at a time: skip the fan-in and recycle queue slots it claimed without
+     *        publishing them, then return the buffers it held to the free stacks
+     * \param size_t now_tsc, the current TSC
+     */
+    void __check_ext_workers(size_t now_tsc);
+
+    /**
+     * \brief Mark buffers collected from the external workers as back at the dispatcher
+     * \param Buffer **bufs, the buffers
+     * \param size_t nb_bufs, the number of buffers
+     */
+    inline void __clear_buf_holders(Buffer **bufs, size_t nb_bufs) {
+        if (likely(this->_ext_workers.segment == nullptr)) {
+            return;
+        }
+        for (size_t i = 0; i < nb_bufs; i++) {
+            bufs[i]->holder_pid_ = 0;
+        }
+    }
+
     /**
      * \brief Launch the SoC kernel loop
+     * \return the number of packets and messages handled in this round, 0 when idle
+     */
+    size_t __launch();
+
+    /**
+     * \brief Wait according to the idle wait strategy, i.e., spin, back off, or sleep
+     *        depending on how long the thread has been idle
+     * \param size_t idle_tsc, cycles since the thread last handled any packet
+     */
+    void __idle_wait(size_t idle_tsc);
+
+    /**
+     * \brief Arm the recv CQs of the dispatcher for completion events, and make sure no
+     *        packet arrived before they were armed
+     * \return true if the dispatcher can sleep, false if packets are waiting
+     */
+    bool __arm_cq_events();
+
+    /**
+     * \brief Sleep until a recv CQ of the dispatcher reports a completion, or at most
+     *        _idle_sleep_us, and acknowledge the received events
+     * \return true if woken by a completion event
      */
-    void __launch();
+    bool __wait_cq_events();
+
+    /// adaptive batch, target grows up to max_size while the backlog outpaces it, and
+    /// shrinks when the deadline expires first
+    struct adaptive_batch_t {
+        size_t target = 1;
+        size_t max_size = 1;
+        size_t pending_tsc = 0;     /// since when messages are pending, 0 if none
+    };
+
+    /**
+     * \brief Decide whether a batch is due, i.e., nb_pending reached the target of the
+     *        batch or the oldest pending message waited for _batch_deadline_tsc, and
+     *        adapt the target to the load
+     * \param adaptive_batch_t &batch, the adaptive batch
+     * \param size_t nb_pending, the number of pending messages
+     * \return true if the pending messages should be handled now
+     */
+    bool __batch_ready(adaptive_batch_t &batch, size_t nb_pending);
+
+    /// token bucket of an egress shaper, in fixed point with kShaperShift fraction bits
+    struct soc_token_bucket_t {
+        size_t tokens = 0;
+        size_t depth = 0;           /// capacity, 0 if shaping is disabled
+        size_t rate = 0;            /// tokens refilled per cycle
+        size_t fill_tsc = 0;        /// cycles to fill up an empty bucket, bounds the refill
+        size_t last_tsc = 0;
+        size_t nb_throttled = 0;    /// flushes which held packets back
+    };
+
+    /**
+     * \brief Set up the token bucket of an egress shaper, which starts full
+     * \param soc_token_bucket_t &bucket, the token bucket
+     * \param const soc_shaper_config_t &config, the shaper configuration
+     */
+    void __init_shaper(soc_token_bucket_t &bucket, const soc_shaper_config_t &config);
+
+    /**
+     * \brief Refill a token bucket and count how many packets from the head of a tx queue
+     *        it lets pass, one rdtsc per flush and a compare per packet
+     * \param soc_token_bucket_t &bucket, the token bucket
+     * \param Buffer **tx, the tx queue
+     * \param size_t tx_size, the number of packets in the tx queue
+     * \return the number of packets allowed to be sent
+     */
+    inline size_t __shape_tx_pkts(soc_token_bucket_t &bucket, Buffer **tx, size_t tx_size) {
+        size_t now_tsc = rdtsc();
+        size_t elapsed_tsc = std::min(now_tsc - bucket.last_tsc, bucket.fill_tsc);
+        bucket.last_tsc = now_tsc;
+        bucket.tokens = std::min(bucket.tokens + elapsed_tsc * bucket.rate, bucket.depth);
+        size_t nb_pass = 0;
+        while (nb_pass < tx_size) {
+            size_t cost = static_cast<size_t>(tx[nb_pass]->length_) << kShaperShift;
+            if (cost > bucket.tokens) {
+                bucket.nb_throttled++;
+                break;
+            }
+            bucket.tokens -= cost;
+            nb_pass++;
+        }
+        return nb_pass;
+    }
 
     /* ========================SoC Datapath ========================*/
 
     /**
-     * \brief Post receive wrs to the NIC, and update the recv head
+     * \brief Post receive wrs to the NIC, each with a buffer popped from the free stack of
+     *        the QP, and update the recv head
      * \param RDMA_SoC_QP *qp, the QP for receiving packets
-     * \param size_t num_recvs, the number of receive wrs to be posted
+     * \param size_t num_recvs, the number of receive wrs to be posted, at most the number
+     *        of free buffers
      */
     static void __post_recvs(RDMA_SoC_QP *qp, size_t num_recvs) {
         // The recvs posted are @first_wr through @last_wr, inclusive
@@ -123,6 +508,15 @@ class SoCWrapper {
         size_t last_wr_i = first_wr_i + (num_recvs - 1);
         if (last_wr_i >= RDMA_SoC_QP::kNumRxRingEntries) last_wr_i -= RDMA_SoC_QP::kNumRxRingEntries;
 
+        // bind the buffers to the wrs, completions come back in the order of the wrs
+        for (size_t i = 0, wr_i = first_wr_i; i < num_recvs; i++, wr_i = (wr_i + 1) % RDMA_SoC_QP::kNumRxRingEntries) {
+            Buffer *m = qp->_free_bufs[--qp->_nb_free_bufs];
+            m->state_ = Buffer::kPOSTED;
+            qp->_rx_ring[wr_i] = m;
+            qp->_recv_sgl[wr_i].addr = reinterpret_cast<uint64_t>(m->get_buf());
+            qp->_recv_sgl[wr_i].lkey = m->lkey_;
+        }
+
         first_wr = &qp->_recv_wr[first_wr_i];
         last_wr = &qp->_recv_wr[last_wr_i];
         temp_wr = last_wr->next;
@@ -139,8 +533,48 @@ class SoCWrapper {
         // Update RECV head: go to the last wr posted and take 1 more step
         qp->_recv_head = last_wr_i;
         qp->_recv_head = (qp->_recv_head + 1) % RDMA_SoC_QP::kNumRxRingEntries;
+        qp->_nb_posted_recvs += num_recvs;
+    }
+
+    /**
+     * \brief Move the rx buffers released by the workers to the free stack of the QP
+     * \param RDMA_SoC_QP *qp, the QP the buffers belong to
+     */
+    inline void __reclaim_worker_bufs(RDMA_SoC_QP *qp) {
+        size_t room = RDMA_SoC_QP::kNumRxRingEntries - qp->_nb_free_bufs;
+        if (room > 0) {
+            size_t nb_reclaim = qp->_recycle_worker_queue->dequeue_burst(
+                (uint8_t**)&qp->_free_bufs[qp->_nb_free_bufs], room);
+            this->__clear_buf_holders(&qp->_free_bufs[qp->_nb_free_bufs], nb_reclaim);
+            qp->_nb_free_bufs += nb_reclaim;
+        }
+    }
+
+    /**
+     * \brief Release an rx buffer, the dispatcher pushes it onto the free stack of its QP
+     *        right away, a pure worker returns it to the dispatcher through the recycle queue
+     * \param Buffer *m, the buffer
+     */
+    inline void __free_buf(Buffer *m) {
+        if (this->_type & kSoC_Dispatcher) {
+            m->rx_qp_->push_free_buf(m);
+            return;
+        }
+        m->state_ = Buffer::kFREE_BUF;
+        this->_worker_free_bufs[this->_nb_worker_free_bufs++] = m;
+        if (unlikely(this->_nb_worker_free_bufs == kQueueBurstSize)) {
+            this->__flush_worker_free_bufs();
+        }
     }
 
+    /**
+     * \brief Push the buffers released by a pure worker into the recycle queue, which holds
+     *        every rx buffer of the QP feeding the workers, so there is room once the dispatcher catches up
+     * \param bool is_stopping, the wrapper stops, and the dispatcher may be gone: give up
+     *        after kStopFlushMs rather than wait for it forever
+     */
+    void __flush_worker_free_bufs(bool is_stopping = false);
+
     /**
      * \brief Receive packets from the NIC and put them into the dispatcher rx queue.
      * \param RDMA_SoC_QP *qp, the QP for receiving packets
@@ -148,24 +582,495 @@ class SoCWrapper {
      */
     size_t __rx_burst(RDMA_SoC_QP *qp);
 
+    /// sampling state of the tap on a QP
+    struct soc_mirror_tap_t {
+        uint32_t sample_n = 0;      /// sample every sample_n-th packet, 0 if the QP is not tapped
+        uint32_t nb_skip = 0;       /// packets to skip before the next sample
+        size_t gap_tsc = 0;         /// least cycles between two samples
+        size_t next_tsc = 0;        /// earliest TSC of the next sample
+    };
+
+    /**
+     * \brief Copy the sampled packets of an rx burst into the mirror ring
+     * \param RDMA_SoC_QP *qp, the QP which received the packets
+     * \param size_t first, position of the first received packet in the rx ring
+     * \param size_t nb_pkts, the number of received packets
+     */
+    void __mirror_rx_pkts(RDMA_SoC_QP *qp, size_t first, size_t nb_pkts);
+
     /**
-     * \brief Dispatch packets from the dispatcher rx queue to the worker rx queue 
-     * based on packet UDP field. Workspace will be blocked until all packets are
-     * dispatched.
+     * \brief Dispatch packets from the dispatcher rx queue to the worker rx queues,
+     * by the hash of their 5-tuple or in turn according to the dispatch policy.
+     * Workspace will be blocked until all packets are dispatched.
      * \param RDMA_SoC_QP *qp, the QP for receiving packets
      * \return the number of packets dispatched
      */
     size_t __dispatch_rx_pkts(RDMA_SoC_QP *qp);
 
     /**
-     * \brief Iterate all worker queues assigned to this dispatcher, and collect packets from them.
+     * \brief Dispatch a burst of packets to the rx queues of a worker, spilling packets the
+     *        worker can not take to the following workers, except with traffic classes
+     * \param RDMA_SoC_QP *qp, the QP for receiving packets
+     * \param uint16_t worker_id, the worker to dispatch to first
+     * \param Buffer **burst, the packets to be dispatched
+     * \param size_t nb_burst, the number of packets
+     * \param uint32_t *worker_mask, [out] the workers which received packets
+     * \return the number of packets dispatched, the rest is dropped
+     */
+    size_t __dispatch_rx_burst(RDMA_SoC_QP *qp, uint16_t worker_id, Buffer **burst, size_t nb_burst, uint32_t *worker_mask);
+
+    /**
+     * \brief Dispatch a burst of packets to the workers selected by their flow hash, packets
+     *        a worker can not take are dropped to keep the flows on their workers
+     * \param RDMA_SoC_QP *qp, the QP for receiving packets
+     * \param Buffer **burst, the packets to be dispatched
+     * \param size_t nb_burst, the number of packets
+     * \param uint32_t *worker_mask, [out] the workers which received packets
+     * \return the number of packets dispatched
+     */
+    size_t __dispatch_rx_burst_by_flow(RDMA_SoC_QP *qp, Buffer **burst, size_t nb_burst, uint32_t *worker_mask);
+
+    /**
+     * \brief Dispatch a burst of packets with the dispatch policy of the block
+     * \param RDMA_SoC_QP *qp, the QP for receiving packets
+     * \param Buffer **burst, the packets to be dispatched
+     * \param size_t nb_burst, the number of packets
+     * \param uint32_t *worker_mask, [out] the workers which received packets
+     * \return the number of packets dispatched
+     */
+    size_t __dispatch_rx_burst_by_policy(RDMA_SoC_QP *qp, Buffer **burst, size_t nb_burst, uint32_t *worker_mask);
+
+    /**
+     * \brief Retry the packets held back by backpressure, in their order; packets still
+     *        rejected stay held, with all packets after them
+     * \param RDMA_SoC_QP *qp, the QP for receiving packets
+     * \param uint32_t *worker_mask, [out] the workers which received packets
+     * \return the number of packets dispatched
+     */
+    size_t __dispatch_held_rx_pkts(RDMA_SoC_QP *qp, uint32_t *worker_mask);
+
+    /**
+     * \brief Handle a packet the dispatcher can not hand to its worker: under backpressure
+     *        it is held, together with its rx buffer, to be retried; otherwise it is dropped
+     *        and its buffer reposted
+     * \param Buffer *pkt, the packet
+     */
+    inline void __reject_rx_pkt(Buffer *pkt) {
+        if (this->_bp_held != nullptr) {
+            this->_bp_held[this->_bp_nb_held++] = pkt;
+            return;
+        }
+        pkt->rx_qp_->push_free_buf(pkt);
+        this->_drop_stats[kSoC_Drop_WorkerQueueFull]++;
+    }
+
+    /**
+     * \brief Dispatch a burst of packets, every kP2cPickSize packets to the less loaded of
+     *        two random workers
+     * \param RDMA_SoC_QP *qp, the QP for receiving packets
+     * \param Buffer **burst, the packets to be dispatched
+     * \param size_t nb_burst, the number of packets
+     * \param uint32_t *worker_mask, [out] the workers which received packets
+     * \return the number of packets dispatched
+     */
+    size_t __dispatch_rx_burst_by_load(RDMA_SoC_QP *qp, Buffer **burst, size_t nb_burst, uint32_t *worker_mask);
+
+    /**
+     * \brief Pick the less loaded of two distinct random workers, from the load estimates
+     *        of the dispatcher, so that no remote cache line is touched per packet
+     * \return the worker
+     */
+    inline uint16_t __pick_least_loaded_worker() {
+        const uint32_t nb_workers = this->_context->config.nb_workers;
+        if (unlikely(nb_workers == 1)) return 0;
+        // one LCG step gives both samples, multiply-shift instead of modulo maps them into the range
+        this->_p2c_rng = this->_p2c_rng * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t rand = static_cast<uint32_t>(this->_p2c_rng >> 32);
+        uint16_t a = static_cast<uint16_t>(((rand & 0xffff) * nb_workers) >> 16);
+        uint16_t b = static_cast<uint16_t>(((rand >> 16) * (nb_workers - 1)) >> 16);
+        b += (b >= a);
+        return this->_p2c_load[a] <= this->_p2c_load[b] ? a : b;
+    }
+
+    /**
+     * \brief Dispatch a burst of packets to the worker rx queues of their traffic classes
+     * \param RDMA_SoC_QP *qp, the QP for receiving packets
+     * \param uint16_t worker_id, the worker to dispatch to
+     * \param Buffer **burst, the packets to be dispatched
+     * \param size_t nb_burst, the number of packets
+     * \param const uint16_t *buckets, RSS buckets of the packets, whose drain positions are
+     *        recorded, nullptr if the packets are not dispatched by flow
+     * \return the number of packets dispatched
+     */
+    size_t __dispatch_rx_pkts_by_class(RDMA_SoC_QP *qp, uint16_t worker_id, Buffer **burst, size_t nb_burst,
+                                       const uint16_t *buckets);
+
+    /**
+     * \brief Get the RSS bucket of a packet from the hash of its 5-tuple
+     * \param Buffer *pkt, the packet
+     * \return the bucket, in [0, kSoCRssRetaSize)
+     */
+    static inline uint16_t __get_rss_bucket(Buffer *pkt) {
+        return static_cast<uint16_t>(pkt->meta_.flow_hash_ % kSoCRssRetaSize);
+    }
+
+    /**
+     * \brief 5-tuple of a packet, packed into two words
+     */
+    struct soc_flow_key {
+        uint64_t addrs;
+        uint64_t ports;
+        inline bool operator==(const soc_flow_key &other) const {
+            return addrs == other.addrs && ports == other.ports;
+        }
+    };
+
+    /**
+     * \brief Get the 5-tuple of a packet from its parsed metadata, IPv6 addresses are folded
+     *        into 32 bits, which leaves the key of an IPv4 packet as its plain addresses
+     * \param Buffer *pkt, the packet
+     * \return the flow key
+     */
+    static inline soc_flow_key __get_flow_key(Buffer *pkt) {
+        const pkt_meta &meta = pkt->meta_;
+        uint32_t saddr = meta.saddr_[0] ^ meta.saddr_[1] ^ meta.saddr_[2] ^ meta.saddr_[3];
+        uint32_t daddr = meta.daddr_[0] ^ meta.daddr_[1] ^ meta.daddr_[2] ^ meta.daddr_[3];
+        soc_flow_key key;
+        key.addrs = (static_cast<uint64_t>(saddr) << 32) | daddr;
+        key.ports = (static_cast<uint64_t>(meta.sport_) << 24) | (static_cast<uint64_t>(meta.dport_) << 8) | meta.l4_proto_;
+        return key;
+    }
+
+    /**
+     * \brief Parse the L3/L4 headers of a packet into its metadata, behind up to kMaxVlanTags
+     *        VLAN tags; IPv6 extension headers are not walked
+     * \param Buffer *pkt, the packet, whose metadata holds the defaults of an untagged packet
+     * \return whether the L3/L4 headers, and the ws_hdr behind them, were found within
+     *         the packet
+     */
+    static inline bool __parse_pkt_hdrs(Buffer *pkt) {
+        pkt_meta &meta = pkt->meta_;
+        const uint8_t *buf = pkt->get_buf();
+        const uint32_t len = pkt->length_;
+        uint32_t off = kEthHdrLen;
+        uint32_t l4_off;
+
+        if (unlikely(len < kEthHdrLen)) return false;
+        uint16_t ether_type = ntohs(reinterpret_cast<const struct ether_header*>(buf)->ether_type);
+        for (size_t i = 0; i < kMaxVlanTags && (ether_type == ETHERTYPE_VLAN || ether_type == kEthTypeQinQ); i++) {
+            /// a tag is the TCI followed by the inner ethertype
+            if (unlikely(off + 4 > len)) return false;
+            ether_type = ntohs(*reinterpret_cast<const uint16_t*>(buf + off + 2));
+            off += 4;
+            meta.flags_ |= pkt_meta::kVLAN;
+        }
+        meta.ether_type_ = ether_type;
+        meta.l3_offset_ = static_cast<uint16_t>(off);
+
+        if (likely(ether_type == ETHERTYPE_IP)) {
+            if (unlikely(off + sizeof(struct iphdr) > len)) return false;
+            const struct iphdr *iph = reinterpret_cast<const struct iphdr*>(buf + off);
+            if (unlikely(iph->ihl < 5)) return false;
+            meta.tos_ = iph->tos;
+            meta.l4_proto_ = iph->protocol;
+            meta.saddr_[0] = iph->saddr;
+            meta.daddr_[0] = iph->daddr;
+            l4_off = off + iph->ihl * 4;
+            if (unlikely(l4_off > len)) return false;
+        } else if (ether_type == ETHERTYPE_IPV6) {
+            if (unlikely(off + sizeof(struct ip6_hdr) > len)) return false;
+            const struct ip6_hdr *ip6h = reinterpret_cast<const struct ip6_hdr*>(buf + off);
+            meta.flags_ |= pkt_meta::kIPV6;
+            meta.tos_ = static_cast<uint8_t>(ntohl(ip6h->ip6_flow) >> 20);
+            meta.l4_proto_ = ip6h->ip6_nxt;
+            memcpy(meta.saddr_, &ip6h->ip6_src, IP6_ADDR_SIZE);
+            memcpy(meta.daddr_, &ip6h->ip6_dst, IP6_ADDR_SIZE);
+            l4_off = off + sizeof(struct ip6_hdr);
+        } else {
+            return false;
+        }
+        meta.l4_offset_ = static_cast<uint16_t>(l4_off);
+
+        if (meta.l4_proto_ == IPPROTO_UDP) {
+            if (unlikely(l4_off + sizeof(struct udphdr) > len)) return false;
+            const struct udphdr *uh = reinterpret_cast<const struct udphdr*>(buf + l4_off);
+            meta.sport_ = uh->source;
+            meta.dport_ = uh->dest;
+            meta.ws_hdr_offset_ = static_cast<uint16_t>(l4_off + sizeof(struct udphdr));
+            if (unlikely(meta.ws_hdr_offset_ + sizeof(struct ws_hdr) > len)) return false;
+        } else if (meta.l4_proto_ == IPPROTO_TCP) {
+            if (unlikely(l4_off + sizeof(struct tcphdr) > len)) return false;
+            const struct tcphdr *th = reinterpret_cast<const struct tcphdr*>(buf + l4_off);
+            if (unlikely(th->doff < 5)) return false;
+            meta.sport_ = th->source;
+            meta.dport_ = th->dest;
+            meta.ws_hdr_offset_ = static_cast<uint16_t>(l4_off + th->doff * 4);
+            if (unlikely(meta.ws_hdr_offset_ + sizeof(struct ws_hdr) > len)) return false;
+        } else {
+            /// flows of other protocols are told apart by their addresses only
+            meta.ws_hdr_offset_ = static_cast<uint16_t>(l4_off);
+            if (unlikely(meta.ws_hdr_offset_ + sizeof(struct ws_hdr) > len)) return false;
+        }
+        return true;
+    }
+
+    /**
+     * \brief Fill the metadata of a received packet once, so that neither the dispatcher nor
+     *        the kernels parse its headers again; a packet which can't be parsed keeps the
+     *        offsets of an untagged IPv4/UDP packet and an empty 5-tuple
+     * \param Buffer *pkt, the packet
+     */
+    static inline void __parse_rx_pkt(Buffer *pkt) {
+        pkt_meta &meta = pkt->meta_;
+        uint64_t rx_tsc = meta.rx_tsc_;
+        meta = pkt_meta();
+        if (likely(__parse_pkt_hdrs(pkt))) {
+            meta.flags_ |= pkt_meta::kPARSED;
+        } else {
+            /// drop whatever was parsed before the headers ran out
+            meta = pkt_meta();
+        }
+        meta.rx_tsc_ = rx_tsc;
+        meta.flow_hash_ = __get_flow_hash(__get_flow_key(pkt));
+    }
+
+    /**
+     * \brief Hash a flow key
+     * \param const soc_flow_key &key, the flow key
+     * \return the hash
+     */
+    static inline uint64_t __get_flow_hash(const soc_flow_key &key) {
+        uint64_t hash = key.addrs * 0x9e3779b97f4a7c15ULL ^ key.ports * 0xc2b2ae3d27d4eb4fULL;
+        hash ^= hash >> 29;
+        hash ^= hash >> 17;
+        return hash;
+    }
+
+    /**
+     * \brief Get the worker of an RSS bucket; a bucket reprogrammed to another worker only
+     *        moves once its old worker has retired every packet of it, so that the packets
+     *        of a flow are never reordered
+     * \param RDMA_SoC_QP *qp, the QP for receiving packets
+     * \param uint16_t bucket, the RSS bucket
+     * \return the worker
+     */
+    inline uint16_t __get_rss_worker(RDMA_SoC_QP *qp, uint16_t bucket) {
+        uint16_t worker_id = this->_rss_bucket_worker[bucket];
+        uint16_t target = qp->_rss_reta[bucket].load(std::memory_order_relaxed);
+        if (likely(target == worker_id) || unlikely(target >= this->_context->config.nb_workers)) {
+            return worker_id;
+        }
+        for (uint8_t i = 0; i < this->_context->config.nb_traffic_classes; i++) {
+            if (!qp->_disp_worker_queues[worker_id][i]->is_retired(this->_rss_drain_pos[bucket][i])) {
+                this->_rss_stats.nb_deferred++;
+                return worker_id;
+            }
+        }
+        this->_rss_bucket_worker[bucket] = target;
+        memset(this->_rss_drain_pos[bucket], 0, sizeof(this->_rss_drain_pos[bucket]));
+        this->_rss_stats.nb_migrations++;
+        return target;
+    }
+
+    /**
+     * \brief Mark the messages dequeued from the worker rx queues as finished
+     */
+    inline void __retire_worker_rx_msgs() {
+        for (uint8_t i = 0; i < this->_context->config.nb_traffic_classes; i++) {
+            this->_tmp_worker_rx_queues[i]->retire();
+        }
+    }
+
+    /**
+     * \brief Get the traffic class of a packet from the configured packet field
+     * \param Buffer *pkt, the packet
+     * \return the traffic class
+     */
+    inline uint8_t __classify_rx_pkt(Buffer *pkt) {
+        const SoCWrapperConfig &config = this->_context->config;
+        uint8_t field;
+        if (config.class_field == kSoC_ClassField_Dscp) {
+            field = pkt->meta_.tos_ >> 2;
+        } else {
+            field = reinterpret_cast<struct ws_hdr*>(pkt->get_ws_hdr())->workload_type_;
+        }
+        return config.class_of_field[field];
+    }
+
+    /**
+     * \brief Dequeue messages from the worker rx queues according to the class scheduling
+     * \param Buffer **msgs, [out] the array receiving the messages
+     * \param size_t nb_msgs, the capacity of msgs
+     * \return the number of messages dequeued
+     */
+    size_t __dequeue_worker_rx_msgs(Buffer **msgs, size_t nb_msgs);
+
+    /**
+     * \brief Get the number of messages waiting in the worker rx queues of all classes
+     * \return the number of messages
+     */
+    inline size_t __get_worker_rx_queue_size() {
+        size_t size = 0;
+        for (uint8_t i = 0; i < this->_context->config.nb_traffic_classes; i++) {
+            size += this->_tmp_worker_rx_queues[i]->get_size();
+        }
+        return size;
+    }
+
+    /**
+     * \brief Collect packets from the fan-in queue shared by all workers assigned to this dispatcher.
      * \param RDMA_SoC_QP *qp, the QP for sending packets
      * \return the number of packets collected
      */
     size_t __collect_tx_pkts(RDMA_SoC_QP *qp);
 
     /**
-     * \brief Post send wrs to the NIC, and update the send head
+     * \brief Collect packets from the fan-in queue and restore the order within each flow,
+     *        in-order packets pass through, the others wait in the reorder buffer of their flow
+     * \param RDMA_SoC_QP *qp, the QP for sending packets
+     * \return the number of packets collected
+     */
+    size_t __collect_tx_pkts_in_order(RDMA_SoC_QP *qp);
+
+    /**
+     * \brief Move the packets following the next expected one of a flow out of its reorder
+     *        buffer, as long as the tx queue has room
+     * \param RDMA_SoC_QP *qp, the QP for sending packets
+     * \param uint16_t flow_id, the flow slot
+     */
+    void __drain_reorder_flow(RDMA_SoC_QP *qp, uint16_t flow_id);
+
+    /**
+     * \brief Give up on the missing packets of the flows which waited longer than the timeout,
+     *        and drain those whose draining was stopped by a full tx queue
+     * \param RDMA_SoC_QP *qp, the QP for sending packets
+     */
+    void __expire_reorder_flows(RDMA_SoC_QP *qp);
+
+    /**
+     * \brief Tag each packet of a burst with the next sequence number of its flow
+     * \param Buffer **burst, the packets
+     * \param size_t nb_burst, the number of packets
+     */
+    inline void __tag_rx_burst(Buffer **burst, size_t nb_burst) {
+        for (size_t i = 0; i < nb_burst; i++) {
+            uint16_t flow = static_cast<uint16_t>(burst[i]->meta_.flow_hash_ & (kReorderFlowNum - 1));
+            burst[i]->order_flow_ = flow;
+            burst[i]->order_seq_ = this->_reorder_disp_seq[flow]++;
+        }
+    }
+
+    /**
+     * \brief Push messages processed by the worker into the fan-in queue towards the dispatcher,
+     *        messages that do not fit are dropped and returned to the rx ring, unless a pure
+     *        worker under backpressure, which waits for the dispatcher to make room until
+     *        the wrapper stops, then drops the rest.
+     * \param Buffer **msgs, the array of processed messages
+     * \param size_t nb_msgs, the number of processed messages
+     * \return the number of messages enqueued
+     */
+    size_t __enqueue_worker_tx_msgs(Buffer **msgs, size_t nb_msgs);
+
+    /**
+     * \brief Fetch messages for the worker, either directly from the dispatcher queue, or
+     *        through the stealable rx deque of the worker when work stealing is enabled.
+     * \param Buffer **msgs, [out] the array receiving the messages
+     * \param size_t nb_msgs, the capacity of msgs
+     * \return the number of messages fetched
+     */
+    size_t __fetch_worker_rx_msgs(Buffer **msgs, size_t nb_msgs);
+
+    /**
+     * \brief Steal messages from the rx deques of the sibling workers of the same block,
+     *        victims are visited round-robin starting after the last one visited.
+     * \param Buffer **msgs, [out] the array receiving the messages
+     * \param size_t nb_msgs, the capacity of msgs
+     * \return the number of messages stolen
+     */
+    size_t __steal_worker_rx_msgs(Buffer **msgs, size_t nb_msgs);
+
+    /**
+     * \brief Run the user defined message handler over a batch of messages and push
+     *        them towards the dispatcher. The burst handler, if registered, gets the
+     *        whole batch in one call, otherwise the message handler is called per message.
+     * \param Buffer **msgs, the array of received messages
+     * \param size_t nb_msgs, the number of received messages, at most kAppRxMsgBatchSize
+     */
+    void __handle_worker_rx_msgs(Buffer **msgs, size_t nb_msgs);
+
+    /**
+     * \brief Reassemble the segments of multi-packet messages. The segments of a message
+     *        must follow each other within their flow, which RSS dispatch without work
+     *        stealing guarantees. Only a segment carrying kWsSegFirst starts a message, so
+     *        the segments following a lost one are dropped rather than taken for a shorter
+     *        message. Complete messages are chained from their first segment through
+     *        Buffer::msg_next_ and replace the segments in pkts, in place.
+     * \param Buffer **pkts, [in/out] the received packets, then the complete messages
+     * \param size_t nb_pkts, the number of received packets
+     * \return the number of complete messages
+     */
+    size_t __reassemble_worker_rx_msgs(Buffer **pkts, size_t nb_pkts);
+
+    /**
+     * \brief Return the segments of a message to the rx ring
+     * \param Buffer *head, the first segment of the message
+     * \param soc_drop_reason_t reason, why the message is dropped
+     */
+    inline void __drop_msg_segments(Buffer *head, soc_drop_reason_t reason) {
+        while (head != nullptr) {
+            Buffer *next = head->msg_next_;
+            head->msg_next_ = nullptr;
+            head->msg_nb_segs_ = 1;
+            this->__free_buf(head);
+            this->_drop_stats[reason]++;
+            head = next;
+        }
+    }
+
+    /**
+     * \brief Drop the messages which have been reassembled for longer than the timeout,
+     *        their segments are returned to the rx ring
+     * \param bool reclaim_all, drop all incomplete messages regardless of their age
+     */
+    void __reclaim_worker_rx_msgs(bool reclaim_all);
+
+    /**
+     * \brief Push processed messages towards the dispatcher segment by segment
+     * \param Buffer **msgs, the first segments of the processed messages
+     * \param size_t nb_msgs, the number of processed messages
+     */
+    void __enqueue_worker_tx_segments(Buffer **msgs, size_t nb_msgs);
+
+    /**
+     * \brief Start the asynchronous message handler on received messages, messages done right
+     *        away are forwarded, the others stay in flight
+     * \param Buffer **msgs, the array of received messages
+     * \param size_t nb_msgs, the number of received messages, at most the free in-flight slots
+     */
+    void __start_async_msgs(Buffer **msgs, size_t nb_msgs);
+
+    /**
+     * \brief Resume the in-flight messages whose awaited operation completed, and forward
+     *        the messages done
+     * \return the number of messages done
+     */
+    size_t __resume_async_msgs();
+
+    /**
+     * \brief Get the number of messages the asynchronous message handler can still take
+     * \return the number of free in-flight slots, or SIZE_MAX without asynchronous handler
+     */
+    inline size_t __get_async_room() {
+        if (likely(this->_context->async_msg_handler == nullptr)) {
+            return SIZE_MAX;
+        }
+        return kAsyncMaxInflight - this->_async_nb_inflight;
+    }
+
+    /**
+     * \brief Post send wrs to the NIC, and update the send head. A completion is only
+     *        requested every kTxSignalInterval wrs and on the last wr of the post list, and
+     *        releases all buffers sent up to its wr
      * \param RDMA_SoC_QP *qp, the QP for sending packets
      * \param Buffer **tx, the array of buffers to be sent
      * \param size_t tx_size, the number of buffers to be sent
@@ -175,7 +1080,8 @@ class SoCWrapper {
 
     /**
      * \brief Flush the dispatcher tx queue to the NIC. Dispatcher will be blocked
-     * until all packets are sent
+     * until all packets allowed by the egress shaper of the QP are sent, the others
+     * stay at the head of the tx queue for the next flush
      * \param RDMA_SoC_QP *qp, the QP for sending packets
      * \return the number of packets sent
      */
@@ -190,12 +1096,24 @@ class SoCWrapper {
     size_t __direct_tx_burst(RDMA_SoC_QP *rx_qp, RDMA_SoC_QP *tx_qp);
 
     /**
-     * \brief Forward packet using routing decision based on kernel return value
-     * \param packet            packet buffer to forward
-     * \param kernel_retval     return value from user kernel
-     * \return NICC_SUCCESS for successful forwarding
+     * \brief Route a handled message by the return value of the handler, a single load
+     *        from the route table of the block
+     * \param Buffer *msg, the message
+     * \param nicc_retval_t ret, the return value of the handler
+     * \return true if the message is forwarded to the next block, false if it is dropped
      */
-    nicc_retval_t __forward_packet_with_routing(Buffer* packet, nicc_core_retval_t kernel_retval);
+    inline bool __route_msg(Buffer *msg, nicc_retval_t ret) {
+        uint8_t route = this->_context->config.route_of_retval[static_cast<nicc_core_retval_t>(ret)];
+        if (likely(route != kSoC_Route_Drop)) {
+            if (unlikely(route == kSoC_Route_Default && ret != NICC_SUCCESS)) {
+                /// processing failed, log warning but still forward
+                NICC_WARN_C("User msg handler failed: ret=%d, still forwarding message", ret);
+            }
+            return true;
+        }
+        this->__drop_msg_segments(msg, kSoC_Drop_Route);
+        return false;
+    }
 
 /**
  * ----------------------Internel parameters----------------------
@@ -208,8 +1126,136 @@ class SoCWrapper {
     RDMA_SoC_QP *_qp_for_next = nullptr;
 
     /// tmp shm queue for testing
-    soc_shm_lock_free_queue* _tmp_worker_rx_queue = nullptr;
-    soc_shm_lock_free_queue* _tmp_worker_tx_queue = nullptr;
+    soc_shm_lock_free_queue* _tmp_worker_rx_queues[kSoCMaxTrafficClasses] = { nullptr };
+    /// next worker the dispatcher hands a burst to
+    uint16_t _disp_worker_cursor = 0;
+    /// worker currently serving each RSS bucket, lags behind the indirection table while
+    /// the bucket drains from its old worker
+    uint16_t _rss_bucket_worker[kSoCRssRetaSize] = { 0 };
+    /// position after the last packet of each RSS bucket in the queues of its worker
+    size_t _rss_drain_pos[kSoCRssRetaSize][kSoCMaxTrafficClasses] = {};
+    struct {
+        size_t nb_migrations = 0;
+        size_t nb_deferred = 0;
+    } _rss_stats;
+    /// load estimate of each worker for power of two choices, refreshed from the worker
+    /// queues once per dispatch round and counted up locally within the round
+    size_t _p2c_load[kSoCWorkspaceMaxNum] = { 0 };
+    uint64_t _p2c_rng = 0x9e3779b97f4a7c15ULL;
+    /// deficit round robin state among traffic classes
+    uint32_t _drr_deficit[kSoCMaxTrafficClasses] = { 0 };
+    uint8_t _drr_cursor = 0;
+    soc_shm_mpsc_queue* _tmp_worker_tx_queue = nullptr;
+    /// rx buffers released by a pure worker, batched towards the dispatcher
+    soc_shm_recycle_queue* _tmp_worker_recycle_queue = nullptr;
+    Buffer *_worker_free_bufs[kQueueBurstSize];
+    size_t _nb_worker_free_bufs = 0;
+    /// stealable rx deque of this worker, nullptr if work stealing is disabled
+    soc_shm_ws_deque* _tmp_worker_ws_deque = nullptr;
+    size_t _steal_victim_idx = 0;
+
+    /// messages under reassembly, indexed by the flow hash
+    struct soc_reassembly_slot {
+        soc_flow_key flow;
+        uint16_t msg_id = 0;            /// ws_hdr::msg_id_ of the message
+        Buffer *head = nullptr;         /// first segment, nullptr if the slot is free
+        Buffer *tail = nullptr;
+        size_t nb_remain = 0;           /// segments still to come
+        size_t start_tsc = 0;
+        bool discard = false;           /// drop the segments of an oversized message
+    } _reassembly_slots[kReassemblySlotNum];
+    size_t _nb_reassembly_pending = 0;
+    size_t _reassembly_timeout_tsc = 0;
+    size_t _reassembly_check_tsc = 0;
+    struct {
+        size_t nb_msgs = 0;
+        size_t nb_timeouts = 0;
+        size_t nb_broken = 0;
+        size_t nb_orphans = 0;          /// segments dropped as their message has no first segment
+        size_t nb_oversized = 0;
+    } _reassembly_stats;
+
+    /// per-flow reorder stage of ordered blocks whose flows are spread over workers, the
+    /// dispatcher tags on rx and restores the order on tx collect; nullptr if not needed
+    struct soc_reorder_flow {
+        uint32_t next_seq = 0;          /// next sequence number to send
+        uint32_t nb_held = 0;
+        size_t hold_tsc = 0;            /// since when the flow waits for next_seq
+        Buffer *held[kReorderWindow] = { nullptr };     /// indexed by sequence number
+    } *_reorder_flows = nullptr;
+    uint32_t _reorder_disp_seq[kReorderFlowNum] = { 0 };
+    size_t _reorder_nb_held = 0;
+    size_t _reorder_timeout_tsc = 0;
+    size_t _reorder_check_tsc = 0;
+    struct {
+        size_t nb_reordered = 0;
+        size_t nb_gaps = 0;
+        size_t nb_late = 0;
+    } _reorder_stats;
+
+    /// in-flight messages of the asynchronous message handler
+    struct soc_async_slot {
+        Buffer *msg = nullptr;
+        soc_async_ctx ctx;
+    };
+    soc_async_slot _async_slots[kAsyncMaxInflight];
+    uint16_t _async_inflight[kAsyncMaxInflight];   /// indices of the slots in flight
+    uint16_t _async_free[kAsyncMaxInflight];       /// indices of the free slots
+    size_t _async_nb_inflight = 0;
+
+    /// packets held back by backpressure, in rx order, nullptr if the block drops instead
+    Buffer **_bp_held = nullptr;
+    size_t _bp_nb_held = 0;
+
+    /// liveness of the external worker processes of a dispatcher
+    struct {
+        soc_shm_segment_hdr *segment = nullptr;     /// nullptr if the workers run in this process
+        int32_t pids[kSoCWorkspaceMaxNum] = { 0 };  /// process last seen in each worker slot
+        int32_t dead_pid = 0;       /// process under recovery, 0 if none
+        uint16_t dead_worker = 0;
+        size_t tx_tail = 0;         /// fan-in queue slots claimed when the death was noticed
+        size_t recycle_tail = 0;    /// recycle queue slots claimed when the death was noticed
+        size_t dead_tsc = 0;
+        size_t check_tsc = 0;
+        size_t check_interval_tsc = 0;
+        size_t grace_tsc = 0;
+        size_t nb_dead = 0;
+        size_t nb_skipped = 0;      /// slots claimed and never published by dead processes
+        size_t nb_reclaimed = 0;    /// buffers held by dead processes
+    } _ext_workers;
+    /// pid of this external worker process, stamped on the buffers it holds, 0 for a thread
+    int32_t _holder_pid = 0;
+    /// dropped packets per soc_drop_reason_t, reported when the wrapper stops
+    size_t _drop_stats[kSoC_Drop_NumReasons] = { 0 };
+
+    /// idle wait strategy, in cycles
+    size_t _idle_spin_tsc = 0;
+    size_t _idle_backoff_tsc = 0;
+    size_t _idle_sleep_us = 0;
+    double _freq_ghz = 0.0;
+    /// TSC at which the run loop stops, backpressure waits give up past it
+    size_t _stop_tsc = SIZE_MAX;
+
+    /// adaptive batching of worker rx messages and of the tx flush towards the next block
+    adaptive_batch_t _worker_rx_batch;
+    adaptive_batch_t _tx_batch;
+    size_t _batch_deadline_tsc = 0;
+    /// egress shapers of the dispatcher, one per QP
+    soc_token_bucket_t _shaper_next;
+    soc_token_bucket_t _shaper_prior;
+    /// sampling tap of the dispatcher, nullptr if no QP is tapped
+    soc_mirror *_mirror = nullptr;
+    soc_mirror_tap_t _mirror_next;
+    soc_mirror_tap_t _mirror_prior;
+    /// stats of idle waits, reported when the wrapper stops
+    struct {
+        size_t nb_sleeps = 0;
+        size_t nb_doorbell_wakes = 0;
+        size_t nb_cq_event_wakes = 0;
+        size_t nb_latency_samples = 0;
+        size_t wake_latency_tsc_sum = 0;
+        size_t wake_latency_tsc_max = 0;
+    } _idle_stats;
 };
 
 
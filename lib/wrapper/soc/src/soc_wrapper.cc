@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <poll.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
 #include "soc_wrapper.h"
 
 namespace nicc {
@@ -9,17 +14,83 @@ SoCWrapper::SoCWrapper(soc_wrapper_type_t type, SoCWrapperContext *context) {
     }
     this->_type = type;
     NICC_CHECK_POINTER(this->_context = context);
-    NICC_CHECK_POINTER(this->_qp_for_prior = context->qp_for_prior);
-    NICC_CHECK_POINTER(this->_qp_for_next = context->qp_for_next);
-    NICC_CHECK_POINTER(this->_tmp_worker_rx_queue = new soc_shm_lock_free_queue());
-    NICC_CHECK_POINTER(this->_tmp_worker_tx_queue = new soc_shm_lock_free_queue());
+    if (unlikely(context->config.nb_workers == 0
+        || context->config.nb_workers >= kSoCWorkspaceMaxNum)) {
+        NICC_WARN_C("Invalid number of workers %u, fall back to 1", context->config.nb_workers);
+        context->config.nb_workers = 1;
+    }
+    if (unlikely((type & kSoC_Worker) && context->worker_id >= context->config.nb_workers)) {
+        NICC_ERROR_C("Invalid worker id %u, the block has %u workers", context->worker_id, context->config.nb_workers);
+        return;
+    }
+    if (context->shm_segment != nullptr) {
+        /// external worker process, only the queues in the SHM segment are reachable
+        if (unlikely(type != kSoC_Worker)) {
+            NICC_ERROR_C("External process can only run as SoC worker");
+            return;
+        }
+        for (uint8_t i = 0; i < kSoCMaxTrafficClasses; i++) {
+            NICC_CHECK_POINTER(this->_tmp_worker_rx_queues[i] = context->shm_segment->get_worker_rx_queue(context->worker_id, i));
+        }
+        NICC_CHECK_POINTER(this->_tmp_worker_tx_queue = context->shm_segment->get_worker_tx_queue());
+        NICC_CHECK_POINTER(this->_tmp_worker_recycle_queue = context->shm_segment->get_worker_recycle_queue());
+        this->_holder_pid = static_cast<int32_t>(getpid());
+    } else {
+        NICC_CHECK_POINTER(this->_qp_for_prior = context->qp_for_prior);
+        NICC_CHECK_POINTER(this->_qp_for_next = context->qp_for_next);
+        /// queues are placed in the SHM segment of the channel, if any; otherwise only a
+        /// thread running as both dispatcher and worker may allocate them, as nobody else uses them
+        const bool is_single_thread = (type == (kSoC_Dispatcher | kSoC_Worker));
+        if (type & kSoC_Worker) {
+            for (uint8_t i = 0; i < kSoCMaxTrafficClasses; i++) {
+                this->_tmp_worker_rx_queues[i] = this->_qp_for_prior->_disp_worker_queues[context->worker_id][i];
+                if (this->_tmp_worker_rx_queues[i] == nullptr && is_single_thread) {
+                    NICC_CHECK_POINTER(this->_tmp_worker_rx_queues[i] = new soc_shm_lock_free_queue());
+                }
+                if (unlikely(this->_tmp_worker_rx_queues[i] == nullptr)) {
+                    NICC_ERROR_C("No rx queue for worker %u, the QP has no SHM segment", context->worker_id);
+                    return;
+                }
+            }
+        }
+        this->_tmp_worker_tx_queue = this->_qp_for_next->_collect_worker_queue;
+        if (this->_tmp_worker_tx_queue == nullptr && is_single_thread) {
+            NICC_CHECK_POINTER(this->_tmp_worker_tx_queue = new soc_shm_mpsc_queue());
+        }
+        if (unlikely(this->_tmp_worker_tx_queue == nullptr)) {
+            NICC_ERROR_C("No tx queue for the workers, the QP has no SHM segment");
+            return;
+        }
+        /// a thread which is also the dispatcher frees its buffers directly
+        this->_tmp_worker_recycle_queue = this->_qp_for_prior->_recycle_worker_queue;
+        if (unlikely(this->_tmp_worker_recycle_queue == nullptr && type == kSoC_Worker)) {
+            NICC_ERROR_C("No recycle queue for the workers, the QP has no SHM segment");
+            return;
+        }
+    }
+    if (unlikely(context->config.nb_traffic_classes == 0 
+        || context->config.nb_traffic_classes > kSoCMaxTrafficClasses)) {
+        NICC_WARN_C("Invalid number of traffic classes %u, fall back to 1", context->config.nb_traffic_classes);
+        context->config.nb_traffic_classes = 1;
+    }
+    /// the deque table lives in the QP, so only in-process workers steal
+    if (context->config.enable_work_stealing && this->_qp_for_prior != nullptr && (type & kSoC_Worker)) {
+        NICC_CHECK_POINTER(this->_tmp_worker_ws_deque = new soc_shm_ws_deque());
+    }
+    /// the async handler completes messages out of order, and the RSS bucket migration takes
+    /// the messages in flight for retired, so blocks which require packet order can't have it
+    if ((type & kSoC_Worker) && context->async_msg_handler != nullptr && !context->config.is_unordered) {
+        NICC_ERROR_C("Asynchronous message handlers are only for blocks with \"order\": \"false\"");
+        return;
+    }
     if (type & kSoC_Dispatcher) {
         // init the dispatcher
         if (this->__init_dispatcher() != NICC_SUCCESS) {
             NICC_ERROR_C("Failed to initialize dispatcher");
             return;
         }
-    } else if (type & kSoC_Worker) {
+    }
+    if (type & kSoC_Worker) {
         // init the worker
         if (this->__init_worker() != NICC_SUCCESS) {
             NICC_ERROR_C("Failed to initialize worker");
@@ -27,8 +98,11 @@ SoCWrapper::SoCWrapper(soc_wrapper_type_t type, SoCWrapperContext *context) {
         }
     }
     
-    // call user defined init handler if available
-    if (this->_context->init_handler) {
+    // call user defined init handler if available, the user state is only used by workers
+    if (!(type & kSoC_Worker)) {
+        this->_context->user_state = nullptr;
+        this->_context->user_state_size = 0;
+    } else if (this->_context->init_handler) {
         // user init_handler allocates and returns user_state with size info
         user_state_info state_info = this->_context->init_handler();
         this->_context->user_state = state_info.state;
@@ -37,6 +111,10 @@ SoCWrapper::SoCWrapper(soc_wrapper_type_t type, SoCWrapperContext *context) {
         if (this->_context->user_state) {
             NICC_LOG("User init handler called successfully, user_state allocated: size=%zu", 
                      this->_context->user_state_size);
+            if (this->_context->worker_user_states != nullptr) {
+                this->_context->worker_user_states[this->_context->worker_id].store(
+                    this->_context->user_state, std::memory_order_release);
+            }
         } else {
             NICC_WARN_C("User init handler returned null user_state");
             this->_context->user_state_size = 0;
@@ -53,6 +131,30 @@ SoCWrapper::SoCWrapper(soc_wrapper_type_t type, SoCWrapperContext *context) {
 }
 
 SoCWrapper::~SoCWrapper() {
+    if (this->_reorder_flows != nullptr) {
+        delete[] this->_reorder_flows;
+        this->_reorder_flows = nullptr;
+    }
+    if (this->_bp_held != nullptr) {
+        delete[] this->_bp_held;
+        this->_bp_held = nullptr;
+    }
+    soc_merge_barrier_t *barrier = this->_context->merge_barrier;
+    if (barrier != nullptr) {
+        if (this->_type == kSoC_Worker) {
+            /// the user_state is still read by the final merge of the dispatcher
+            barrier->nb_stopped.fetch_add(1, std::memory_order_acq_rel);
+            while (!barrier->merged.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        } else {
+            /// a dispatcher which never ran must not hold the workers back
+            barrier->merged.store(true, std::memory_order_release);
+        }
+    }
+    if (this->_context->worker_user_states != nullptr && (this->_type & kSoC_Worker)) {
+        this->_context->worker_user_states[this->_context->worker_id].store(nullptr, std::memory_order_release);
+    }
     // call user defined cleanup handler if available
     if (this->_context->cleanup_handler && this->_context->user_state) {
         this->_context->cleanup_handler(this->_context->user_state);
@@ -63,14 +165,128 @@ SoCWrapper::~SoCWrapper() {
     }
 }
 
+nicc_retval_t SoCWrapper::attach_worker(const char *block_name, SoCWrapperContext *context) {
+    NICC_CHECK_POINTER(block_name);
+    NICC_CHECK_POINTER(context);
+
+    std::string shm_name = soc_shm_segment_name(block_name);
+    context->shm_segment = soc_shm_attach_segment(shm_name.c_str());
+    if (unlikely(context->shm_segment == nullptr)) {
+        NICC_WARN("failed to attach worker to SoC block %s", block_name);
+        return NICC_ERROR_NOT_FOUND;
+    }
+    /// the worker rx queues are single-consumer, claim a worker slot which is free or whose
+    /// process died without detaching
+    uint16_t nb_workers = context->shm_segment->nb_workers_;
+    int32_t pid = static_cast<int32_t>(getpid());
+    uint16_t worker_id;
+    for (worker_id = 0; worker_id < nb_workers; worker_id++) {
+        int32_t owner = context->shm_segment->worker_pids_[worker_id].load(std::memory_order_acquire);
+        if (owner != 0 && soc_shm_pid_alive(owner)) continue;
+        if (context->shm_segment->worker_pids_[worker_id].compare_exchange_strong(
+                owner, pid, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            if (owner != 0) {
+                NICC_LOG("SoC block %s: worker slot %u taken over from dead process %d", block_name, worker_id, owner);
+            }
+            break;
+        }
+    }
+    if (unlikely(worker_id >= nb_workers)) {
+        NICC_WARN("SoC block %s already has all its %u external workers attached", block_name, nb_workers);
+        soc_shm_detach_segment(context->shm_segment);
+        context->shm_segment = nullptr;
+        return NICC_ERROR_EXSAUSTED;
+    }
+    context->qp_for_prior = nullptr;
+    context->qp_for_next = nullptr;
+    context->worker_id = worker_id;
+    context->config = SoCWrapperConfig();
+    context->config.nb_workers = nb_workers;
+    /// the dispatcher classifies, the worker only needs to know how to schedule the classes
+    context->config.nb_traffic_classes = context->shm_segment->nb_traffic_classes_;
+    context->config.class_sched = static_cast<soc_class_sched_t>(context->shm_segment->class_sched_);
+    for (uint8_t i = 0; i < kSoCMaxTrafficClasses; i++) {
+        context->config.class_quantum[i] = context->shm_segment->class_quantum_[i];
+    }
+    context->config.enable_reassembly = (context->shm_segment->reassembly_timeout_us_ > 0);
+    context->config.reassembly_timeout_us = context->shm_segment->reassembly_timeout_us_;
+    context->config.enable_backpressure = context->shm_segment->enable_backpressure_;
+    /// the deque table lives in the QP of the runtime, external workers never steal
+    context->config.is_unordered = context->shm_segment->is_unordered_;
+    context->config.enable_work_stealing = false;
+    context->config.batch_deadline_us = context->shm_segment->batch_deadline_us_;
+    memcpy(context->config.route_of_retval, context->shm_segment->route_of_retval_, sizeof(context->config.route_of_retval));
+    /// the dispatcher can't reach the user_state of another process
+    context->merge_handler = nullptr;
+    context->worker_user_states = nullptr;
+    context->merge_barrier = nullptr;
+    context->worker_shm_segment = nullptr;
+    return NICC_SUCCESS;
+}
+
+void SoCWrapper::detach_worker(SoCWrapperContext *context) {
+    NICC_CHECK_POINTER(context);
+    if (context->shm_segment != nullptr) {
+        context->shm_segment->worker_pids_[context->worker_id].store(0, std::memory_order_release);
+        soc_shm_detach_segment(context->shm_segment);
+        context->shm_segment = nullptr;
+    }
+}
+
 nicc_retval_t SoCWrapper::__init_dispatcher() {
-    /// Allocate the SHM queue for transferring buffers between dispatcher and worker
-    this->_qp_for_prior->_disp_worker_queue = this->_tmp_worker_rx_queue;
+    /// Publish the queues allocated by a single-threaded wrapper
+    if (this->_type & kSoC_Worker) {
+        for (uint8_t i = 0; i < kSoCMaxTrafficClasses; i++) {
+            this->_qp_for_prior->_disp_worker_queues[this->_context->worker_id][i] = this->_tmp_worker_rx_queues[i];
+        }
+    }
     this->_qp_for_next->_collect_worker_queue = this->_tmp_worker_tx_queue;
+    /// every worker must have its queues before the first packet is dispatched
+    const SoCWrapperConfig &config = this->_context->config;
+    for (uint16_t w = 0; w < config.nb_workers; w++) {
+        for (uint8_t i = 0; i < config.nb_traffic_classes; i++) {
+            if (unlikely(this->_qp_for_prior->_disp_worker_queues[w][i] == nullptr)) {
+                NICC_WARN_C("No rx queue for worker %u class %u", w, i);
+                return NICC_ERROR_NOT_FOUND;
+            }
+        }
+    }
+    /// program the initial RSS indirection table, invalid entries fall back to an even spread
+    for (uint16_t b = 0; b < kSoCRssRetaSize; b++) {
+        uint16_t worker_id = b % config.nb_workers;
+        if (config.rss_reta_size > 0 && config.rss_reta[b % config.rss_reta_size] < config.nb_workers) {
+            worker_id = config.rss_reta[b % config.rss_reta_size];
+        }
+        this->_rss_bucket_worker[b] = worker_id;
+        this->_qp_for_prior->_rss_reta[b].store(worker_id, std::memory_order_relaxed);
+    }
+    /// RSS keeps a flow on one worker, round robin spreads it, so ordered blocks restore the order
+    if (!(this->_type & kSoC_Worker) && !config.is_unordered && config.nb_workers > 1
+        && config.dispatch_policy == kSoC_Dispatch_RoundRobin) {
+        NICC_CHECK_POINTER(this->_reorder_flows = new soc_reorder_flow[kReorderFlowNum]);
+        NICC_LOG("SoC dispatcher restores the packet order of %lu flow slots on tx collect", kReorderFlowNum);
+    }
+    if (config.enable_backpressure) {
+        NICC_CHECK_POINTER(this->_bp_held = new Buffer*[RDMA_SoC_QP::kNumRxRingEntries]);
+    }
     return NICC_SUCCESS;
 }
 
 nicc_retval_t SoCWrapper::__init_worker() {
+    if (this->_tmp_worker_ws_deque == nullptr) {
+        return NICC_SUCCESS;
+    }
+    /// expose the rx deque to the sibling workers fed by the same QP
+    size_t idx = this->_qp_for_prior->_nb_worker_ws_deques.fetch_add(1, std::memory_order_relaxed);
+    if (unlikely(idx >= kSoCWorkspaceMaxNum)) {
+        NICC_WARN_C("Too many workers for work stealing: idx(%lu), max(%d), disabled for this worker",
+                    idx, kSoCWorkspaceMaxNum);
+        delete this->_tmp_worker_ws_deque;
+        this->_tmp_worker_ws_deque = nullptr;
+        return NICC_SUCCESS;
+    }
+    this->_qp_for_prior->_worker_ws_deques[idx].store(this->_tmp_worker_ws_deque, std::memory_order_release);
+    this->_steal_victim_idx = idx + 1;
     return NICC_SUCCESS;
 }
 
@@ -78,14 +294,77 @@ void SoCWrapper::__run(double seconds) {
     double freq_ghz = measure_rdtsc_freq();
     size_t timeout_tsc = ms_to_cycles(1000*seconds, freq_ghz);
     size_t interval_tsc = us_to_cycles(1.0, freq_ghz);  // launch an event loop once per one us
+    const SoCWrapperConfig &config = this->_context->config;
+    this->_freq_ghz = freq_ghz;
+    this->_idle_spin_tsc = us_to_cycles(config.idle_spin_us, freq_ghz);
+    this->_idle_backoff_tsc = us_to_cycles(config.idle_backoff_us, freq_ghz);
+    this->_idle_sleep_us = config.idle_sleep_us < 1.0 ? 1 : static_cast<size_t>(config.idle_sleep_us);
+    this->_reorder_timeout_tsc = us_to_cycles(kReorderTimeoutUs, freq_ghz);
+    if ((this->_type & kSoC_Worker) && config.enable_reassembly) {
+        this->_reassembly_timeout_tsc = us_to_cycles(config.reassembly_timeout_us, freq_ghz);
+        if (this->_reassembly_timeout_tsc == 0) this->_reassembly_timeout_tsc = 1;
+    }
+    this->_batch_deadline_tsc = us_to_cycles(config.batch_deadline_us, freq_ghz);
+    if (this->_type & kSoC_Dispatcher) {
+        if (this->_context->worker_shm_segment != nullptr) {
+            this->_ext_workers.segment = this->_context->worker_shm_segment;
+            this->_ext_workers.check_interval_tsc = ms_to_cycles(kExtWorkerCheckMs, freq_ghz);
+            this->_ext_workers.grace_tsc = ms_to_cycles(kExtWorkerGraceMs, freq_ghz);
+        }
+        this->__init_shaper(this->_shaper_next, config.shaper_next);
+        this->__init_shaper(this->_shaper_prior, config.shaper_prior);
+        if (config.mirror_sample_next > 0 || config.mirror_sample_prior > 0) {
+            const std::pair<soc_mirror_tap_t*, uint32_t> taps[] = {
+                { &this->_mirror_next, config.mirror_sample_next },
+                { &this->_mirror_prior, config.mirror_sample_prior },
+            };
+            for (const auto &tap : taps) {
+                tap.first->sample_n = tap.second;
+                tap.first->nb_skip = tap.second > 0 ? tap.second - 1 : 0;
+                tap.first->gap_tsc = config.mirror_rate_pps > 0.0 ?
+                    static_cast<size_t>(freq_ghz * 1e9 / config.mirror_rate_pps) : 0;
+            }
+            this->_mirror = soc_mirror_start(config.mirror_path, config.mirror_snaplen, freq_ghz);
+            if (unlikely(this->_mirror == nullptr)) {
+                NICC_WARN_C("failed to start the mirror tap, the dispatcher runs untapped");
+            }
+        }
+    }
+    if ((this->_type & kSoC_Worker) && this->_context->async_msg_handler != nullptr) {
+        for (size_t i = 0; i < kAsyncMaxInflight; i++) {
+            this->_async_free[i] = static_cast<uint16_t>(kAsyncMaxInflight - 1 - i);
+        }
+        this->_async_nb_inflight = 0;
+    }
+    /// start with full batches, the targets shrink on their own at light load
+    this->_worker_rx_batch.max_size = this->_worker_rx_batch.target = kAppRxMsgBatchSize;
+    this->_tx_batch.max_size = this->_tx_batch.target = kTxBatchSize;
+
+    const bool do_merge = (this->_type & kSoC_Dispatcher) && this->_context->merge_handler != nullptr
+                            && this->_context->worker_user_states != nullptr;
+    size_t merge_interval_tsc = ms_to_cycles(config.merge_interval_ms, freq_ghz);
 
     /* Start loop */
     size_t start_tsc = rdtsc();
     size_t loop_tsc = start_tsc;
+    size_t busy_tsc = start_tsc;
+    size_t merge_tsc = start_tsc;
+    this->_stop_tsc = start_tsc + timeout_tsc;
     while (true) {
         if (rdtsc() - loop_tsc > interval_tsc) {
             loop_tsc = rdtsc();
-            this->__launch();
+            if (do_merge && merge_interval_tsc > 0 && loop_tsc - merge_tsc > merge_interval_tsc) {
+                merge_tsc = loop_tsc;
+                this->__merge_user_states();
+            }
+            if (unlikely(this->_ext_workers.segment != nullptr)) {
+                this->__check_ext_workers(loop_tsc);
+            }
+            if (this->__launch() > 0) {
+                busy_tsc = loop_tsc;
+            } else if (config.enable_idle_wait) {
+                this->__idle_wait(loop_tsc - busy_tsc);
+            }
         }
         if (unlikely(rdtsc() - start_tsc > timeout_tsc)) {
             /// Only the first workspace records the stats
@@ -93,137 +372,1192 @@ void SoCWrapper::__run(double seconds) {
             break;
         }
     }
+    if (do_merge) {
+        /// the workers free their user_states once they stop, wait for them to stop, and
+        /// hold their cleanup until the final merge is done
+        soc_merge_barrier_t *barrier = this->_context->merge_barrier;
+        while (barrier != nullptr && barrier->nb_stopped.load(std::memory_order_acquire) < barrier->nb_workers) {
+            std::this_thread::yield();
+        }
+        this->__merge_user_states();
+        if (barrier != nullptr) {
+            barrier->merged.store(true, std::memory_order_release);
+        }
+    }
+    if (this->_async_nb_inflight > 0) {
+        /// let the awaited operations complete, the buffers must not be freed under them
+        size_t drain_start_tsc = rdtsc();
+        size_t drain_tsc = ms_to_cycles(kAsyncDrainMs, freq_ghz);
+        while (this->_async_nb_inflight > 0 && rdtsc() - drain_start_tsc < drain_tsc) {
+            this->__resume_async_msgs();
+        }
+        if (this->_async_nb_inflight > 0) {
+            NICC_WARN_C("SoC worker %u stopped with %lu messages in flight in the async handler, dropped",
+                        this->_context->worker_id, this->_async_nb_inflight);
+            for (size_t i = 0; i < this->_async_nb_inflight; i++) {
+                soc_async_slot &slot = this->_async_slots[this->_async_inflight[i]];
+                this->__drop_msg_segments(slot.msg, kSoC_Drop_Stopped);
+                slot.msg = nullptr;
+            }
+            this->_async_nb_inflight = 0;
+        }
+    }
+    if (this->_nb_worker_free_bufs > 0) {
+        this->__flush_worker_free_bufs(true);
+    }
+    if (this->_mirror != nullptr) {
+        soc_mirror_stop(this->_mirror);
+        this->_mirror = nullptr;
+    }
+    if ((this->_type & kSoC_Dispatcher) && config.dispatch_policy == kSoC_Dispatch_FlowHash && config.nb_workers > 1) {
+        NICC_LOG("SoC dispatcher RSS stats: bucket migrations(%lu), deferred packets(%lu)",
+                 this->_rss_stats.nb_migrations, this->_rss_stats.nb_deferred);
+    }
+    NICC_LOG("SoC wrapper drop stats: worker queue full(%lu), tx queue full(%lu), reassembly(%lu), route(%lu), stopped(%lu)%s",
+             this->_drop_stats[kSoC_Drop_WorkerQueueFull], this->_drop_stats[kSoC_Drop_TxQueueFull],
+             this->_drop_stats[kSoC_Drop_Reassembly], this->_drop_stats[kSoC_Drop_Route],
+             this->_drop_stats[kSoC_Drop_Stopped],
+             this->_bp_held != nullptr ? ", backpressure on" : "");
+    if (this->_reorder_flows != nullptr) {
+        NICC_LOG("SoC dispatcher reorder stats: reordered packets(%lu), skipped gaps(%lu), late packets(%lu)",
+                 this->_reorder_stats.nb_reordered, this->_reorder_stats.nb_gaps, this->_reorder_stats.nb_late);
+    }
+    if (this->_reassembly_timeout_tsc > 0) {
+        this->__reclaim_worker_rx_msgs(true);
+        NICC_LOG("SoC worker %u reassembly stats: messages(%lu), timeouts(%lu), broken(%lu), orphans(%lu), oversized(%lu)",
+                 this->_context->worker_id, this->_reassembly_stats.nb_msgs, this->_reassembly_stats.nb_timeouts,
+                 this->_reassembly_stats.nb_broken, this->_reassembly_stats.nb_orphans,
+                 this->_reassembly_stats.nb_oversized);
+    }
+    if (this->_ext_workers.segment != nullptr) {
+        NICC_LOG("SoC dispatcher external worker stats: dead processes(%lu), skipped slots(%lu), reclaimed buffers(%lu)",
+                 this->_ext_workers.nb_dead, this->_ext_workers.nb_skipped, this->_ext_workers.nb_reclaimed);
+    }
+    if (this->_shaper_next.depth > 0 || this->_shaper_prior.depth > 0) {
+        NICC_LOG("SoC dispatcher shaper stats: throttled flushes next(%lu), prior(%lu)",
+                 this->_shaper_next.nb_throttled, this->_shaper_prior.nb_throttled);
+    }
+    if (config.enable_idle_wait) {
+        NICC_LOG("SoC wrapper idle stats: sleeps(%lu), doorbell wakes(%lu), cq event wakes(%lu), wake latency avg(%.2f us) max(%.2f us)",
+                 this->_idle_stats.nb_sleeps, this->_idle_stats.nb_doorbell_wakes, this->_idle_stats.nb_cq_event_wakes,
+                 this->_idle_stats.nb_latency_samples ? 
+                    to_usec(this->_idle_stats.wake_latency_tsc_sum / this->_idle_stats.nb_latency_samples, freq_ghz) : 0.0,
+                 to_usec(this->_idle_stats.wake_latency_tsc_max, freq_ghz));
+    }
     return;
 }
 
-/// \todo divide into worker and dispatcher, now we write in one function
-void SoCWrapper::__launch() {
+void SoCWrapper::__merge_user_states() {
+    void *user_states[kSoCWorkspaceMaxNum];
+    uint16_t nb_states = 0;
+    for (uint16_t w = 0; w < this->_context->config.nb_workers; w++) {
+        void *user_state = this->_context->worker_user_states[w].load(std::memory_order_acquire);
+        if (user_state != nullptr) {
+            user_states[nb_states++] = user_state;
+        }
+    }
+    if (nb_states > 0) {
+        this->_context->merge_handler(user_states, nb_states);
+    }
+}
+
+void SoCWrapper::__check_ext_workers(size_t now_tsc) {
+    soc_shm_segment_hdr *segment = this->_ext_workers.segment;
+    soc_shm_mpsc_queue *tx_queue = segment->get_worker_tx_queue();
+    soc_shm_recycle_queue *recycle_queue = segment->get_worker_recycle_queue();
+
+    if (this->_ext_workers.dead_pid == 0) {
+        if (now_tsc - this->_ext_workers.check_tsc < this->_ext_workers.check_interval_tsc) {
+            return;
+        }
+        this->_ext_workers.check_tsc = now_tsc;
+        for (uint16_t w = 0; w < this->_context->config.nb_workers; w++) {
+            int32_t seen = this->_ext_workers.pids[w];
+            int32_t pid = segment->worker_pids_[w].load(std::memory_order_acquire);
+            if (seen != 0 && !soc_shm_pid_alive(seen)) {
+                /// the process is gone, whether or not another one took over its slot;
+                /// what it claimed so far is known, what it held is found by the recovery
+                this->_ext_workers.dead_pid = seen;
+                this->_ext_workers.dead_worker = w;
+                this->_ext_workers.tx_tail = tx_queue->get_tail();
+                this->_ext_workers.recycle_tail = recycle_queue->get_tail();
+                this->_ext_workers.dead_tsc = now_tsc;
+                this->_ext_workers.nb_dead++;
+                NICC_WARN_C("External worker process %d of worker slot %u is gone, recovering", seen, w);
+                break;
+            }
+            this->_ext_workers.pids[w] = pid;
+        }
+        return;
+    }
+
+    /// the published slots are collected as usual, those claimed by the dead process before
+    /// its death and never published would stall the queues forever
+    size_t tx_head = tx_queue->get_head();
+    size_t recycle_head = recycle_queue->get_head();
+    if (tx_head < this->_ext_workers.tx_tail || recycle_head < this->_ext_workers.recycle_tail) {
+        if (now_tsc - this->_ext_workers.dead_tsc < this->_ext_workers.grace_tsc) {
+            return;
+        }
+        if (tx_head < this->_ext_workers.tx_tail && tx_queue->skip_unpublished()) {
+            this->_ext_workers.nb_skipped++;
+        }
+        if (recycle_head < this->_ext_workers.recycle_tail && recycle_queue->skip_unpublished()) {
+            this->_ext_workers.nb_skipped++;
+        }
+        return;
+    }
+
+    /// every buffer the dead process handed back has been collected, and so cleared, the
+    /// buffers still stamped with its pid are the ones it held
+    Buffer *descs = segment->get_buffer_descs();
+    int32_t dead_pid = this->_ext_workers.dead_pid;
+    for (size_t i = 0; i < segment->nb_buffer_descs_; i++) {
+        Buffer *m = &descs[i];
+        if (m->holder_pid_ != dead_pid) continue;
+        m->holder_pid_ = 0;
+        m->msg_next_ = nullptr;
+        m->msg_nb_segs_ = 1;
+        m->rx_qp_->push_free_buf(m);
+        this->_ext_workers.nb_reclaimed++;
+    }
+    /// free the worker slot, unless a new process already took it over
+    segment->worker_pids_[this->_ext_workers.dead_worker].compare_exchange_strong(
+        dead_pid, 0, std::memory_order_acq_rel, std::memory_order_relaxed);
+    this->_ext_workers.pids[this->_ext_workers.dead_worker] = 0;
+    this->_ext_workers.dead_pid = 0;
+    NICC_LOG("Recovered external worker process %d: skipped slots(%lu), reclaimed buffers(%lu)",
+             dead_pid, this->_ext_workers.nb_skipped, this->_ext_workers.nb_reclaimed);
+}
+
+void SoCWrapper::__idle_wait(size_t idle_tsc) {
+    /* stage 1: keep spinning, the next packet is likely to come soon */
+    if (idle_tsc < this->_idle_spin_tsc) {
+        return;
+    }
+
+    /* stage 2: back off, giving the core to the SMT sibling or to other threads */
+    if (idle_tsc < this->_idle_spin_tsc + this->_idle_backoff_tsc) {
+        for (size_t i = 0; i < kIdleRelaxNum; i++) {
+            cpu_relax();
+        }
+        std::this_thread::yield();
+        return;
+    }
+
+    /* stage 3: sleep, unless messages in flight wait for their operations */
+    if (this->_async_nb_inflight > 0) {
+        return;
+    }
+    size_t sleep_start_tsc = rdtsc();
+    size_t wake_latency_tsc = 0;
+    bool has_latency_sample = false;
+    if (this->_type == kSoC_Worker) {
+        /// pure worker, sleep until the dispatcher publishes messages
+        soc_shm_doorbell *doorbell = &this->_tmp_worker_rx_queues[0]->doorbell_;
+        uint32_t seq = doorbell->prepare_wait();
+        if (this->__get_worker_rx_queue_size() > 0) {
+            doorbell->cancel_wait();
+            return;
+        }
+        if (doorbell->commit_wait(seq, this->_idle_sleep_us)) {
+            size_t now_tsc = rdtsc();
+            size_t ring_tsc = doorbell->ring_tsc_.load(std::memory_order_relaxed);
+            wake_latency_tsc = now_tsc > ring_tsc ? now_tsc - ring_tsc : 0;
+            has_latency_sample = true;
+            this->_idle_stats.nb_doorbell_wakes++;
+        }
+    } else if (this->_context->config.enable_cq_event) {
+        /// the NIC wakes the dispatcher up through the completion channels of its recv CQs
+        if (!this->__arm_cq_events()) {
+            return;
+        }
+        if (this->__wait_cq_events()) {
+            this->_idle_stats.nb_cq_event_wakes++;
+        }
+        wake_latency_tsc = rdtsc() - sleep_start_tsc;
+        has_latency_sample = true;
+    } else {
+        /// the dispatcher polls the NIC, which can not wake it up, so it sleeps for a bounded
+        /// time, which is the worst-case latency of a packet arriving right after it fell asleep
+        struct timespec ts;
+        ts.tv_sec = this->_idle_sleep_us / 1000000;
+        ts.tv_nsec = (this->_idle_sleep_us % 1000000) * 1000;
+        nanosleep(&ts, nullptr);
+        wake_latency_tsc = rdtsc() - sleep_start_tsc;
+        has_latency_sample = true;
+    }
+    this->_idle_stats.nb_sleeps++;
+    if (has_latency_sample) {
+        this->_idle_stats.nb_latency_samples++;
+        this->_idle_stats.wake_latency_tsc_sum += wake_latency_tsc;
+        if (wake_latency_tsc > this->_idle_stats.wake_latency_tsc_max) {
+            this->_idle_stats.wake_latency_tsc_max = wake_latency_tsc;
+        }
+    }
+}
+
+bool SoCWrapper::__batch_ready(adaptive_batch_t &batch, size_t nb_pending) {
+    if (nb_pending == 0) {
+        batch.pending_tsc = 0;
+        return false;
+    }
+    if (nb_pending >= batch.target) {
+        /// the backlog outpaces the target, batch more to amortize the per-batch cost
+        if (nb_pending >= 2 * batch.target) {
+            batch.target = std::min(2 * batch.target, batch.max_size);
+        }
+        batch.pending_tsc = 0;
+        return true;
+    }
+    size_t now_tsc = rdtsc();
+    if (batch.pending_tsc == 0) {
+        batch.pending_tsc = now_tsc;
+    }
+    if (now_tsc - batch.pending_tsc >= this->_batch_deadline_tsc) {
+        /// the load can't fill the target in time, wait for less next time
+        batch.target = std::max(batch.target / 2, static_cast<size_t>(1));
+        batch.pending_tsc = 0;
+        return true;
+    }
+    return false;
+}
+
+void SoCWrapper::__init_shaper(soc_token_bucket_t &bucket, const soc_shaper_config_t &config) {
+    bucket = soc_token_bucket_t();
+    if (config.rate_gbps <= 0.0) {
+        return;
+    }
+    /// a bucket shallower than a packet would hold the head of the tx queue forever
+    double depth_bytes = std::max(config.burst_kb * 1024.0, static_cast<double>(RDMA_SoC_QP::kMTU));
+    double bytes_per_cycle = config.rate_gbps / 8.0 / this->_freq_ghz;
+    bucket.depth = static_cast<size_t>(depth_bytes) << kShaperShift;
+    bucket.rate = static_cast<size_t>(bytes_per_cycle * static_cast<double>(1ul << kShaperShift));
+    if (bucket.rate == 0) bucket.rate = 1;
+    bucket.fill_tsc = bucket.depth / bucket.rate + 1;
+    bucket.tokens = bucket.depth;
+    bucket.last_tsc = rdtsc();
+}
+
+bool SoCWrapper::__arm_cq_events() {
+    RDMA_SoC_QP *qps[2] = { this->_qp_for_prior, this->_qp_for_next };
+    size_t nb_pending = 0;
+    for (RDMA_SoC_QP *qp : qps) {
+        if (!qp->_recv_cq_armed) {
+            if (unlikely(ibv_req_notify_cq(qp->_recv_cq, 0) != 0)) {
+                NICC_WARN_C("failed to arm recv CQ of QP %lu", qp->_qp_id);
+                return false;
+            }
+            qp->_recv_cq_armed = true;
+        }
+        /// completions before arming raise no event, take them now
+        nb_pending += this->__rx_burst(qp) + qp->get_rx_queue_size();
+    }
+    nb_pending += this->_qp_for_next->get_tx_worker_queue_size() + this->_qp_for_next->get_tx_queue_size()
+                    + this->_bp_nb_held;
+    if (this->_type & kSoC_Worker) {
+        nb_pending += this->__get_worker_rx_queue_size();
+    }
+    return nb_pending == 0;
+}
+
+bool SoCWrapper::__wait_cq_events() {
+    RDMA_SoC_QP *qps[2] = { this->_qp_for_prior, this->_qp_for_next };
+    struct pollfd fds[2];
+    struct timespec ts;
+    bool has_event = false;
+    for (size_t i = 0; i < 2; i++) {
+        fds[i].fd = qps[i]->_recv_comp_channel->fd;
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    ts.tv_sec = this->_idle_sleep_us / 1000000;
+    ts.tv_nsec = (this->_idle_sleep_us % 1000000) * 1000;
+    if (ppoll(fds, 2, &ts, nullptr) <= 0) {
+        return false;
+    }
+    for (size_t i = 0; i < 2; i++) {
+        struct ibv_cq *ev_cq;
+        void *ev_ctx;
+        if (!(fds[i].revents & POLLIN)) continue;
+        /// the channel is non-blocking, drain all events it holds
+        while (ibv_get_cq_event(qps[i]->_recv_comp_channel, &ev_cq, &ev_ctx) == 0) {
+            ibv_ack_cq_events(ev_cq, 1);
+            qps[i]->_recv_cq_armed = false;
+            has_event = true;
+        }
+    }
+    return has_event;
+}
+
+size_t SoCWrapper::__launch() {
+    size_t nb_work = 0;
+
     /* 1. RX Direction, from piror component block to next component block */
-    size_t nb_rx = this->__rx_burst(this->_qp_for_prior);
-    size_t nb_disp = this->__dispatch_rx_pkts(this->_qp_for_prior);
+    if (this->_type & kSoC_Dispatcher) {
+        size_t nb_rx = this->__rx_burst(this->_qp_for_prior);
+        size_t nb_disp = this->__dispatch_rx_pkts(this->_qp_for_prior);
+        nb_work += nb_rx;
+    }
 
     /// Worker Logic
-    size_t worker_queue_size = this->_tmp_worker_rx_queue->get_size();
-    /// \todo get packets per message within header; now assume 1 packet per message
-    size_t msg_num = worker_queue_size / 1;
-    if (msg_num > kAppRxMsgBatchSize) {
-        /// handle received messages with user defined msg handler
-        for (size_t i = 0; i < msg_num * 1; i++) {
-            Buffer *m = (Buffer*)this->_tmp_worker_rx_queue->dequeue();
-            
-            // call user defined message handler if available
-            if (likely(this->_context->msg_handler)) {
-                nicc_retval_t ret = this->_context->msg_handler(m, this->_context->user_state);
-                
-                // Use routing to decide packet forwarding based on kernel return value
-                // if (this->_context->routing) {
-                    // nicc_retval_t routing_ret = this->__forward_packet_with_routing(m, ret);
-                    // if (routing_ret != NICC_SUCCESS) {
-                    //     NICC_WARN_C("Routing-based forwarding failed for kernel_retval=%d, using default forwarding", ret);
-                    //     this->_tmp_worker_tx_queue->enqueue((uint8_t*)m);
-                    // }
-                // } else {
-                    // No routing configured, use original logic
-                    if (likely(ret == NICC_SUCCESS)) {
-                        // successful processing, forward to next component
-                        this->_tmp_worker_tx_queue->enqueue((uint8_t*)m);
-                    } else {
-                        // processing failed, log warning but still forward (or could drop based on policy)
-                        NICC_WARN_C("User msg handler failed: ret=%d, still forwarding message", ret);
-                        this->_tmp_worker_tx_queue->enqueue((uint8_t*)m);
+    if (this->_type & kSoC_Worker) {
+        if (unlikely(this->_nb_reassembly_pending > 0)) {
+            this->__reclaim_worker_rx_msgs(false);
+        }
+        if (this->_async_nb_inflight > 0) {
+            nb_work += this->__resume_async_msgs();
+        }
+        size_t nb_queued_msgs = this->__get_worker_rx_queue_size();
+        if (this->_tmp_worker_ws_deque) {
+            nb_queued_msgs += this->_tmp_worker_ws_deque->get_size();
+        }
+        Buffer *rx_msgs[kAppRxMsgBatchSize];
+        if (this->__batch_ready(this->_worker_rx_batch, nb_queued_msgs)) {
+            /// handle received messages with user defined msg handler
+            while (nb_queued_msgs > 0) {
+                size_t nb_burst = std::min(std::min(nb_queued_msgs, static_cast<size_t>(kAppRxMsgBatchSize)), this->__get_async_room());
+                if (nb_burst == 0) {
+                    /// the async handler is full, the rest waits in the rx queues
+                    break;
+                }
+                size_t nb_rx_msgs = this->__fetch_worker_rx_msgs(rx_msgs, nb_burst);
+                if (nb_rx_msgs == 0) {
+                    /// the rest has been stolen by sibling workers
+                    break;
+                }
+                if (this->_holder_pid != 0) {
+                    /// the dispatcher reclaims the buffers stamped by this process if it dies
+                    for (size_t i = 0; i < nb_rx_msgs; i++) {
+                        rx_msgs[i]->holder_pid_ = this->_holder_pid;
                     }
-                // }
-            } else {
-                // no user handler registered, default behavior: forward message
-                this->_tmp_worker_tx_queue->enqueue((uint8_t*)m);
+                }
+                size_t nb_complete = this->_reassembly_timeout_tsc > 0 ?
+                    this->__reassemble_worker_rx_msgs(rx_msgs, nb_rx_msgs) : nb_rx_msgs;
+                if (nb_complete > 0) {
+                    this->__handle_worker_rx_msgs(rx_msgs, nb_complete);
+                }
+                this->__retire_worker_rx_msgs();
+                nb_queued_msgs -= nb_rx_msgs;
+                nb_work += nb_rx_msgs;
+            }
+        } else if (this->_tmp_worker_ws_deque && this->__get_async_room() > 0) {
+            /// not enough local work, help the busiest sibling
+            size_t nb_rx_msgs = this->__steal_worker_rx_msgs(rx_msgs,
+                std::min(static_cast<size_t>(kAppRxMsgBatchSize), this->__get_async_room()));
+            if (nb_rx_msgs > 0) {
+                this->__handle_worker_rx_msgs(rx_msgs, nb_rx_msgs);
+                nb_work += nb_rx_msgs;
             }
         }
+        if (unlikely(this->_nb_worker_free_bufs > 0)) {
+            this->__flush_worker_free_bufs();
+        }
+    }
+
+    if (!(this->_type & kSoC_Dispatcher)) {
+        return nb_work;
     }
 
     size_t nb_collect = this->__collect_tx_pkts(this->_qp_for_next);
+    nb_work += nb_collect;
 
-    if (this->_qp_for_next->get_tx_queue_size() >= kTxBatchSize) {
+    if (this->__batch_ready(this->_tx_batch, this->_qp_for_next->get_tx_queue_size())) {
         /// \todo use MAT to decide dst qp_id
         this->__tx_flush(this->_qp_for_next);
     }
 
     /* 2. TX Direction, from next component block to prior component block */
-    nb_rx = this->__rx_burst(this->_qp_for_next);
+    size_t nb_rx = this->__rx_burst(this->_qp_for_next);
     /// immediately send the packets
     size_t nb_direct_tx = this->__direct_tx_burst(this->_qp_for_next, this->_qp_for_prior);
     size_t nb_tx = this->__tx_flush(this->_qp_for_prior);
+    nb_work += nb_rx;
+
+    return nb_work;
+}
+
+void SoCWrapper::__handle_worker_rx_msgs(Buffer **msgs, size_t nb_msgs) {
+    if (this->_context->async_msg_handler) {
+        this->__start_async_msgs(msgs, nb_msgs);
+        return;
+    }
+    if (this->_context->msg_burst_handler) {
+        /// one call per burst, the kernel may vectorize and amortize its state lookups
+        nicc_retval_t retvals[kAppRxMsgBatchSize];
+        if (kPrefetchDistance > 0) {
+            for (size_t i = 0; i < nb_msgs; i++) {
+                msgs[i]->prefetch_hdrs();
+            }
+        }
+        this->_context->msg_burst_handler(msgs, retvals, static_cast<uint16_t>(nb_msgs), this->_context->user_state);
+        size_t nb_fwd = 0;
+        for (size_t i = 0; i < nb_msgs; i++) {
+            if (likely(this->__route_msg(msgs[i], retvals[i]))) {
+                msgs[nb_fwd++] = msgs[i];
+            }
+        }
+        if (nb_fwd > 0) {
+            this->__enqueue_worker_tx_segments(msgs, nb_fwd);
+        }
+        return;
+    }
+
+    // without user handler, default behavior is forwarding to the next component
+    if (unlikely(!this->_context->msg_handler)) {
+        this->__enqueue_worker_tx_segments(msgs, nb_msgs);
+        return;
+    }
+    for (size_t i = 0; i < std::min(nb_msgs, kPrefetchDistance); i++) {
+        msgs[i]->prefetch_hdrs();
+    }
+    /// the kernel return value picks the route of each message, forwarded ones are packed
+    /// at the front of msgs, behind the prefetch window
+    size_t nb_fwd = 0;
+    for (size_t i = 0; i < nb_msgs; i++) {
+        Buffer *m = msgs[i];
+        if (kPrefetchDistance > 0 && i + kPrefetchDistance < nb_msgs) {
+            msgs[i + kPrefetchDistance]->prefetch_hdrs();
+        }
+        nicc_retval_t ret = this->_context->msg_handler(m, this->_context->user_state);
+        if (likely(this->__route_msg(m, ret))) {
+            msgs[nb_fwd++] = m;
+        }
+    }
+    if (nb_fwd > 0) {
+        this->__enqueue_worker_tx_segments(msgs, nb_fwd);
+    }
+}
+
+void SoCWrapper::__start_async_msgs(Buffer **msgs, size_t nb_msgs) {
+    Buffer *done[kAppRxMsgBatchSize];
+    size_t nb_done = 0;
+    for (size_t i = 0; i < nb_msgs; i++) {
+        /// take the top of the free slots, it is only popped if the message stays in flight
+        uint16_t idx = this->_async_free[kAsyncMaxInflight - this->_async_nb_inflight - 1];
+        soc_async_slot &slot = this->_async_slots[idx];
+        memset(&slot.ctx, 0, sizeof(soc_async_ctx));
+        slot.ctx.freq_ghz = this->_freq_ghz;
+        if (this->_context->async_msg_handler(msgs[i], &slot.ctx, this->_context->user_state) == kSoC_Async_Done) {
+            if (likely(this->__route_msg(msgs[i], slot.ctx.retval))) {
+                done[nb_done++] = msgs[i];
+            }
+        } else {
+            slot.msg = msgs[i];
+            this->_async_inflight[this->_async_nb_inflight++] = idx;
+        }
+    }
+    if (nb_done > 0) {
+        this->__enqueue_worker_tx_segments(done, nb_done);
+    }
+}
+
+size_t SoCWrapper::__resume_async_msgs() {
+    Buffer *done[kAsyncMaxInflight];
+    size_t nb_done = 0;
+    size_t now_tsc = 0;
+    size_t i = 0;
+    while (i < this->_async_nb_inflight) {
+        uint16_t idx = this->_async_inflight[i];
+        soc_async_slot &slot = this->_async_slots[idx];
+        if (slot.ctx.wake_tsc != 0) {
+            if (now_tsc == 0) now_tsc = rdtsc();
+            if (now_tsc < slot.ctx.wake_tsc) {
+                i++;
+                continue;
+            }
+            slot.ctx.wake_tsc = 0;
+        }
+        if (slot.ctx.poll != nullptr) {
+            if (!slot.ctx.poll(slot.ctx.poll_arg)) {
+                i++;
+                continue;
+            }
+            slot.ctx.poll = nullptr;
+        }
+        if (this->_context->async_msg_handler(slot.msg, &slot.ctx, this->_context->user_state) == kSoC_Async_Pending) {
+            i++;
+            continue;
+        }
+        if (likely(this->__route_msg(slot.msg, slot.ctx.retval))) {
+            done[nb_done++] = slot.msg;
+        }
+        slot.msg = nullptr;
+        /// the last in-flight slot takes its place, and the slot returns to the free ones
+        this->_async_inflight[i] = this->_async_inflight[--this->_async_nb_inflight];
+        this->_async_free[kAsyncMaxInflight - this->_async_nb_inflight - 1] = idx;
+    }
+    if (nb_done > 0) {
+        this->__enqueue_worker_tx_segments(done, nb_done);
+    }
+    return nb_done;
+}
+
+void SoCWrapper::__enqueue_worker_tx_segments(Buffer **msgs, size_t nb_msgs) {
+    if (likely(this->_reassembly_timeout_tsc == 0)) {
+        this->__enqueue_worker_tx_msgs(msgs, nb_msgs);
+        return;
+    }
+
+    /// every segment goes out as a packet of its own, unchained for the next use of the buffer
+    Buffer *segs[kQueueBurstSize];
+    size_t nb_segs = 0;
+    for (size_t i = 0; i < nb_msgs; i++) {
+        Buffer *seg = msgs[i];
+        msgs[i]->msg_nb_segs_ = 1;
+        while (seg != nullptr) {
+            Buffer *next = seg->msg_next_;
+            seg->msg_next_ = nullptr;
+            segs[nb_segs++] = seg;
+            if (nb_segs == kQueueBurstSize) {
+                this->__enqueue_worker_tx_msgs(segs, nb_segs);
+                nb_segs = 0;
+            }
+            seg = next;
+        }
+    }
+    if (nb_segs > 0) {
+        this->__enqueue_worker_tx_msgs(segs, nb_segs);
+    }
+}
+
+size_t SoCWrapper::__reassemble_worker_rx_msgs(Buffer **pkts, size_t nb_pkts) {
+    size_t nb_complete = 0;
+    size_t now_tsc = rdtsc();
+
+    for (size_t i = 0; i < nb_pkts; i++) {
+        Buffer *pkt = pkts[i];
+        const struct ws_hdr *wsh = reinterpret_cast<struct ws_hdr*>(pkt->get_ws_hdr());
+        size_t segment_num = wsh->segment_num_;
+        bool is_first = (wsh->seg_flags_ & kWsSegFirst);
+        soc_flow_key flow = __get_flow_key(pkt);
+        soc_reassembly_slot &slot = this->_reassembly_slots[pkt->meta_.flow_hash_ & (kReassemblySlotNum - 1)];
+        bool is_pending = (slot.head != nullptr && slot.flow == flow);
+
+        if (is_pending) {
+            if (likely(!is_first && wsh->msg_id_ == slot.msg_id && segment_num == slot.nb_remain)) {
+                /// next segment of the message
+                slot.nb_remain--;
+                if (unlikely(slot.discard)) {
+                    this->__free_buf(pkt);
+                } else {
+                    slot.tail->msg_next_ = pkt;
+                    slot.tail = pkt;
+                    slot.head->msg_nb_segs_++;
+                }
+                if (slot.nb_remain == 0) {
+                    if (likely(!slot.discard)) {
+                        pkts[nb_complete++] = slot.head;
+                        this->_reassembly_stats.nb_msgs++;
+                    } else {
+                        __drop_msg_segments(slot.head, kSoC_Drop_Reassembly);
+                    }
+                    slot.head = slot.tail = nullptr;
+                    this->_nb_reassembly_pending--;
+                }
+                continue;
+            }
+            /// a segment was lost, or another message started in between
+            this->_reassembly_stats.nb_broken++;
+            __drop_msg_segments(slot.head, kSoC_Drop_Reassembly);
+            slot.head = slot.tail = nullptr;
+            this->_nb_reassembly_pending--;
+        }
+
+        if (unlikely(!is_first)) {
+            /// rest of a broken message, or of one whose first segment reached another worker
+            /// before its flow moved here; dropped up to the next first segment
+            this->_reassembly_stats.nb_orphans++;
+            pkt->msg_next_ = nullptr;
+            __drop_msg_segments(pkt, kSoC_Drop_Reassembly);
+            continue;
+        }
+
+        if (segment_num <= 1) {
+            /// single-packet message, doesn't touch the slot of another flow
+            pkt->msg_next_ = nullptr;
+            pkt->msg_nb_segs_ = 1;
+            pkts[nb_complete++] = pkt;
+            this->_reassembly_stats.nb_msgs++;
+            continue;
+        }
+
+        if (unlikely(slot.head != nullptr)) {
+            /// the slot is taken by another flow, the older message gives way
+            this->_reassembly_stats.nb_broken++;
+            __drop_msg_segments(slot.head, kSoC_Drop_Reassembly);
+            this->_nb_reassembly_pending--;
+        }
+        /// first segment of a message, an oversized one is tracked only to drop all its segments
+        pkt->msg_next_ = nullptr;
+        pkt->msg_nb_segs_ = 1;
+        slot.flow = flow;
+        slot.msg_id = wsh->msg_id_;
+        slot.head = slot.tail = pkt;
+        slot.nb_remain = segment_num - 1;
+        slot.start_tsc = now_tsc;
+        slot.discard = (segment_num > kReassemblyMaxSegs);
+        if (unlikely(slot.discard)) {
+            this->_reassembly_stats.nb_oversized++;
+        }
+        this->_nb_reassembly_pending++;
+    }
+    return nb_complete;
+}
+
+void SoCWrapper::__reclaim_worker_rx_msgs(bool reclaim_all) {
+    size_t now_tsc = rdtsc();
+    /// slots are scanned a few times per timeout, not on every round
+    if (!reclaim_all && now_tsc - this->_reassembly_check_tsc < this->_reassembly_timeout_tsc / 4) {
+        return;
+    }
+    this->_reassembly_check_tsc = now_tsc;
+
+    for (size_t i = 0; i < kReassemblySlotNum && this->_nb_reassembly_pending > 0; i++) {
+        soc_reassembly_slot &slot = this->_reassembly_slots[i];
+        if (slot.head == nullptr) continue;
+        if (!reclaim_all && now_tsc - slot.start_tsc < this->_reassembly_timeout_tsc) continue;
+        __drop_msg_segments(slot.head, kSoC_Drop_Reassembly);
+        slot.head = slot.tail = nullptr;
+        this->_nb_reassembly_pending--;
+        if (!reclaim_all) this->_reassembly_stats.nb_timeouts++;
+    }
+}
+
+size_t SoCWrapper::__fetch_worker_rx_msgs(Buffer **msgs, size_t nb_msgs) {
+    soc_shm_ws_deque *ws_deque = this->_tmp_worker_ws_deque;
+    if (ws_deque == nullptr) {
+        return this->__dequeue_worker_rx_msgs(msgs, nb_msgs);
+    }
+
+    /// refill the deque, but keep only a bounded window stealable so the LIFO end
+    /// can not starve the oldest messages
+    size_t nb_deque = ws_deque->get_size();
+    while (nb_deque < kWsDequeWindow) {
+        Buffer *burst[kQueueBurstSize];
+        size_t nb_burst = kWsDequeWindow - nb_deque;
+        if (nb_burst > kQueueBurstSize) nb_burst = kQueueBurstSize;
+        nb_burst = this->__dequeue_worker_rx_msgs(burst, nb_burst);
+        if (nb_burst == 0) break;
+        /// never overflows, as only the owner pushes and the window is far below the capacity
+        nb_deque += ws_deque->push_burst((uint8_t**)burst, nb_burst);
+    }
+    return ws_deque->pop_burst((uint8_t**)msgs, nb_msgs);
+}
+
+size_t SoCWrapper::__dequeue_worker_rx_msgs(Buffer **msgs, size_t nb_msgs) {
+    const SoCWrapperConfig &config = this->_context->config;
+    size_t nb_dequeue = 0;
+    if (likely(config.nb_traffic_classes == 1)) {
+        return this->_tmp_worker_rx_queues[0]->dequeue_burst((uint8_t**)msgs, nb_msgs);
+    }
+
+    if (config.class_sched == kSoC_ClassSched_Strict) {
+        for (uint8_t i = 0; i < config.nb_traffic_classes && nb_dequeue < nb_msgs; i++) {
+            nb_dequeue += this->_tmp_worker_rx_queues[i]->dequeue_burst((uint8_t**)&msgs[nb_dequeue], nb_msgs - nb_dequeue);
+        }
+        return nb_dequeue;
+    }
+
+    /// deficit round robin, each message costs one credit; visiting every class twice
+    /// guarantees that a class resumed in the middle of its quantum does not block the round
+    for (size_t i = 0; i < 2 * config.nb_traffic_classes && nb_dequeue < nb_msgs; i++) {
+        uint8_t cls = this->_drr_cursor;
+        if (this->_drr_deficit[cls] == 0) {
+            this->_drr_deficit[cls] = config.class_quantum[cls];
+        }
+        size_t nb_want = nb_msgs - nb_dequeue;
+        if (nb_want > this->_drr_deficit[cls]) nb_want = this->_drr_deficit[cls];
+        size_t nb_class = this->_tmp_worker_rx_queues[cls]->dequeue_burst((uint8_t**)&msgs[nb_dequeue], nb_want);
+        nb_dequeue += nb_class;
+        this->_drr_deficit[cls] -= nb_class;
+        if (nb_class < nb_want) {
+            /// an empty class does not keep its credit
+            this->_drr_deficit[cls] = 0;
+        }
+        if (this->_drr_deficit[cls] == 0) {
+            this->_drr_cursor = (cls + 1) % config.nb_traffic_classes;
+        }
+    }
+    return nb_dequeue;
+}
+
+size_t SoCWrapper::__steal_worker_rx_msgs(Buffer **msgs, size_t nb_msgs) {
+    RDMA_SoC_QP *qp = this->_qp_for_prior;
+    size_t nb_victims = qp->_nb_worker_ws_deques.load(std::memory_order_acquire);
+    if (nb_victims > kSoCWorkspaceMaxNum) nb_victims = kSoCWorkspaceMaxNum;
+    for (size_t i = 0; i < nb_victims; i++) {
+        size_t idx = (this->_steal_victim_idx + i) % nb_victims;
+        soc_shm_ws_deque *victim = qp->_worker_ws_deques[idx].load(std::memory_order_acquire);
+        if (victim == nullptr || victim == this->_tmp_worker_ws_deque) {
+            continue;
+        }
+        size_t nb_steal = victim->steal_burst((uint8_t**)msgs, nb_msgs);
+        if (nb_steal > 0) {
+            /// stay on a loaded victim for the next steal
+            this->_steal_victim_idx = idx;
+            return nb_steal;
+        }
+    }
+    this->_steal_victim_idx++;
+    return 0;
+}
+
+size_t SoCWrapper::__enqueue_worker_tx_msgs(Buffer **msgs, size_t nb_msgs) {
+    /// claim all slots at once on the fan-in queue shared with other workers
+    size_t nb_enqueue = this->_tmp_worker_tx_queue->enqueue_burst((uint8_t**)msgs, nb_msgs);
+    /// under backpressure a pure worker waits for the dispatcher, which never waits for the
+    /// workers, to drain the fan-in queue; a single thread would wait for itself. Once the
+    /// wrapper stops, the dispatcher may be gone and nobody makes room any more
+    bool is_stopped = false;
+    if (unlikely(nb_enqueue < nb_msgs) && this->_context->config.enable_backpressure && this->_type == kSoC_Worker) {
+        while (nb_enqueue < nb_msgs) {
+            if (unlikely(rdtsc() > this->_stop_tsc)) {
+                is_stopped = true;
+                break;
+            }
+            cpu_relax();
+            nb_enqueue += this->_tmp_worker_tx_queue->enqueue_burst((uint8_t**)&msgs[nb_enqueue], nb_msgs - nb_enqueue);
+        }
+    }
+    /// fan-in queue is full, drop the rest and return them to the rx ring
+    for (size_t i = nb_enqueue; i < nb_msgs; i++) {
+        this->__free_buf(msgs[i]);
+        this->_drop_stats[is_stopped ? kSoC_Drop_Stopped : kSoC_Drop_TxQueueFull]++;
+    }
+    return nb_enqueue;
+}
+
+void SoCWrapper::__flush_worker_free_bufs(bool is_stopping) {
+    size_t nb_enqueue = 0;
+    size_t start_tsc = is_stopping ? rdtsc() : 0;
+    while (true) {
+        nb_enqueue += this->_tmp_worker_recycle_queue->enqueue_burst(
+            (uint8_t**)&this->_worker_free_bufs[nb_enqueue], this->_nb_worker_free_bufs - nb_enqueue);
+        if (likely(nb_enqueue == this->_nb_worker_free_bufs)) break;
+        if (unlikely(is_stopping) && rdtsc() - start_tsc > ms_to_cycles(kStopFlushMs, this->_freq_ghz)) {
+            NICC_WARN_C("SoC worker %u stopped with %lu rx buffers not returned to the dispatcher",
+                        this->_context->worker_id, this->_nb_worker_free_bufs - nb_enqueue);
+            break;
+        }
+        cpu_relax();
+    }
+    this->_nb_worker_free_bufs = 0;
 }
 
 size_t SoCWrapper::__rx_burst(RDMA_SoC_QP *qp) {
-    /// post recvs first
-    Buffer *ring_entry = qp->_rx_ring[qp->_recv_head];
-    size_t num_recvs = 0;
-    while (ring_entry->state_ == Buffer::kFREE_BUF) {
-        num_recvs++;
-        ring_entry->state_ = Buffer::kPOSTED;
-        ring_entry = ring_entry->next_;
+    /// post recvs first, with the released buffers, on the wrs not waiting for dispatch
+    if (qp->_recycle_worker_queue != nullptr) {
+        this->__reclaim_worker_bufs(qp);
     }
+    size_t num_recvs = RDMA_SoC_QP::kNumRxRingEntries - qp->_nb_posted_recvs - qp->_wait_for_disp;
+    if (num_recvs > qp->_nb_free_bufs) num_recvs = qp->_nb_free_bufs;
     if (num_recvs) {
         this->__post_recvs(qp, num_recvs);
     }
 
     /// poll cq
     int ret = ibv_poll_cq(qp->_recv_cq, kRxBatchSize, qp->_recv_wc);
-    /// set buffer's length
+    /// set buffer's length, and the rx timestamp shared by the packets of the poll
+    size_t ring_tail = qp->_ring_head + qp->_wait_for_disp;
+    size_t rx_tsc = ret > 0 ? rdtsc() : 0;
     for (int i = 0; i < ret; i++) {
-        qp->_rx_ring[(qp->_ring_head + qp->_wait_for_disp + i) % RDMA_SoC_QP::kNumRxRingEntries]->length_ = qp->_recv_wc[i].byte_len;
+        if (kPrefetchDistance > 0) {
+            prefetch_write(qp->_rx_ring[(ring_tail + i + kPrefetchDistance) % RDMA_SoC_QP::kNumRxRingEntries]);
+        }
+        Buffer *m = qp->_rx_ring[(ring_tail + i) % RDMA_SoC_QP::kNumRxRingEntries];
+        m->length_ = qp->_recv_wc[i].byte_len;
+        m->meta_.rx_tsc_ = rx_tsc;
     }
     qp->_wait_for_disp += ret;
+    qp->_nb_posted_recvs -= ret;
+    if (unlikely(this->_mirror != nullptr)) {
+        this->__mirror_rx_pkts(qp, ring_tail, static_cast<size_t>(ret));
+    }
 
     return static_cast<size_t>(ret);
 }
 
+void SoCWrapper::__mirror_rx_pkts(RDMA_SoC_QP *qp, size_t first, size_t nb_pkts) {
+    soc_mirror_tap_t &tap = (qp == this->_qp_for_next) ? this->_mirror_next : this->_mirror_prior;
+    if (tap.sample_n == 0 || unlikely(this->_mirror->failed_.load(std::memory_order_relaxed))) {
+        return;
+    }
+    /// jump from sample to sample, the packets in between are not touched
+    size_t i = tap.nb_skip;
+    for (; i < nb_pkts; i += tap.sample_n) {
+        size_t now_tsc = rdtsc();
+        if (now_tsc < tap.next_tsc) {
+            continue;
+        }
+        Buffer *m = qp->_rx_ring[(first + i) % RDMA_SoC_QP::kNumRxRingEntries];
+        this->_mirror->ring_.push(m->get_buf(), m->length_, this->_context->config.mirror_snaplen, now_tsc);
+        tap.next_tsc = now_tsc + tap.gap_tsc;
+    }
+    tap.nb_skip = static_cast<uint32_t>(i - nb_pkts);
+}
+
 size_t SoCWrapper::__dispatch_rx_pkts(RDMA_SoC_QP *qp) {
     size_t dispatch_total = 0;
-    Buffer *ring_entry = qp->_rx_ring[qp->_ring_head];
-    struct soc_shm_lock_free_queue *worker_queue = qp->_disp_worker_queue;
-    for (size_t i = 0; i < qp->_wait_for_disp; i++) {
-        if (unlikely(!worker_queue->enqueue((uint8_t*)ring_entry))) {
-            ring_entry->state_ = Buffer::kFREE_BUF;
-            ring_entry = ring_entry->next_;
-            continue;
+    Buffer *burst[kQueueBurstSize];
+    uint32_t worker_mask = 0;
+    size_t remain = qp->_wait_for_disp;
+    size_t nb_consumed = 0;
+    if (this->_context->config.dispatch_policy == kSoC_Dispatch_LeastLoaded && (remain > 0 || this->_bp_nb_held > 0)) {
+        /// one read of the remote queue indices per worker and round
+        for (uint16_t w = 0; w < this->_context->config.nb_workers; w++) {
+            this->_p2c_load[w] = 0;
+            for (uint8_t i = 0; i < this->_context->config.nb_traffic_classes; i++) {
+                this->_p2c_load[w] += qp->_disp_worker_queues[w][i]->get_size();
+            }
+        }
+    }
+    /// packets held back go first, new packets wait in the rx ring until all of them are through
+    if (unlikely(this->_bp_nb_held > 0)) {
+        dispatch_total += this->__dispatch_held_rx_pkts(qp, &worker_mask);
+    }
+    while (remain > 0 && this->_bp_nb_held == 0) {
+        size_t nb_burst = remain > kQueueBurstSize ? kQueueBurstSize : remain;
+        /// ownership must be handed over before the buffers are published
+        for (size_t i = 0; i < nb_burst; i++) {
+            Buffer *ring_entry = qp->_rx_ring[(qp->_ring_head + nb_consumed + i) % RDMA_SoC_QP::kNumRxRingEntries];
+            if (kPrefetchDistance > 0) {
+                prefetch_write(qp->_rx_ring[(qp->_ring_head + nb_consumed + i + kPrefetchDistance) % RDMA_SoC_QP::kNumRxRingEntries]);
+                /// the headers are parsed once the whole burst is gathered
+                ring_entry->prefetch_hdrs();
+            }
+            ring_entry->state_ = Buffer::kAPP_OWNED_BUF;
+            burst[i] = ring_entry;
+        }
+        for (size_t i = 0; i < nb_burst; i++) {
+            __parse_rx_pkt(burst[i]);
+        }
+        if (this->_reorder_flows != nullptr) {
+            this->__tag_rx_burst(burst, nb_burst);
+        }
+        size_t nb_dispatch = this->__dispatch_rx_burst_by_policy(qp, burst, nb_burst, &worker_mask);
+        if (this->_reorder_flows != nullptr && this->_bp_held == nullptr && this->_context->config.nb_traffic_classes == 1) {
+            /// the dropped packets are the last of the burst, take their sequence numbers back
+            /// so that their flows don't wait for them
+            for (size_t i = nb_burst; i > nb_dispatch; i--) {
+                Buffer *pkt = burst[i - 1];
+                if (this->_reorder_disp_seq[pkt->order_flow_] == pkt->order_seq_ + 1) {
+                    this->_reorder_disp_seq[pkt->order_flow_]--;
+                }
+            }
+        }
+        dispatch_total += nb_dispatch;
+        nb_consumed += nb_burst;
+        remain -= nb_burst;
+    }
+    for (uint16_t w = 0; worker_mask != 0; w++, worker_mask >>= 1) {
+        if (worker_mask & 1) {
+            qp->_disp_worker_queues[w][0]->doorbell_.ring();
+        }
+    }
+    qp->_ring_head = (qp->_ring_head + nb_consumed) % RDMA_SoC_QP::kNumRxRingEntries;
+    qp->_wait_for_disp -= nb_consumed;
+    return dispatch_total;
+}
+
+size_t SoCWrapper::__dispatch_rx_burst_by_policy(RDMA_SoC_QP *qp, Buffer **burst, size_t nb_burst, uint32_t *worker_mask) {
+    size_t nb_dispatch;
+    if (likely(this->_context->config.dispatch_policy == kSoC_Dispatch_FlowHash)) {
+        return this->__dispatch_rx_burst_by_flow(qp, burst, nb_burst, worker_mask);
+    } else if (this->_context->config.dispatch_policy == kSoC_Dispatch_LeastLoaded) {
+        return this->__dispatch_rx_burst_by_load(qp, burst, nb_burst, worker_mask);
+    }
+    /// hand the bursts to the workers in turn
+    nb_dispatch = this->__dispatch_rx_burst(qp, this->_disp_worker_cursor, burst, nb_burst, worker_mask);
+    this->_disp_worker_cursor = (this->_disp_worker_cursor + 1) % this->_context->config.nb_workers;
+    return nb_dispatch;
+}
+
+size_t SoCWrapper::__dispatch_held_rx_pkts(RDMA_SoC_QP *qp, uint32_t *worker_mask) {
+    Buffer *burst[kQueueBurstSize];
+    size_t nb_held = this->_bp_nb_held;
+    size_t dispatch_total = 0;
+    size_t i = 0;
+
+    /// rejected packets are held again at the front, always behind the read position
+    this->_bp_nb_held = 0;
+    while (i < nb_held) {
+        size_t nb_burst = std::min(kQueueBurstSize, nb_held - i);
+        memcpy(burst, &this->_bp_held[i], nb_burst * sizeof(Buffer*));
+        i += nb_burst;
+        dispatch_total += this->__dispatch_rx_burst_by_policy(qp, burst, nb_burst, worker_mask);
+        if (this->_bp_nb_held > 0) {
+            /// a worker is still full, the later packets must not overtake the rejected ones
+            memmove(&this->_bp_held[this->_bp_nb_held], &this->_bp_held[i], (nb_held - i) * sizeof(Buffer*));
+            this->_bp_nb_held += nb_held - i;
+            break;
+        }
+    }
+    return dispatch_total;
+}
+
+size_t SoCWrapper::__dispatch_rx_burst(RDMA_SoC_QP *qp, uint16_t worker_id, Buffer **burst, size_t nb_burst, uint32_t *worker_mask) {
+    const uint16_t nb_workers = this->_context->config.nb_workers;
+    size_t nb_dispatch = 0;
+    if (unlikely(this->_context->config.nb_traffic_classes > 1)) {
+        /// the burst is split by class, packets a class queue can not take are rejected
+        nb_dispatch = this->__dispatch_rx_pkts_by_class(qp, worker_id, burst, nb_burst, nullptr);
+        if (nb_dispatch > 0) *worker_mask |= (1u << worker_id);
+        return nb_dispatch;
+    }
+    for (uint16_t i = 0; i < nb_workers && nb_dispatch < nb_burst; i++) {
+        uint16_t w = (worker_id + i) % nb_workers;
+        size_t nb_enqueue = qp->_disp_worker_queues[w][0]->enqueue_burst((uint8_t**)&burst[nb_dispatch], nb_burst - nb_dispatch);
+        if (nb_enqueue > 0) *worker_mask |= (1u << w);
+        nb_dispatch += nb_enqueue;
+    }
+    /// all worker queues are full
+    for (size_t i = nb_dispatch; i < nb_burst; i++) {
+        this->__reject_rx_pkt(burst[i]);
+    }
+    return nb_dispatch;
+}
+
+size_t SoCWrapper::__dispatch_rx_burst_by_flow(RDMA_SoC_QP *qp, Buffer **burst, size_t nb_burst, uint32_t *worker_mask) {
+    Buffer *worker_burst[kSoCWorkspaceMaxNum][kQueueBurstSize];
+    uint16_t worker_buckets[kSoCWorkspaceMaxNum][kQueueBurstSize];
+    size_t nb_worker_burst[kSoCWorkspaceMaxNum] = { 0 };
+    size_t dispatch_total = 0;
+
+    for (size_t i = 0; i < nb_burst; i++) {
+        uint16_t bucket = __get_rss_bucket(burst[i]);
+        uint16_t w = this->__get_rss_worker(qp, bucket);
+        worker_buckets[w][nb_worker_burst[w]] = bucket;
+        worker_burst[w][nb_worker_burst[w]++] = burst[i];
+    }
+    for (uint16_t w = 0; w < this->_context->config.nb_workers; w++) {
+        size_t nb_enqueue;
+        if (nb_worker_burst[w] == 0) continue;
+        if (unlikely(this->_context->config.nb_traffic_classes > 1)) {
+            nb_enqueue = this->__dispatch_rx_pkts_by_class(qp, w, worker_burst[w], nb_worker_burst[w], worker_buckets[w]);
+        } else {
+            soc_shm_lock_free_queue *worker_queue = qp->_disp_worker_queues[w][0];
+            size_t tail = worker_queue->get_tail();
+            nb_enqueue = worker_queue->enqueue_burst((uint8_t**)worker_burst[w], nb_worker_burst[w]);
+            for (size_t i = 0; i < nb_enqueue; i++) {
+                this->_rss_drain_pos[worker_buckets[w][i]][0] = tail + i + 1;
+            }
+            /// worker queue is full
+            for (size_t i = nb_enqueue; i < nb_worker_burst[w]; i++) {
+                this->__reject_rx_pkt(worker_burst[w][i]);
+            }
+        }
+        if (nb_enqueue > 0) *worker_mask |= (1u << w);
+        dispatch_total += nb_enqueue;
+    }
+    return dispatch_total;
+}
+
+size_t SoCWrapper::__dispatch_rx_burst_by_load(RDMA_SoC_QP *qp, Buffer **burst, size_t nb_burst, uint32_t *worker_mask) {
+    Buffer *worker_burst[kSoCWorkspaceMaxNum][kQueueBurstSize];
+    size_t nb_worker_burst[kSoCWorkspaceMaxNum] = { 0 };
+    size_t dispatch_total = 0;
+
+    /// a pick per few packets keeps the decision at a few cycles per packet
+    for (size_t i = 0; i < nb_burst; i += kP2cPickSize) {
+        uint16_t w = this->__pick_least_loaded_worker();
+        size_t nb_pick = std::min(kP2cPickSize, nb_burst - i);
+        for (size_t j = 0; j < nb_pick; j++) {
+            worker_burst[w][nb_worker_burst[w]++] = burst[i + j];
+        }
+        this->_p2c_load[w] += nb_pick;
+    }
+    /// order does not matter, packets a worker can not take spill to the others
+    for (uint16_t w = 0; w < this->_context->config.nb_workers; w++) {
+        if (nb_worker_burst[w] == 0) continue;
+        dispatch_total += this->__dispatch_rx_burst(qp, w, worker_burst[w], nb_worker_burst[w], worker_mask);
+    }
+    return dispatch_total;
+}
+
+size_t SoCWrapper::__dispatch_rx_pkts_by_class(RDMA_SoC_QP *qp, uint16_t worker_id, Buffer **burst, size_t nb_burst,
+                                               const uint16_t *buckets) {
+    Buffer *class_burst[kSoCMaxTrafficClasses][kQueueBurstSize];
+    uint16_t class_buckets[kSoCMaxTrafficClasses][kQueueBurstSize];
+    size_t nb_class_burst[kSoCMaxTrafficClasses] = { 0 };
+    size_t dispatch_total = 0;
+    uint8_t nb_classes = this->_context->config.nb_traffic_classes;
+
+    for (size_t i = 0; i < nb_burst; i++) {
+        uint8_t cls = this->__classify_rx_pkt(burst[i]);
+        if (unlikely(cls >= nb_classes)) cls = nb_classes - 1;
+        if (buckets != nullptr) class_buckets[cls][nb_class_burst[cls]] = buckets[i];
+        class_burst[cls][nb_class_burst[cls]++] = burst[i];
+    }
+    for (uint8_t cls = 0; cls < nb_classes; cls++) {
+        if (nb_class_burst[cls] == 0) continue;
+        soc_shm_lock_free_queue *worker_queue = qp->_disp_worker_queues[worker_id][cls];
+        size_t tail = worker_queue->get_tail();
+        size_t nb_enqueue = worker_queue->enqueue_burst((uint8_t**)class_burst[cls], nb_class_burst[cls]);
+        if (buckets != nullptr) {
+            for (size_t i = 0; i < nb_enqueue; i++) {
+                this->_rss_drain_pos[class_buckets[cls][i]][cls] = tail + i + 1;
+            }
+        }
+        /// class queue is full
+        for (size_t i = nb_enqueue; i < nb_class_burst[cls]; i++) {
+            this->__reject_rx_pkt(class_burst[cls][i]);
         }
-        ring_entry->state_ = Buffer::kAPP_OWNED_BUF;
-        ring_entry = ring_entry->next_;
-        dispatch_total++;
+        dispatch_total += nb_enqueue;
     }
-    qp->_ring_head = (qp->_ring_head + qp->_wait_for_disp) % RDMA_SoC_QP::kNumRxRingEntries;
-    qp->_wait_for_disp = 0;
     return dispatch_total;
 }
 
 size_t SoCWrapper::__collect_tx_pkts(RDMA_SoC_QP *qp) {
+    if (this->_reorder_flows != nullptr) {
+        return this->__collect_tx_pkts_in_order(qp);
+    }
     size_t remain_ring_size = RDMA_SoC_QP::kNumTxRingEntries - qp->_tx_queue_idx;
-    uint8_t nb_collect_queue = 0;
     size_t nb_collect_num = 0;
-    struct soc_shm_lock_free_queue *worker_queue = qp->_collect_worker_queue;
-    size_t tx_size = (worker_queue->get_size() > remain_ring_size) 
-                          ? remain_ring_size : worker_queue->get_size();
-    for (size_t i = 0; i < tx_size; i++) {
-        qp->_tx_queue[qp->_tx_queue_idx] = (Buffer*)worker_queue->dequeue();
-        qp->_tx_queue_idx++;
+    soc_shm_mpsc_queue *worker_queue = qp->_collect_worker_queue;
+    while (remain_ring_size > 0) {
+        size_t nb_burst = remain_ring_size > kQueueBurstSize ? kQueueBurstSize : remain_ring_size;
+        size_t nb_dequeue = worker_queue->dequeue_burst((uint8_t**)&qp->_tx_queue[qp->_tx_queue_idx], nb_burst);
+        this->__clear_buf_holders(&qp->_tx_queue[qp->_tx_queue_idx], nb_dequeue);
+        qp->_tx_queue_idx += nb_dequeue;
+        remain_ring_size -= nb_dequeue;
+        nb_collect_num += nb_dequeue;
+        if (nb_dequeue < nb_burst) break;
+    }
+    return nb_collect_num;
+}
+
+size_t SoCWrapper::__collect_tx_pkts_in_order(RDMA_SoC_QP *qp) {
+    soc_shm_mpsc_queue *worker_queue = qp->_collect_worker_queue;
+    Buffer *burst[kQueueBurstSize];
+    size_t nb_collect_num = 0;
+
+    if (unlikely(this->_reorder_nb_held > 0)) {
+        this->__expire_reorder_flows(qp);
+    }
+    /// a burst releases at most itself and all held packets, which must fit into the tx queue
+    while (true) {
+        size_t room = RDMA_SoC_QP::kNumTxRingEntries - qp->_tx_queue_idx;
+        if (room <= this->_reorder_nb_held) break;
+        size_t nb_burst = std::min(room - this->_reorder_nb_held, kQueueBurstSize);
+        size_t nb_dequeue = worker_queue->dequeue_burst((uint8_t**)burst, nb_burst);
+        this->__clear_buf_holders(burst, nb_dequeue);
+        for (size_t i = 0; i < nb_dequeue; i++) {
+            Buffer *pkt = burst[i];
+            soc_reorder_flow &flow = this->_reorder_flows[pkt->order_flow_];
+            int32_t ahead = static_cast<int32_t>(pkt->order_seq_ - flow.next_seq);
+            if (unlikely(ahead >= static_cast<int32_t>(kReorderWindow))) {
+                /// too far ahead to wait for the missing packets, slide the window just enough
+                /// to hold the packet, sending the held packets it passes over
+                uint32_t next_seq = pkt->order_seq_ - (kReorderWindow - 1);
+                uint32_t end_seq = (ahead >= static_cast<int32_t>(2 * kReorderWindow)) ?
+                    flow.next_seq + kReorderWindow : next_seq;
+                for (; flow.next_seq != end_seq; flow.next_seq++) {
+                    Buffer *&slot = flow.held[flow.next_seq & (kReorderWindow - 1)];
+                    if (slot == nullptr) continue;
+                    qp->_tx_queue[qp->_tx_queue_idx++] = slot;
+                    slot = nullptr;
+                    flow.nb_held--;
+                    this->_reorder_nb_held--;
+                }
+                flow.next_seq = next_seq;
+                this->_reorder_stats.nb_gaps++;
+                this->__drain_reorder_flow(qp, pkt->order_flow_);
+                ahead = static_cast<int32_t>(pkt->order_seq_ - flow.next_seq);
+            }
+            if (likely(ahead == 0)) {
+                /// in order, the flow pays no more than this comparison
+                qp->_tx_queue[qp->_tx_queue_idx++] = pkt;
+                flow.next_seq++;
+                if (unlikely(flow.nb_held > 0)) {
+                    this->__drain_reorder_flow(qp, pkt->order_flow_);
+                }
+            } else if (ahead < 0) {
+                /// the flow gave up waiting for this packet, send it rather than drop it
+                qp->_tx_queue[qp->_tx_queue_idx++] = pkt;
+                this->_reorder_stats.nb_late++;
+            } else {
+                if (flow.nb_held == 0) {
+                    flow.hold_tsc = rdtsc();
+                }
+                flow.held[pkt->order_seq_ & (kReorderWindow - 1)] = pkt;
+                flow.nb_held++;
+                this->_reorder_nb_held++;
+                this->_reorder_stats.nb_reordered++;
+            }
+        }
+        nb_collect_num += nb_dequeue;
+        if (nb_dequeue < nb_burst) break;
+    }
+    return nb_collect_num;
+}
+
+void SoCWrapper::__drain_reorder_flow(RDMA_SoC_QP *qp, uint16_t flow_id) {
+    soc_reorder_flow &flow = this->_reorder_flows[flow_id];
+    while (flow.nb_held > 0 && qp->_tx_queue_idx < RDMA_SoC_QP::kNumTxRingEntries) {
+        Buffer *&slot = flow.held[flow.next_seq & (kReorderWindow - 1)];
+        if (slot == nullptr) {
+            /// waits for the next missing packet from now on
+            flow.hold_tsc = rdtsc();
+            break;
+        }
+        qp->_tx_queue[qp->_tx_queue_idx++] = slot;
+        slot = nullptr;
+        flow.next_seq++;
+        flow.nb_held--;
+        this->_reorder_nb_held--;
+    }
+}
+
+void SoCWrapper::__expire_reorder_flows(RDMA_SoC_QP *qp) {
+    size_t now_tsc = rdtsc();
+    /// flows are scanned a few times per timeout, not on every round
+    if (now_tsc - this->_reorder_check_tsc < this->_reorder_timeout_tsc / 4) {
+        return;
+    }
+    this->_reorder_check_tsc = now_tsc;
+
+    for (uint16_t i = 0; i < kReorderFlowNum && this->_reorder_nb_held > 0; i++) {
+        soc_reorder_flow &flow = this->_reorder_flows[i];
+        if (flow.nb_held == 0) continue;
+        if (flow.held[flow.next_seq & (kReorderWindow - 1)] == nullptr) {
+            if (now_tsc - flow.hold_tsc < this->_reorder_timeout_tsc) continue;
+            /// the missing packets were dropped by a worker, skip to the next held one
+            while (flow.held[flow.next_seq & (kReorderWindow - 1)] == nullptr) {
+                flow.next_seq++;
+            }
+            this->_reorder_stats.nb_gaps++;
+        }
+        this->__drain_reorder_flow(qp, i);
     }
-    nb_collect_queue++;
-    remain_ring_size -= tx_size;
-    nb_collect_num += tx_size;
-    return tx_size;
 }
 
 size_t SoCWrapper::__tx_burst(RDMA_SoC_QP *qp, Buffer **tx, size_t tx_size) {
     // Mount buffers to send wr, generate corresponding sge
     size_t nb_tx_res = 0;   // total number of mounted wr for this burst tx
-    /// post send cq first
-    int ret = ibv_poll_cq(qp->_send_cq, RDMA_SoC_QP::kNumTxRingEntries, qp->_send_wc);
-    assert(ret >= 0);
-    qp->_free_send_wr_num += ret;
-    for (int i = 0; i < ret; i++) {
-        qp->_sw_ring[qp->_send_head]->state_ = Buffer::kFREE_BUF;
-        qp->_send_head = (qp->_send_head + 1) % RDMA_SoC_QP::kNumTxRingEntries;
+    int ret;
+    /// reap send completions first, wrs complete in order, so one completion covers the
+    /// whole run of unsignaled wrs before it
+    if (qp->_nb_send_signaled > 0) {
+        ret = ibv_poll_cq(qp->_send_cq, RDMA_SoC_QP::kNumTxRingEntries, qp->_send_wc);
+        assert(ret >= 0);
+        for (int i = 0; i < ret; i++) {
+            size_t nb_done = (qp->_send_wc[i].wr_id + RDMA_SoC_QP::kNumTxRingEntries - qp->_send_head)
+                                % RDMA_SoC_QP::kNumTxRingEntries + 1;
+            if (unlikely(qp->_send_wc[i].status != IBV_WC_SUCCESS)) {
+                NICC_WARN_C("send completion error: %s, wr_id(%lu)",
+                            ibv_wc_status_str(qp->_send_wc[i].status), qp->_send_wc[i].wr_id);
+            }
+            for (size_t j = 0; j < nb_done; j++) {
+                /// straight back to the rx QP the buffer came from, ready to be reposted
+                Buffer *m = qp->_sw_ring[qp->_send_head];
+                m->rx_qp_->push_free_buf(m);
+                qp->_send_head = (qp->_send_head + 1) % RDMA_SoC_QP::kNumTxRingEntries;
+            }
+            qp->_free_send_wr_num += nb_done;
+        }
+        /// a failed QP also completes unsignaled wrs
+        qp->_nb_send_signaled = (static_cast<size_t>(ret) < qp->_nb_send_signaled) ? qp->_nb_send_signaled - ret : 0;
     }
     /// post send wr
     struct ibv_send_wr* first_wr = &qp->_send_wr[qp->_send_tail];
@@ -236,6 +1570,13 @@ size_t SoCWrapper::__tx_burst(RDMA_SoC_QP *qp, Buffer **tx, size_t tx_size) {
         sgl->addr = reinterpret_cast<uint64_t>(m->get_buf());
         sgl->length = m->length_;
         sgl->lkey = m->lkey_;
+        if (++qp->_nb_send_unsignaled >= kTxSignalInterval || nb_tx_res + 1 == tx_size || qp->_free_send_wr_num == 1) {
+            tail_wr->send_flags = IBV_SEND_SIGNALED;
+            qp->_nb_send_unsignaled = 0;
+            qp->_nb_send_signaled++;
+        } else {
+            tail_wr->send_flags = 0;
+        }
         /// \todo UD mode
         /// mount buffer to sw_ring
         qp->_sw_ring[qp->_send_tail] = m;
@@ -258,13 +1599,26 @@ size_t SoCWrapper::__tx_burst(RDMA_SoC_QP *qp, Buffer **tx, size_t tx_size) {
 
 size_t SoCWrapper::__tx_flush(RDMA_SoC_QP *qp) {
     size_t nb_tx = 0, tx_total = 0;
+    size_t nb_flush = qp->_tx_queue_idx;
     Buffer **tx = &qp->_tx_queue[0];
-    while(tx_total < qp->_tx_queue_idx) {
-        nb_tx = this->__tx_burst(qp, tx, qp->_tx_queue_idx - tx_total);
+    soc_token_bucket_t &shaper = (qp == this->_qp_for_next) ? this->_shaper_next : this->_shaper_prior;
+    if (unlikely(shaper.depth > 0) && nb_flush > 0) {
+        nb_flush = this->__shape_tx_pkts(shaper, tx, nb_flush);
+        if (nb_flush == 0) {
+            return 0;
+        }
+    }
+    while(tx_total < nb_flush) {
+        nb_tx = this->__tx_burst(qp, tx, nb_flush - tx_total);
         tx += nb_tx;
         tx_total += nb_tx;
     }
-    qp->_tx_queue_idx = 0;
+    /// packets over the rate are held at the head of the tx queue, which then takes fewer
+    /// packets from the workers and the rx ring until the bucket refills
+    if (unlikely(nb_flush < qp->_tx_queue_idx)) {
+        memmove(&qp->_tx_queue[0], &qp->_tx_queue[nb_flush], (qp->_tx_queue_idx - nb_flush) * sizeof(Buffer*));
+    }
+    qp->_tx_queue_idx -= nb_flush;
     return tx_total;
 }
 
@@ -283,23 +1637,4 @@ size_t SoCWrapper::__direct_tx_burst(RDMA_SoC_QP *rx_qp, RDMA_SoC_QP *tx_qp) {
     return remain_tx_queue_size;
 }
 
-nicc_retval_t SoCWrapper::__forward_packet_with_routing(Buffer* packet, nicc_core_retval_t kernel_retval) {
-    // if (!packet) {
-    //     NICC_ERROR_C("Invalid packet buffer in __forward_packet_with_routing.");
-    //     return NICC_ERROR;
-    // }
-    
-    // if (!this->_context->routing) {
-    //     NICC_ERROR_C("Routing not configured in SoCWrapper context.");
-    //     return NICC_ERROR;
-    // }
-    
-    // // Use ComponentRouting_SoC's forward_packet_after_kernel method
-    // return this->_context->routing->forward_packet_after_kernel(
-    //     packet, 
-    //     kernel_retval, 
-    //     reinterpret_cast<nicc::Channel*>(this->_qp_for_next)  // Use next QP as default channel
-    // );
-}
-
 } // namespace nicc
\ No newline at end of file
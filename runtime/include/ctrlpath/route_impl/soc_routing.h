@@ -28,13 +28,6 @@ public:
      *  \return NICC_SUCCESS for successful registration
      */
     nicc_retval_t register_local_channel(const std::string& channel_name, nicc::Channel* channel) override;
-
-    /**
-     *  \brief  SoC-specific retval to local channel lookup
-     *  \param  kernel_retval   return value from user kernel
-     *  \return pointer to target local channel, nullptr if not found
-     */
-    nicc::Channel* lookup_channel(nicc_core_retval_t kernel_retval) override;
 };
 
 } // namespace nicc
\ No newline at end of file
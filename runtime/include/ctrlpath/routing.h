@@ -67,12 +67,24 @@ typedef struct PipelineRoutingState {
  * ----------------------Component-Level Routing Structures----------------------
  */ 
 
+/**
+ * \brief  Compiled route of a kernel return value
+ */
+typedef struct ComponentRoute {
+    nicc::Channel* channel;     // target local channel, nullptr if the packet is dropped
+    bool is_mapped;             // set by a ctrl_path entry, otherwise the default channel applies
+} ComponentRoute_t;
+
 /**
  * \brief  Component routing state for local retval-to-channel mapping
  */
 typedef struct ComponentRoutingState {
-    // Mapping from kernel return value to local channel
+    // Mapping from kernel return value to local channel, nullptr drops the packet
     std::map<nicc_core_retval_t, nicc::Channel*> retval_to_channel_map;
+
+    // Dense routes indexed by kernel return value, compiled from retval_to_channel_map
+    // and default_channel whenever they change, so a lookup is a single load
+    ComponentRoute_t retval_routes[UINT8_MAX + 1];
     
     // Local channels managed by this component (for registration only)
     std::map<std::string, nicc::Channel*> local_channels;
@@ -175,6 +187,7 @@ public:
         this->_state->component_type = comp_type;
         this->_state->component_id = comp_id;
         this->_state->default_channel = nullptr;
+        this->__compile_retval_routes();
     }
     
     virtual ~ComponentRouting() {
@@ -204,6 +217,13 @@ public:
      */
     virtual nicc_retval_t add_retval_mapping(nicc_core_retval_t retval, nicc::Channel* channel);
 
+    /**
+     *  \brief  Drop packets for which the kernel returns the given value
+     *  \param  retval          kernel return value
+     *  \return NICC_SUCCESS for successful mapping
+     */
+    virtual nicc_retval_t add_retval_drop(nicc_core_retval_t retval);
+
     /**
      *  \brief  Set default channel for unmapped return values
      *  \param  channel         default channel
@@ -222,8 +242,14 @@ public:
     component_typeid_t get_component_type() const { return _state->component_type; }
     const std::string& get_component_id() const { return _state->component_id; }
     const ComponentRoutingState_t* get_state() const { return _state; }
+    const ComponentRoute_t* get_retval_routes() const { return _state->retval_routes; }
 
 protected:
+    /**
+     *  \brief  Rebuild the dense routes from the retval mappings and the default channel
+     */
+    void __compile_retval_routes();
+
     ComponentRoutingState_t* _state;
 };
 
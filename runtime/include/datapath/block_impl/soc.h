@@ -7,6 +7,7 @@
 #include "log.h"
 #include "app_context.h"
 #include "datapath/component_block.h"
+#include "utils/app_dag.h"
 
 // nicc_lib headers
 #include "wrapper/soc/soc_wrapper.h"
@@ -40,6 +41,7 @@ typedef struct ComponentDesp_SoC {
     /* ========== Specific fields ========== */
     const char *device_name;
     uint8_t phy_port;
+    uint16_t core_id;   /// first core of the block, the block owns quota cores from it
 } ComponentDesp_SoC_t;
 
 
@@ -53,9 +55,16 @@ typedef struct ComponentFuncState_SoC {
     /* ========== wrapper metadata ========== */
     ComponentFuncBaseState_t base_state;
 
-    // wrapper thread, \todo: use vector for multiple threads
-    SoCWrapper::SoCWrapperContext *context;
-    std::thread *wrapper_thread;
+    // wrapper threads, the first one is the dispatcher, each with its own context
+    std::vector<SoCWrapper::SoCWrapperContext*> contexts;
+    std::vector<std::thread*> wrapper_threads;
+    // wrapper threads already pinned to their cores, each thread waits for its turn before
+    // its user state is allocated, so that the memory is local to its core
+    std::atomic<size_t> nb_pinned_threads{0};
+    // user state of each worker, folded by the merge handler
+    std::atomic<void*> worker_user_states[kSoCWorkspaceMaxNum] = {};
+    // the final merge runs between the workers stopping and freeing their user states
+    soc_merge_barrier_t merge_barrier;
     // Communication Channel
     Channel_SoC                 *channel;           // Communication channel for SoC
     /* ========== Specific fields ========== */
@@ -82,7 +91,7 @@ class ComponentBlock_SoC : public ComponentBlock {
     /**
      *  \brief  typeid of handlers register into SoC
      */
-    enum handler_typeid_t : appfunc_handler_typeid_t { Init = 0, Pkt_Handler, Msg_Handler, Cleanup };
+    enum handler_typeid_t : appfunc_handler_typeid_t { Init = 0, Pkt_Handler, Msg_Handler, Cleanup, Msg_Burst_Handler, Merge_Handler, Async_Msg_Handler };
 
     /**
      *  \brief  register a new application function into this component
@@ -150,6 +159,24 @@ class ComponentBlock_SoC : public ComponentBlock {
      */
     nicc_retval_t register_local_channels();
 
+    /**
+     *  \brief  apply the data_path configuration of this block in the app DAG to the SoCWrapper,
+     *          must be called before run_block; "order": "false" lets messages leave the block
+     *          out of order, "work_stealing": "true" or "false" balances the workers of such
+     *          a block by stealing, on by default only without order
+     *  \param  dag_component [in] the DAG configuration of this component block
+     *  \return NICC_SUCCESS for successful application
+     */
+    nicc_retval_t apply_datapath_config(const DAGComponent *dag_component);
+
+    /**
+     *  \brief  reprogram the RSS indirection table of the dispatcher, can be called while the block
+     *          runs; a bucket moves to its new worker once the old one finished its packets
+     *  \param  reta  [in] worker of each bucket, repeated over all kSoCRssRetaSize buckets
+     *  \return NICC_SUCCESS for successful reprogramming
+     */
+    nicc_retval_t set_rss_indirection_table(const std::vector<uint16_t> &reta);
+
 /**
  * ----------------------Internel Methonds----------------------
  */ 
@@ -171,12 +198,76 @@ private:
     nicc_retval_t __deallocate_wrapper_resources(ComponentFuncState_SoC_t *func_state);
 
     /**
-     *  \brief  create wrapper process for the function
+     *  \brief  create wrapper process for the function, i.e., a single thread serving as both
+     *          dispatcher and worker when the block has one core, otherwise a dispatcher
+     *          thread and one worker thread per remaining core, each pinned to its own core
      *  \param  func_state  state of the function on this SoC block
      *  \return NICC_SUCCESS for successful creation
      */
     nicc_retval_t __create_wrapper_process(ComponentFuncState_SoC_t *func_state);
 
+    /**
+     *  \brief  compile the retval-to-channel routes of the component into the dense
+     *          route table of the wrapper config, which the workers look up per message
+     *  \param  channel     the SoC channel of the block, whose next QP forwarded messages take
+     *  \return NICC_SUCCESS for successful compilation
+     */
+    nicc_retval_t __compile_routes(Channel_SoC *channel);
+
+    /**
+     *  \brief  parse the traffic classes of the dispatcher-to-worker path from data_path, i.e.,
+     *          "traffic_classes": number of classes,
+     *          "class_field": "ws_type" or "dscp",
+     *          "class_map": comma-separated "field_value:class" pairs, unmapped values go to the last class,
+     *          "class_sched": "strict" or "drr",
+     *          "class_quantum": comma-separated DRR quantum of each class, in messages
+     *  \param  dag_component [in] the DAG configuration of this component block
+     *  \return NICC_SUCCESS for successful parsing
+     */
+    nicc_retval_t __parse_traffic_class_config(const DAGComponent *dag_component);
+
+    /**
+     *  \brief  parse how the workers see packets from data_path, i.e.,
+     *          "handler_type": "packet" (default) or "message", whose segments are
+     *          reassembled before the handlers run, only with rss dispatch and packet order,
+     *          "reassembly_timeout_us": age at which an incomplete message is dropped
+     *  \param  dag_component [in] the DAG configuration of this component block
+     *  \return NICC_SUCCESS for successful parsing
+     */
+    nicc_retval_t __parse_message_config(const DAGComponent *dag_component);
+
+    /**
+     *  \brief  parse how the dispatcher spreads packets over the workers from data_path, i.e.,
+     *          "dispatch": "rss", "round_robin", or "p2c" (power of two choices, only for
+     *          "order": "false" blocks); defaults to "p2c" without order and "rss" otherwise,
+     *          "rss_reta": comma-separated worker of each RSS bucket, repeated over all buckets
+     *  \param  dag_component [in] the DAG configuration of this component block
+     *  \return NICC_SUCCESS for successful parsing
+     */
+    nicc_retval_t __parse_dispatch_config(const DAGComponent *dag_component);
+
+    /**
+     *  \brief  parse the egress shapers of the dispatcher from data_path, i.e.,
+     *          "shape_next_gbps" / "shape_prior_gbps": rate towards the next block, e.g.,
+     *          the local host, and back towards the prior block, unshaped if absent or 0,
+     *          "shape_next_burst_kb" / "shape_prior_burst_kb": depth of the token bucket
+     *  \param  dag_component [in] the DAG configuration of this component block
+     *  \return NICC_SUCCESS for successful parsing
+     */
+    nicc_retval_t __parse_shaper_config(const DAGComponent *dag_component);
+
+    /**
+     *  \brief  parse the sampling tap of the dispatcher from data_path, i.e.,
+     *          "mirror_next_sample" / "mirror_prior_sample": copy every N-th packet received
+     *          from the next / prior block, untapped if absent or 0,
+     *          "mirror_rate_pps": upper bound of samples per second and QP,
+     *          "mirror_snaplen": bytes copied per packet,
+     *          "mirror_path": pcap file, defaults to /tmp/<block name>.pcap, must not exist yet
+     *  \param  dag_component [in] the DAG configuration of this component block
+     *  \return NICC_SUCCESS for successful parsing
+     */
+    nicc_retval_t __parse_mirror_config(const DAGComponent *dag_component);
+
 /**
  * ----------------------Public parameters----------------------
  */
@@ -212,7 +303,14 @@ private:
     AppHandler *_pkt_handler = nullptr;
     AppHandler *_msg_handler = nullptr;
     AppHandler *_cleanup_handler = nullptr;
-    
+    AppHandler *_msg_burst_handler = nullptr;
+    AppHandler *_merge_handler = nullptr;
+    AppHandler *_async_msg_handler = nullptr;
+
+    /**
+     * \brief  configuration passed to every SoCWrapper of this block
+     */
+    SoCWrapper::SoCWrapperConfig _wrapper_config;
 };
 
 
@@ -65,11 +65,7 @@ class Channel_SoC : public Channel {
             NICC_WARN_C("Memory degistration failed. size %zu B, lkey %u\n", this->_mr->length / MB(1), this->_mr->lkey);
         }
         NICC_DEBUG_C("Deregistered %zu MB (lkey = %u)\n", this->_mr->length / MB(1), this->_mr->lkey);
-        // delete Buffer in _rx_ring
-        for (size_t i = 0; i < kRQDepth; i++) {
-            delete this->qp_for_prior->_rx_ring[i];
-            delete this->qp_for_next->_rx_ring[i];
-        }
+        // Buffers in _rx_ring live in the SHM segment, released together with it
         // delete SHM
         delete this->_huge_alloc;
 
@@ -77,9 +73,11 @@ class Channel_SoC : public Channel {
         exit_assert(ibv_destroy_qp(this->qp_for_prior->_qp) == 0, "Failed to destroy send QP");
         exit_assert(ibv_destroy_cq(this->qp_for_prior->_send_cq) == 0, "Failed to destroy send CQ");
         exit_assert(ibv_destroy_cq(this->qp_for_prior->_recv_cq) == 0, "Failed to destroy recv CQ");
+        exit_assert(ibv_destroy_comp_channel(this->qp_for_prior->_recv_comp_channel) == 0, "Failed to destroy completion channel");
         exit_assert(ibv_destroy_qp(this->qp_for_next->_qp) == 0, "Failed to destroy send QP");
         exit_assert(ibv_destroy_cq(this->qp_for_next->_send_cq) == 0, "Failed to destroy send CQ");
         exit_assert(ibv_destroy_cq(this->qp_for_next->_recv_cq) == 0, "Failed to destroy recv CQ");
+        exit_assert(ibv_destroy_comp_channel(this->qp_for_next->_recv_comp_channel) == 0, "Failed to destroy completion channel");
         exit_assert(ibv_destroy_ah(this->_local_ah) == 0, "Failed to destroy local AH");
         exit_assert(ibv_destroy_ah(this->qp_for_prior->_remote_ah) == 0, "Failed to destroy remote AH");
         exit_assert(ibv_destroy_ah(this->qp_for_next->_remote_ah) == 0, "Failed to destroy remote AH");
@@ -93,9 +91,11 @@ class Channel_SoC : public Channel {
      * \param ibv_ctx IBV context
      * \param queue_depth Depth of application queues
      * \param max_sge Maximum number of scatter/gather elements per WR
+     * \param shm_name Name of the SHM segment holding the worker queues and packet buffers,
+     *                 which external worker processes attach to
      * \return NICC_SUCCESS on success and NICC_ERROR otherwise
      */
-    nicc_retval_t allocate_channel(const char *dev_name, uint8_t phy_port);
+    nicc_retval_t allocate_channel(const char *dev_name, uint8_t phy_port, const std::string &shm_name);
 
     /**
      * \brief Deallocate channel resources
@@ -123,6 +123,8 @@ class Channel_SoC : public Channel {
     class RDMA_SoC_QP *qp_for_next;         /// QP for next component block
     QPInfo *qp_for_prior_info;
     QPInfo *qp_for_next_info;
+    /// SHM segment shared with the workers of this block
+    soc_shm_segment_hdr *shm_segment = nullptr;
 /**
  * ----------------------Internel methods----------------------
  */ 
@@ -171,9 +173,10 @@ class Channel_SoC : public Channel {
     /**
      * @brief Initialize the RECV queue
      * @param qp [in] RDMA_SoC_QP for prior or next component block
+     * @param buffer_descs [in] kRQDepth Buffer descriptors in the SHM segment for the rx ring
      * @return NICC_SUCCESS on success and NICC_ERROR otherwise
      */
-    nicc_retval_t __init_recvs(RDMA_SoC_QP *qp);
+    nicc_retval_t __init_recvs(RDMA_SoC_QP *qp, Buffer *buffer_descs);
 
     /**
      * @brief Initialize the SEND queue
@@ -210,6 +213,8 @@ class Channel_SoC : public Channel {
  private:
     /// The hugepage allocator for this channel
     HugeAlloc *_huge_alloc = nullptr;
+    /// Name of the SHM segment
+    std::string _shm_name;
     /// Info resolved from \p phy_port, must be filled by constructor.
     class IBResolve : public VerbsResolve {
     public:
@@ -10,6 +10,7 @@
 #include "common/buffer.h"
 #include "utils/rand.h"
 #include "common/math_utils.h"
+#include "common/soc_shm_segment.h"
 
 namespace nicc {
 
@@ -20,12 +21,15 @@ struct shm_region_t {
   const uint8_t *buf_;     /// The start address of the allocated SHM buffer
   const size_t size_;      /// The size in bytes of the allocated SHM buffer
   const bool registered_;  /// Is this SHM region registered with the NIC?
+  const bool named_;       /// Is this SHM region attachable by other processes?
 
-  shm_region_t(int shm_key, uint8_t *buf, size_t size, bool registered)
+  shm_region_t(int shm_key, uint8_t *buf, size_t size, bool registered,
+               bool named = false)
       : shm_key_(shm_key),
         buf_(buf),
         size_(size),
-        registered_(registered) {
+        registered_(registered),
+        named_(named) {
     assert(size % kHugepageSize == 0);
   }
 };
@@ -92,6 +96,29 @@ class HugeAlloc {
    */
   Buffer alloc_raw(size_t size, DoRegister do_register);
 
+  /**
+   * @brief Allocate a named SHM region, which other processes can attach to
+   * by \p name (see soc_shm_attach_segment). Unlike \p alloc_raw(), the region
+   * is not marked for deletion right away, it is removed when this allocator
+   * is destroyed, and lives on until the last attached process detaches.
+   *
+   * A stale region left with the same name by a crashed run is removed first,
+   * provided it starts with \p magic and no process is attached to it; any
+   * other region with the same key is left alone and the allocation fails.
+   * The region is accessible to the user and group of this process only.
+   *
+   * @param name The name of the region, unique on this host
+   * @param size The minimum size of the allocated memory
+   * @param magic The 64-bit value the caller writes at the start of the region
+   *
+   * @return The allocated hugepage-backed Buffer. buffer.buf is nullptr if we
+   * ran out of memory.
+   *
+   * @throw runtime_error if hugepage reservation failure is catastrophic
+   */
+  Buffer alloc_named(const std::string &name, size_t size, uint64_t magic,
+                     DoRegister do_register);
+
   /**
    * @brief Allocate a Buffer using the allocator's freelists, i.e., the max
    * size that can be allocated is the max freelist class size.
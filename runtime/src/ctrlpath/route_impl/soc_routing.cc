@@ -21,19 +21,4 @@ nicc_retval_t ComponentRouting_SoC::register_local_channel(const std::string& ch
     return NICC_SUCCESS;
 }
 
-nicc::Channel* ComponentRouting_SoC::lookup_channel(nicc_core_retval_t kernel_retval) {
-    NICC_LOG("SoC: Looking up channel for kernel_retval=%d.", kernel_retval);
-    
-    // Call base class implementation
-    nicc::Channel* channel = ComponentRouting::lookup_channel(kernel_retval);
-    
-    if (channel) {
-        NICC_LOG("SoC: Found target channel for retval=%d.", kernel_retval);
-    } else {
-        NICC_WARN_C("SoC: No channel mapping found for retval=%d.", kernel_retval);
-    }
-    
-    return channel;
-}
-
 } // namespace nicc
\ No newline at end of file
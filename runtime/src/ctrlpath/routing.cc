@@ -141,32 +141,50 @@ nicc_retval_t ComponentRouting::add_retval_mapping(nicc_core_retval_t retval, ni
     }
     
     this->_state->retval_to_channel_map[retval] = channel;
+    this->__compile_retval_routes();
     NICC_DEBUG_C("Added retval mapping in component '%s': %d -> channel", 
             this->_state->component_id.c_str(), retval);
     return NICC_SUCCESS;
 }
 
+nicc_retval_t ComponentRouting::add_retval_drop(nicc_core_retval_t retval) {
+    if (this->_state->retval_to_channel_map.count(retval) > 0) {
+        NICC_WARN_C("Retval %d already mapped in component '%s'. Overwriting.", 
+                   retval, this->_state->component_id.c_str());
+    }
+    
+    this->_state->retval_to_channel_map[retval] = nullptr;
+    this->__compile_retval_routes();
+    NICC_DEBUG_C("Added retval mapping in component '%s': %d -> drop", 
+            this->_state->component_id.c_str(), retval);
+    return NICC_SUCCESS;
+}
+
 nicc_retval_t ComponentRouting::set_default_channel(nicc::Channel* channel) {
     this->_state->default_channel = channel;
+    this->__compile_retval_routes();
     NICC_DEBUG_C("Set default channel in component '%s'.", this->_state->component_id.c_str());
     return NICC_SUCCESS;
 }
 
 nicc::Channel* ComponentRouting::lookup_channel(nicc_core_retval_t kernel_retval) {
-    // Try retval mapping first
-    auto it = this->_state->retval_to_channel_map.find(kernel_retval);
-    if (it != this->_state->retval_to_channel_map.end()) {
-        return it->second;
+    const ComponentRoute_t &route = this->_state->retval_routes[kernel_retval];
+    if (unlikely(route.channel == nullptr && !route.is_mapped)) {
+        NICC_WARN_C("Component '%s': no mapping found for retval %d", 
+                   this->_state->component_id.c_str(), kernel_retval);
     }
-    
-    // Fall back to default channel
-    if (this->_state->default_channel) {
-        return this->_state->default_channel;
+    return route.channel;
+}
+
+void ComponentRouting::__compile_retval_routes() {
+    for (size_t i = 0; i <= UINT8_MAX; i++) {
+        this->_state->retval_routes[i].channel = this->_state->default_channel;
+        this->_state->retval_routes[i].is_mapped = false;
+    }
+    for (const auto& mapping : this->_state->retval_to_channel_map) {
+        this->_state->retval_routes[mapping.first].channel = mapping.second;
+        this->_state->retval_routes[mapping.first].is_mapped = true;
     }
-    
-    NICC_WARN_C("Component '%s': no mapping found for retval %d", 
-               this->_state->component_id.c_str(), kernel_retval);
-    return nullptr;
 }
 
 /**
@@ -2,7 +2,7 @@
 #include "ctrlpath/route_impl/soc_routing.h"
 
 namespace nicc {
-static void __soc_wrapper_thread_func(ComponentFuncState_SoC_t *func_state);
+static void __soc_wrapper_thread_func(ComponentFuncState_SoC_t *func_state, size_t thread_idx, SoCWrapper::soc_wrapper_type_t type);
 
 nicc_retval_t ComponentBlock_SoC::register_app_function(AppFunction *app_func, device_state_t &device_state){
     nicc_retval_t retval = NICC_SUCCESS;
@@ -35,6 +35,15 @@ nicc_retval_t ComponentBlock_SoC::register_app_function(AppFunction *app_func, d
         case handler_typeid_t::Cleanup:
             this->_cleanup_handler = app_handler;
             break;
+        case handler_typeid_t::Msg_Burst_Handler:
+            this->_msg_burst_handler = app_handler;
+            break;
+        case handler_typeid_t::Merge_Handler:
+            this->_merge_handler = app_handler;
+            break;
+        case handler_typeid_t::Async_Msg_Handler:
+            this->_async_msg_handler = app_handler;
+            break;
         default:
             NICC_ERROR_C_DETAIL("unregornized handler id for SoC, this is a bug: handler_id(%u)", app_handler->tid);
         }
@@ -121,7 +130,7 @@ nicc_retval_t ComponentBlock_SoC::run_block(){
         goto exit;
     }
     /// wait thread join. 
-    // this->_function_state->wrapper_thread->join();
+    // for (std::thread *t : this->_function_state->wrapper_threads) t->join();
 
 exit:
     return retval;
@@ -167,13 +176,423 @@ nicc_retval_t ComponentBlock_SoC::register_local_channels(){
     return retval;
 }
 
+nicc_retval_t ComponentBlock_SoC::apply_datapath_config(const DAGComponent *dag_component){
+    nicc_retval_t retval = NICC_SUCCESS;
+    NICC_CHECK_POINTER(dag_component);
+
+    auto order_it = dag_component->data_path.find("order");
+    this->_wrapper_config.is_unordered = (order_it != dag_component->data_path.end() && order_it->second == "false");
+    // blocks which don't require packet order balance their workers by stealing, unless told not to
+    auto work_stealing_it = dag_component->data_path.find("work_stealing");
+    if (work_stealing_it == dag_component->data_path.end()) {
+        this->_wrapper_config.enable_work_stealing = this->_wrapper_config.is_unordered;
+    } else if (work_stealing_it->second == "true" || work_stealing_it->second == "false") {
+        this->_wrapper_config.enable_work_stealing = (work_stealing_it->second == "true");
+    } else {
+        NICC_WARN_C("unknown work_stealing %s for SoC block %s", work_stealing_it->second.c_str(), dag_component->name.c_str());
+        return NICC_ERROR;
+    }
+    if (this->_wrapper_config.enable_work_stealing && !this->_wrapper_config.is_unordered) {
+        NICC_WARN_C("work stealing reorders packets, only for blocks with \"order\": \"false\"");
+        return NICC_ERROR;
+    }
+    // workers run in processes attached to the SHM segment of the block
+    auto worker_mode_it = dag_component->data_path.find("worker_mode");
+    if (worker_mode_it != dag_component->data_path.end() && worker_mode_it->second == "process") {
+        this->_wrapper_config.external_workers = true;
+    } else {
+        this->_wrapper_config.external_workers = false;
+    }
+    // overloaded workers push back on the sender through RNR instead of dropping
+    auto overload_it = dag_component->data_path.find("overload");
+    if (overload_it == dag_component->data_path.end() || overload_it->second == "drop") {
+        this->_wrapper_config.enable_backpressure = false;
+    } else if (overload_it->second == "backpressure") {
+        this->_wrapper_config.enable_backpressure = true;
+    } else {
+        NICC_WARN_C("unknown overload %s for SoC block %s", overload_it->second.c_str(), dag_component->name.c_str());
+        return NICC_ERROR;
+    }
+    // batches adapt to the load, but pending messages never wait longer than the deadline
+    auto batch_deadline_it = dag_component->data_path.find("batch_deadline_us");
+    if (batch_deadline_it != dag_component->data_path.end()) {
+        try {
+            this->_wrapper_config.batch_deadline_us = std::stod(batch_deadline_it->second);
+        } catch (const std::exception &e) {
+            NICC_WARN_C("invalid batch_deadline_us for SoC block %s: %s, use default %.1f",
+                        dag_component->name.c_str(), batch_deadline_it->second.c_str(),
+                        this->_wrapper_config.batch_deadline_us);
+        }
+        if (this->_wrapper_config.batch_deadline_us < 0.0) {
+            this->_wrapper_config.batch_deadline_us = 0.0;
+        }
+    }
+    // the dispatcher periodically folds the user states of the workers with the merge handler
+    auto merge_interval_it = dag_component->data_path.find("merge_interval_ms");
+    if (merge_interval_it != dag_component->data_path.end()) {
+        try {
+            this->_wrapper_config.merge_interval_ms = std::stod(merge_interval_it->second);
+        } catch (const std::exception &e) {
+            NICC_WARN_C("invalid merge_interval_ms for SoC block %s: %s, use default %.1f",
+                        dag_component->name.c_str(), merge_interval_it->second.c_str(),
+                        this->_wrapper_config.merge_interval_ms);
+        }
+        if (this->_wrapper_config.merge_interval_ms < 0.0) {
+            this->_wrapper_config.merge_interval_ms = 0.0;
+        }
+    }
+    // idle threads spin, back off, then sleep, trading power for tail latency; with "event"
+    // the dispatcher sleeps on the completion channels of its CQs until packets arrive
+    auto idle_wait_it = dag_component->data_path.find("idle_wait");
+    this->_wrapper_config.enable_idle_wait = (idle_wait_it != dag_component->data_path.end()
+        && (idle_wait_it->second == "true" || idle_wait_it->second == "event"));
+    this->_wrapper_config.enable_cq_event = 
+        (idle_wait_it != dag_component->data_path.end() && idle_wait_it->second == "event");
+    if (this->_wrapper_config.enable_idle_wait) {
+        const std::pair<const char*, double*> idle_wait_params[] = {
+            { "idle_spin_us", &this->_wrapper_config.idle_spin_us },
+            { "idle_backoff_us", &this->_wrapper_config.idle_backoff_us },
+            { "idle_sleep_us", &this->_wrapper_config.idle_sleep_us },
+        };
+        for (const auto &param : idle_wait_params) {
+            auto it = dag_component->data_path.find(param.first);
+            if (it == dag_component->data_path.end()) continue;
+            try {
+                *param.second = std::stod(it->second);
+            } catch (const std::exception &e) {
+                NICC_WARN_C("invalid %s for SoC block %s: %s, use default %.1f",
+                            param.first, dag_component->name.c_str(), it->second.c_str(), *param.second);
+            }
+        }
+        NICC_LOG("SoC block %s: idle wait spin(%.1f us), backoff(%.1f us), %s(%.1f us)",
+                 dag_component->name.c_str(), this->_wrapper_config.idle_spin_us,
+                 this->_wrapper_config.idle_backoff_us,
+                 this->_wrapper_config.enable_cq_event ? "cq event sleep" : "sleep",
+                 this->_wrapper_config.idle_sleep_us);
+    }
+
+    if (unlikely(NICC_SUCCESS != (retval = this->__parse_traffic_class_config(dag_component)))) {
+        NICC_WARN_C("failed to parse traffic classes of SoC block %s: retval(%u)", dag_component->name.c_str(), retval);
+        return retval;
+    }
+
+    if (unlikely(NICC_SUCCESS != (retval = this->__parse_dispatch_config(dag_component)))) {
+        NICC_WARN_C("failed to parse dispatch policy of SoC block %s: retval(%u)", dag_component->name.c_str(), retval);
+        return retval;
+    }
+
+    if (unlikely(NICC_SUCCESS != (retval = this->__parse_message_config(dag_component)))) {
+        NICC_WARN_C("failed to parse message handling of SoC block %s: retval(%u)", dag_component->name.c_str(), retval);
+        return retval;
+    }
+
+    if (unlikely(NICC_SUCCESS != (retval = this->__parse_shaper_config(dag_component)))) {
+        NICC_WARN_C("failed to parse egress shapers of SoC block %s: retval(%u)", dag_component->name.c_str(), retval);
+        return retval;
+    }
+
+    if (unlikely(NICC_SUCCESS != (retval = this->__parse_mirror_config(dag_component)))) {
+        NICC_WARN_C("failed to parse mirror tap of SoC block %s: retval(%u)", dag_component->name.c_str(), retval);
+        return retval;
+    }
+
+    NICC_LOG("SoC block %s: %s, work stealing %s, %s on overload, workers in %s", dag_component->name.c_str(),
+             this->_wrapper_config.is_unordered ? "unordered" : "ordered",
+             this->_wrapper_config.enable_work_stealing ? "enabled" : "disabled",
+             this->_wrapper_config.enable_backpressure ? "backpressure" : "drop",
+             this->_wrapper_config.external_workers ? "external process" : "runtime");
+
+    return retval;
+}
+
+nicc_retval_t ComponentBlock_SoC::__parse_traffic_class_config(const DAGComponent *dag_component){
+    SoCWrapper::SoCWrapperConfig &config = this->_wrapper_config;
+    auto it = dag_component->data_path.find("traffic_classes");
+    if (it == dag_component->data_path.end()) {
+        config.nb_traffic_classes = 1;
+        return NICC_SUCCESS;
+    }
+
+    try {
+        int nb_classes = std::stoi(it->second);
+        if (nb_classes < 1 || nb_classes > kSoCMaxTrafficClasses) {
+            NICC_WARN_C("invalid traffic_classes %d, should be within [1, %u]", nb_classes, kSoCMaxTrafficClasses);
+            return NICC_ERROR;
+        }
+        config.nb_traffic_classes = static_cast<uint8_t>(nb_classes);
+
+        it = dag_component->data_path.find("class_field");
+        if (it == dag_component->data_path.end() || it->second == "ws_type") {
+            config.class_field = SoCWrapper::kSoC_ClassField_WsType;
+        } else if (it->second == "dscp") {
+            config.class_field = SoCWrapper::kSoC_ClassField_Dscp;
+        } else {
+            NICC_WARN_C("unknown class_field %s", it->second.c_str());
+            return NICC_ERROR;
+        }
+
+        // unmapped field values go to the last, i.e., lowest priority class
+        memset(config.class_of_field, config.nb_traffic_classes - 1, sizeof(config.class_of_field));
+        it = dag_component->data_path.find("class_map");
+        if (it != dag_component->data_path.end()) {
+            std::stringstream ss(it->second);
+            std::string entry;
+            while (std::getline(ss, entry, ',')) {
+                size_t colon = entry.find(':');
+                if (colon == std::string::npos) {
+                    NICC_WARN_C("invalid class_map entry %s, expect field_value:class", entry.c_str());
+                    return NICC_ERROR;
+                }
+                int field = std::stoi(entry.substr(0, colon));
+                int cls = std::stoi(entry.substr(colon + 1));
+                if (field < 0 || field > UINT8_MAX || cls < 0 || cls >= config.nb_traffic_classes) {
+                    NICC_WARN_C("class_map entry %s out of range", entry.c_str());
+                    return NICC_ERROR;
+                }
+                config.class_of_field[field] = static_cast<uint8_t>(cls);
+            }
+        }
+
+        it = dag_component->data_path.find("class_sched");
+        if (it == dag_component->data_path.end() || it->second == "strict") {
+            config.class_sched = SoCWrapper::kSoC_ClassSched_Strict;
+        } else if (it->second == "drr") {
+            config.class_sched = SoCWrapper::kSoC_ClassSched_DRR;
+        } else {
+            NICC_WARN_C("unknown class_sched %s", it->second.c_str());
+            return NICC_ERROR;
+        }
+
+        it = dag_component->data_path.find("class_quantum");
+        if (it != dag_component->data_path.end()) {
+            std::stringstream ss(it->second);
+            std::string quantum;
+            uint8_t cls = 0;
+            while (std::getline(ss, quantum, ',') && cls < config.nb_traffic_classes) {
+                int value = std::stoi(quantum);
+                if (value < 1) {
+                    NICC_WARN_C("invalid class_quantum %d of class %u", value, cls);
+                    return NICC_ERROR;
+                }
+                config.class_quantum[cls++] = static_cast<uint32_t>(value);
+            }
+        }
+    } catch (const std::exception &e) {
+        NICC_WARN_C("failed to parse traffic classes: %s", e.what());
+        return NICC_ERROR;
+    }
+
+    NICC_LOG("SoC block %s: %u traffic classes by %s, %s scheduling", dag_component->name.c_str(),
+             config.nb_traffic_classes,
+             config.class_field == SoCWrapper::kSoC_ClassField_Dscp ? "dscp" : "ws_type",
+             config.class_sched == SoCWrapper::kSoC_ClassSched_DRR ? "drr" : "strict");
+    return NICC_SUCCESS;
+}
+
+nicc_retval_t ComponentBlock_SoC::__parse_message_config(const DAGComponent *dag_component){
+    SoCWrapper::SoCWrapperConfig &config = this->_wrapper_config;
+    auto it = dag_component->data_path.find("handler_type");
+    if (it == dag_component->data_path.end() || it->second == "packet") {
+        config.enable_reassembly = false;
+        return NICC_SUCCESS;
+    } else if (it->second != "message") {
+        NICC_WARN_C("unknown handler_type %s", it->second.c_str());
+        return NICC_ERROR;
+    }
+
+    // segments of a message are reassembled per flow, so they must stay in order on one worker
+    if (config.is_unordered || config.dispatch_policy != SoCWrapper::kSoC_Dispatch_FlowHash) {
+        NICC_WARN_C("multi-packet messages require \"dispatch\": \"rss\" and packet order");
+        return NICC_ERROR;
+    }
+    config.enable_reassembly = true;
+    auto timeout_it = dag_component->data_path.find("reassembly_timeout_us");
+    if (timeout_it != dag_component->data_path.end()) {
+        try {
+            config.reassembly_timeout_us = std::stod(timeout_it->second);
+        } catch (const std::exception &e) {
+            NICC_WARN_C("invalid reassembly_timeout_us for SoC block %s: %s, use default %.1f",
+                        dag_component->name.c_str(), timeout_it->second.c_str(), config.reassembly_timeout_us);
+        }
+    }
+    if (config.reassembly_timeout_us < 1.0) {
+        config.reassembly_timeout_us = 1.0;
+    }
+
+    NICC_LOG("SoC block %s: multi-packet messages, reassembly timeout(%.1f us)",
+             dag_component->name.c_str(), config.reassembly_timeout_us);
+    return NICC_SUCCESS;
+}
+
+nicc_retval_t ComponentBlock_SoC::__parse_dispatch_config(const DAGComponent *dag_component){
+    SoCWrapper::SoCWrapperConfig &config = this->_wrapper_config;
+    auto it = dag_component->data_path.find("dispatch");
+    if (it == dag_component->data_path.end()) {
+        // blocks without packet order go for the least loaded worker, the others keep their flows
+        config.dispatch_policy = config.is_unordered ?
+            SoCWrapper::kSoC_Dispatch_LeastLoaded : SoCWrapper::kSoC_Dispatch_FlowHash;
+    } else if (it->second == "rss") {
+        config.dispatch_policy = SoCWrapper::kSoC_Dispatch_FlowHash;
+    } else if (it->second == "round_robin") {
+        config.dispatch_policy = SoCWrapper::kSoC_Dispatch_RoundRobin;
+    } else if (it->second == "p2c") {
+        if (!config.is_unordered) {
+            NICC_WARN_C("p2c dispatch reorders packets, only for blocks with \"order\": \"false\"");
+            return NICC_ERROR;
+        }
+        config.dispatch_policy = SoCWrapper::kSoC_Dispatch_LeastLoaded;
+    } else {
+        NICC_WARN_C("unknown dispatch %s", it->second.c_str());
+        return NICC_ERROR;
+    }
+
+    // workers are counted when the block runs, out of range entries are checked by the dispatcher
+    config.rss_reta_size = 0;
+    it = dag_component->data_path.find("rss_reta");
+    if (it != dag_component->data_path.end()) {
+        try {
+            std::stringstream ss(it->second);
+            std::string entry;
+            while (std::getline(ss, entry, ',') && config.rss_reta_size < kSoCRssRetaSize) {
+                int worker_id = std::stoi(entry);
+                if (worker_id < 0 || worker_id >= kSoCWorkspaceMaxNum - 1) {
+                    NICC_WARN_C("rss_reta entry %d out of range", worker_id);
+                    return NICC_ERROR;
+                }
+                config.rss_reta[config.rss_reta_size++] = static_cast<uint16_t>(worker_id);
+            }
+        } catch (const std::exception &e) {
+            NICC_WARN_C("failed to parse rss_reta: %s", e.what());
+            return NICC_ERROR;
+        }
+    }
+
+    NICC_LOG("SoC block %s: %s dispatch, %s indirection table", dag_component->name.c_str(),
+             config.dispatch_policy == SoCWrapper::kSoC_Dispatch_FlowHash ? "rss" :
+                (config.dispatch_policy == SoCWrapper::kSoC_Dispatch_LeastLoaded ? "p2c" : "round robin"),
+             config.rss_reta_size > 0 ? "configured" : "even");
+    return NICC_SUCCESS;
+}
+
+nicc_retval_t ComponentBlock_SoC::__parse_shaper_config(const DAGComponent *dag_component){
+    SoCWrapper::SoCWrapperConfig &config = this->_wrapper_config;
+    const std::pair<const char*, double*> shaper_params[] = {
+        { "shape_next_gbps", &config.shaper_next.rate_gbps },
+        { "shape_next_burst_kb", &config.shaper_next.burst_kb },
+        { "shape_prior_gbps", &config.shaper_prior.rate_gbps },
+        { "shape_prior_burst_kb", &config.shaper_prior.burst_kb },
+    };
+    for (const auto &param : shaper_params) {
+        auto it = dag_component->data_path.find(param.first);
+        if (it == dag_component->data_path.end()) continue;
+        try {
+            *param.second = std::stod(it->second);
+        } catch (const std::exception &e) {
+            NICC_WARN_C("invalid %s %s", param.first, it->second.c_str());
+            return NICC_ERROR;
+        }
+        if (*param.second < 0.0) {
+            NICC_WARN_C("%s must not be negative: %s", param.first, it->second.c_str());
+            return NICC_ERROR;
+        }
+    }
+
+    if (config.shaper_next.rate_gbps > 0.0 || config.shaper_prior.rate_gbps > 0.0) {
+        NICC_LOG("SoC block %s: egress shaping next(%.3f Gbps, %.1f KB), prior(%.3f Gbps, %.1f KB), 0 is unshaped",
+                 dag_component->name.c_str(), config.shaper_next.rate_gbps, config.shaper_next.burst_kb,
+                 config.shaper_prior.rate_gbps, config.shaper_prior.burst_kb);
+    }
+    return NICC_SUCCESS;
+}
+
+nicc_retval_t ComponentBlock_SoC::__parse_mirror_config(const DAGComponent *dag_component){
+    SoCWrapper::SoCWrapperConfig &config = this->_wrapper_config;
+    const std::pair<const char*, uint32_t*> mirror_params[] = {
+        { "mirror_next_sample", &config.mirror_sample_next },
+        { "mirror_prior_sample", &config.mirror_sample_prior },
+        { "mirror_snaplen", &config.mirror_snaplen },
+    };
+    try {
+        for (const auto &param : mirror_params) {
+            auto it = dag_component->data_path.find(param.first);
+            if (it == dag_component->data_path.end()) continue;
+            long value = std::stol(it->second);
+            if (value < 0 || value > UINT32_MAX) {
+                NICC_WARN_C("%s out of range: %s", param.first, it->second.c_str());
+                return NICC_ERROR;
+            }
+            *param.second = static_cast<uint32_t>(value);
+        }
+        auto it = dag_component->data_path.find("mirror_rate_pps");
+        if (it != dag_component->data_path.end()) {
+            config.mirror_rate_pps = std::max(std::stod(it->second), 0.0);
+        }
+    } catch (const std::exception &e) {
+        NICC_WARN_C("failed to parse mirror tap: %s", e.what());
+        return NICC_ERROR;
+    }
+    if (config.mirror_sample_next == 0 && config.mirror_sample_prior == 0) {
+        return NICC_SUCCESS;
+    }
+    if (config.mirror_snaplen == 0 || config.mirror_snaplen > kSoCMirrorMaxSnaplen) {
+        NICC_WARN_C("mirror_snaplen %u should be within [1, %u]", config.mirror_snaplen, kSoCMirrorMaxSnaplen);
+        return NICC_ERROR;
+    }
+
+    auto path_it = dag_component->data_path.find("mirror_path");
+    std::string path = (path_it != dag_component->data_path.end()) ?
+        path_it->second : std::string("/tmp/") + dag_component->name + ".pcap";
+    if (path.size() >= sizeof(config.mirror_path)) {
+        NICC_WARN_C("mirror_path %s is longer than %lu characters", path.c_str(), sizeof(config.mirror_path) - 1);
+        return NICC_ERROR;
+    }
+    strncpy(config.mirror_path, path.c_str(), sizeof(config.mirror_path));
+
+    NICC_LOG("SoC block %s: mirror tap 1/%u next, 1/%u prior, at most %.1f pps, snaplen(%u) to %s",
+             dag_component->name.c_str(), config.mirror_sample_next, config.mirror_sample_prior,
+             config.mirror_rate_pps, config.mirror_snaplen, config.mirror_path);
+    return NICC_SUCCESS;
+}
+
+nicc_retval_t ComponentBlock_SoC::set_rss_indirection_table(const std::vector<uint16_t> &reta){
+    SoCWrapper::SoCWrapperConfig &config = this->_wrapper_config;
+    RDMA_SoC_QP *qp;
+
+    if (unlikely(reta.empty() || reta.size() > kSoCRssRetaSize)) {
+        NICC_WARN_C("invalid RSS indirection table size %lu, should be within [1, %u]", reta.size(), kSoCRssRetaSize);
+        return NICC_ERROR;
+    }
+    // workers are only counted once the block runs
+    const bool is_running = this->_function_state != nullptr && !this->_function_state->wrapper_threads.empty();
+    const uint16_t nb_workers = is_running ? config.nb_workers : kSoCWorkspaceMaxNum - 1;
+    for (uint16_t worker_id : reta) {
+        if (unlikely(worker_id >= nb_workers)) {
+            NICC_WARN_C("RSS indirection table entry %u out of range, the block has %u workers", worker_id, nb_workers);
+            return NICC_ERROR;
+        }
+    }
+
+    // kept for wrappers started later
+    config.rss_reta_size = static_cast<uint16_t>(reta.size());
+    std::copy(reta.begin(), reta.end(), config.rss_reta);
+
+    if (!is_running) {
+        return NICC_SUCCESS;
+    }
+    NICC_CHECK_POINTER(qp = this->_function_state->channel->qp_for_prior);
+    for (uint16_t b = 0; b < kSoCRssRetaSize; b++) {
+        qp->_rss_reta[b].store(reta[b % reta.size()], std::memory_order_relaxed);
+    }
+    return NICC_SUCCESS;
+}
+
 nicc_retval_t ComponentBlock_SoC::__allocate_wrapper_resources(AppFunction *app_func) {
     nicc_retval_t retval = NICC_SUCCESS;
 
     this->_function_state->channel = new Channel_SoC(Channel::RDMA, Channel::PAKT_UNORDERED, Channel::RDMA, Channel::PAKT_UNORDERED);
     // allocate channel
     if(unlikely(NICC_SUCCESS != (
-        retval = this->_function_state->channel->allocate_channel(this->_desp->device_name, this->_desp->phy_port)
+        retval = this->_function_state->channel->allocate_channel(this->_desp->device_name, this->_desp->phy_port, soc_shm_segment_name(this->block_name))
     ))) {
         NICC_WARN_C("failed to allocate and init SoC channel: nicc_retval(%u)", retval);
         goto exit;
@@ -191,53 +610,160 @@ exit:
 
 nicc_retval_t ComponentBlock_SoC::__create_wrapper_process(ComponentFuncState_SoC_t *func_state){
     nicc_retval_t retval = NICC_SUCCESS;
-    NICC_CHECK_POINTER(func_state->context = new SoCWrapper::SoCWrapperContext());
-    // NICC_CHECK_POINTER(context->pkt_handler = func_state->pkt_handler);
-    // NICC_CHECK_POINTER(context->match_action_table = func_state->match_action_table);
-    NICC_CHECK_POINTER(func_state->context->qp_for_prior = func_state->channel->qp_for_prior);
-    NICC_CHECK_POINTER(func_state->context->qp_for_next = func_state->channel->qp_for_next);
-
-    // pass user defined handlers to wrapper context
-    if (this->_init_handler) {
-        func_state->context->init_handler = (soc_init_handler_t)this->_init_handler->binary.soc;
-    } else {
-        func_state->context->init_handler = nullptr;
+    SoCWrapper::SoCWrapperContext *context;
+    SoCWrapper::soc_wrapper_type_t type;
+    size_t nb_threads, i, core;
+
+    // asynchronous handlers complete messages out of order
+    if (this->_async_msg_handler != nullptr && !this->_wrapper_config.is_unordered) {
+        NICC_WARN_C("asynchronous message handlers reorder messages, only for blocks with \"order\": \"false\"");
+        return NICC_ERROR;
     }
-    
-    if (this->_pkt_handler) {
-        func_state->context->pkt_handler = (soc_pkt_handler_t)this->_pkt_handler->binary.soc;
+
+    // one core serves as both dispatcher and worker, otherwise the dispatcher takes
+    // the first core and the others run one worker each
+    if (this->_desp->base_desp.quota <= 1) {
+        this->_wrapper_config.nb_workers = 1;
     } else {
-        func_state->context->pkt_handler = nullptr;
+        this->_wrapper_config.nb_workers = std::min<size_t>(this->_desp->base_desp.quota - 1, kSoCWorkspaceMaxNum - 1);
+        if (unlikely(this->_wrapper_config.nb_workers < this->_desp->base_desp.quota - 1)) {
+            NICC_WARN_C("too many cores for a SoC block, only %u workers are used: quota(%lu)",
+                        this->_wrapper_config.nb_workers, this->_desp->base_desp.quota);
+        }
     }
-    
-    if (this->_msg_handler) {
-        func_state->context->msg_handler = (soc_msg_handler_t)this->_msg_handler->binary.soc;
+    // external workers are started by the user, only the dispatcher runs here
+    if (this->_desp->base_desp.quota <= 1 || this->_wrapper_config.external_workers) {
+        nb_threads = 1;
     } else {
-        func_state->context->msg_handler = nullptr;
+        nb_threads = 1 + this->_wrapper_config.nb_workers;
     }
-    
-    if (this->_cleanup_handler) {
-        func_state->context->cleanup_handler = (soc_cleanup_handler_t)this->_cleanup_handler->binary.soc;
-    } else {
-        func_state->context->cleanup_handler = nullptr;
+
+    // compile the routes of the kernel return values, every wrapper gets its own copy
+    retval = this->__compile_routes(func_state->channel);
+    if (unlikely(retval != NICC_SUCCESS)) {
+        return retval;
     }
-    
-    // user_state will be allocated by user's init_handler
-    func_state->context->user_state = nullptr;
-    func_state->context->user_state_size = 0;
 
-    // create wrapper process for the function
-    NICC_CHECK_POINTER(func_state->wrapper_thread = new std::thread(__soc_wrapper_thread_func, func_state));
-    // bind the thread to the core
-    size_t core = bind_to_core(*func_state->wrapper_thread, /*SoC only has numa 0*/0, /*thread id, \todo: enable multiple threads*/0);
-    NICC_LOG("Successfully created SoC wrapper thread: core(%lu)", core);
+    // external workers learn the workers and the class scheduling from the segment
+    if (func_state->channel->shm_segment != nullptr) {
+        soc_shm_segment_hdr *shm_segment = func_state->channel->shm_segment;
+        shm_segment->nb_workers_ = this->_wrapper_config.nb_workers;
+        shm_segment->nb_traffic_classes_ = this->_wrapper_config.nb_traffic_classes;
+        shm_segment->class_sched_ = this->_wrapper_config.class_sched;
+        for (uint8_t i = 0; i < kSoCMaxTrafficClasses; i++) {
+            shm_segment->class_quantum_[i] = this->_wrapper_config.class_quantum[i];
+        }
+        shm_segment->reassembly_timeout_us_ = this->_wrapper_config.enable_reassembly ?
+            static_cast<uint32_t>(this->_wrapper_config.reassembly_timeout_us) : 0;
+        shm_segment->enable_backpressure_ = this->_wrapper_config.enable_backpressure;
+        shm_segment->is_unordered_ = this->_wrapper_config.is_unordered;
+        shm_segment->batch_deadline_us_ = this->_wrapper_config.batch_deadline_us;
+        memcpy(shm_segment->route_of_retval_, this->_wrapper_config.route_of_retval, sizeof(shm_segment->route_of_retval_));
+    }
+
+    // the merge handler reads the user states of in-process workers, external workers keep
+    // theirs in their own process
+    const bool do_merge = this->_merge_handler != nullptr && !this->_wrapper_config.external_workers;
+    if (this->_merge_handler != nullptr && !do_merge) {
+        NICC_WARN_C("the merge handler can't reach the user states of external workers, it is not run");
+    }
+    func_state->merge_barrier.nb_workers = static_cast<uint16_t>(nb_threads - 1);
+    func_state->merge_barrier.nb_stopped.store(0, std::memory_order_relaxed);
+    func_state->merge_barrier.merged.store(false, std::memory_order_relaxed);
+    for (i = 0; i < nb_threads; i++) {
+        NICC_CHECK_POINTER(context = new SoCWrapper::SoCWrapperContext());
+        NICC_CHECK_POINTER(context->qp_for_prior = func_state->channel->qp_for_prior);
+        NICC_CHECK_POINTER(context->qp_for_next = func_state->channel->qp_for_next);
+        context->config = this->_wrapper_config;
+        context->shm_segment = nullptr;
+        context->worker_shm_segment = this->_wrapper_config.external_workers ? func_state->channel->shm_segment : nullptr;
+        context->worker_id = (i == 0) ? 0 : i - 1;
+
+        // pass user defined handlers to wrapper context
+        context->init_handler = this->_init_handler ? (soc_init_handler_t)this->_init_handler->binary.soc : nullptr;
+        context->pkt_handler = this->_pkt_handler ? (soc_pkt_handler_t)this->_pkt_handler->binary.soc : nullptr;
+        context->msg_handler = this->_msg_handler ? (soc_msg_handler_t)this->_msg_handler->binary.soc : nullptr;
+        context->cleanup_handler = this->_cleanup_handler ? (soc_cleanup_handler_t)this->_cleanup_handler->binary.soc : nullptr;
+        context->msg_burst_handler = this->_msg_burst_handler ? (soc_msg_burst_handler_t)this->_msg_burst_handler->binary.soc : nullptr;
+        context->merge_handler = do_merge ? (soc_merge_handler_t)this->_merge_handler->binary.soc : nullptr;
+        context->async_msg_handler = this->_async_msg_handler ? (soc_async_msg_handler_t)this->_async_msg_handler->binary.soc : nullptr;
+        context->worker_user_states = do_merge ? func_state->worker_user_states : nullptr;
+        context->merge_barrier = do_merge ? &func_state->merge_barrier : nullptr;
+
+        // user_state will be allocated by user's init_handler
+        context->user_state = nullptr;
+        context->user_state_size = 0;
+        func_state->contexts.push_back(context);
+    }
+
+    // create wrapper threads for the function, the dispatcher first
+    func_state->nb_pinned_threads.store(0, std::memory_order_release);
+    for (i = 0; i < nb_threads; i++) {
+        if (nb_threads > 1) {
+            type = (i == 0) ? SoCWrapper::kSoC_Dispatcher : SoCWrapper::kSoC_Worker;
+        } else if (this->_wrapper_config.external_workers) {
+            type = SoCWrapper::kSoC_Dispatcher;
+        } else {
+            type = static_cast<SoCWrapper::soc_wrapper_type_t>(SoCWrapper::kSoC_Dispatcher | SoCWrapper::kSoC_Worker);
+        }
+        std::thread *wrapper_thread;
+        NICC_CHECK_POINTER(wrapper_thread = new std::thread(__soc_wrapper_thread_func, func_state, i, type));
+        func_state->wrapper_threads.push_back(wrapper_thread);
+        // bind the thread to its own core, then let it start
+        core = bind_to_core(*wrapper_thread, /*SoC only has numa 0*/0, this->_desp->core_id + i);
+        func_state->nb_pinned_threads.store(i + 1, std::memory_order_release);
+        if (unlikely(core == static_cast<size_t>(-1))) {
+            NICC_WARN_C("failed to bind SoC wrapper thread %lu to core index %lu", i, this->_desp->core_id + i);
+            continue;
+        }
+        NICC_LOG("Successfully created SoC %s thread: core(%lu)",
+                 type == SoCWrapper::kSoC_Worker ? "worker" : 
+                    (type == SoCWrapper::kSoC_Dispatcher ? "dispatcher" : "wrapper"), core);
+    }
 
     return retval;
 }
 
-static void __soc_wrapper_thread_func(ComponentFuncState_SoC_t *func_state) {
-    // Create a SoCWrapper object and call its run method
-    SoCWrapper wrapper(SoCWrapper::kSoC_Dispatcher, func_state->context);
+nicc_retval_t ComponentBlock_SoC::__compile_routes(Channel_SoC *channel){
+    SoCWrapper::SoCWrapperConfig &config = this->_wrapper_config;
+    const ComponentRoute_t *routes;
+    size_t nb_mapped = 0, nb_drop = 0;
+
+    NICC_CHECK_POINTER(channel);
+    NICC_CHECK_POINTER(this->routing);
+    NICC_CHECK_POINTER(routes = this->routing->get_retval_routes());
+
+    for (size_t i = 0; i <= UINT8_MAX; i++) {
+        if (!routes[i].is_mapped) {
+            config.route_of_retval[i] = SoCWrapper::kSoC_Route_Default;
+            continue;
+        }
+        nb_mapped++;
+        if (routes[i].channel == nullptr) {
+            config.route_of_retval[i] = SoCWrapper::kSoC_Route_Drop;
+            nb_drop++;
+        } else if (routes[i].channel == static_cast<nicc::Channel*>(channel)) {
+            config.route_of_retval[i] = SoCWrapper::kSoC_Route_Next;
+        } else {
+            /// a SoC block owns a single channel, whose next QP is the only way out
+            NICC_WARN_C("retval %lu is routed to a channel outside of the SoC block", i);
+            return NICC_ERROR_NOT_FOUND;
+        }
+    }
+    if (nb_mapped > 0) {
+        NICC_LOG("SoC block %s routes %lu kernel return values, %lu of them dropped",
+                 this->block_name, nb_mapped, nb_drop);
+    }
+    return NICC_SUCCESS;
+}
+
+static void __soc_wrapper_thread_func(ComponentFuncState_SoC_t *func_state, size_t thread_idx, SoCWrapper::soc_wrapper_type_t type) {
+    // the user state is allocated by the first touch of this thread, wait until it runs on its own core
+    while (func_state->nb_pinned_threads.load(std::memory_order_acquire) <= thread_idx) {
+        std::this_thread::yield();
+    }
+    // Create a SoCWrapper object, which runs until the wrapper stops
+    SoCWrapper wrapper(type, func_state->contexts[thread_idx]);
 }
 
 } // namespace nicc
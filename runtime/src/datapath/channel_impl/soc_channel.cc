@@ -1,3 +1,4 @@
+#include <fcntl.h>
 #include "datapath/channel_impl/soc_channel.h"
 
 namespace nicc {
@@ -9,9 +10,10 @@ namespace nicc {
 //  * Mellanox's `show_gids` script lists all GIDs on all NICs
 static constexpr size_t kDefaultGIDIndex = 1;   
 
-nicc_retval_t Channel_SoC::allocate_channel(const char *dev_name, uint8_t phy_port) {
+nicc_retval_t Channel_SoC::allocate_channel(const char *dev_name, uint8_t phy_port, const std::string &shm_name) {
     nicc_retval_t retval = NICC_SUCCESS;
     
+    this->_shm_name = shm_name;
     this->_huge_alloc = new HugeAlloc(kMemRegionSize, /* numa_node */0);    // SoC only has one NUMA node
     common_resolve_phy_port(dev_name, phy_port, RDMA_SoC_QP::kMTU, this->_resolve);
 
@@ -210,8 +212,15 @@ nicc_retval_t Channel_SoC::__create_qp(RDMA_SoC_QP *qp) {
     qp->_send_cq = ibv_create_cq(this->_resolve.ib_ctx, kSQDepth, nullptr, nullptr, 0);
     NICC_CHECK_POINTER(qp->_send_cq);
 
-    /// Create recv CQ
-    qp->_recv_cq = ibv_create_cq(this->_resolve.ib_ctx, kRQDepth, nullptr, nullptr, 0);
+    /// Create recv CQ, with a completion channel for dispatchers waiting on CQ events
+    qp->_recv_comp_channel = ibv_create_comp_channel(this->_resolve.ib_ctx);
+    NICC_CHECK_POINTER(qp->_recv_comp_channel);
+    int flags = fcntl(qp->_recv_comp_channel->fd, F_GETFL);
+    if (unlikely(flags < 0 || fcntl(qp->_recv_comp_channel->fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        NICC_WARN_C("failed to make completion channel non-blocking: %s", strerror(errno));
+        return NICC_ERROR_HARDWARE_FAILURE;
+    }
+    qp->_recv_cq = ibv_create_cq(this->_resolve.ib_ctx, kRQDepth, nullptr, qp->_recv_comp_channel, 0);
     NICC_CHECK_POINTER(qp->_recv_cq);
 
     // Initialize QP creation attributes
@@ -307,12 +316,25 @@ nicc_retval_t Channel_SoC::__create_ah(const QPInfo *local_qp_info, const QPInfo
 nicc_retval_t Channel_SoC::__init_rings() {
     nicc_retval_t retval = NICC_SUCCESS;
     // Initialize the ring buffer
-    /// Step 1: Allocate memory for the ring buffer
-    Buffer raw_mr = this->_huge_alloc->alloc_raw(kMemRegionSize, DoRegister::kTrue);
-    if (raw_mr.buf_ == nullptr) {
-        NICC_WARN_C("failed to allocate memory for the ring buffer");
+    /// Step 1: Allocate the named SHM segment, holding the worker queues, the rx ring
+    /// descriptors and the ring buffer, so that worker processes can attach to it
+    const size_t ctrl_area_size = soc_shm_segment_hdr::get_ctrl_area_size(2 * kRQDepth);
+    Buffer raw_segment = this->_huge_alloc->alloc_named(this->_shm_name, ctrl_area_size + kMemRegionSize,
+                                                        kSoCShmSegmentMagic, DoRegister::kTrue);
+    if (raw_segment.buf_ == nullptr) {
+        NICC_WARN_C("failed to allocate SHM segment %s for the ring buffer", this->_shm_name.c_str());
         return NICC_ERROR_MEMORY_FAILURE;
     }
+    NICC_CHECK_POINTER(this->shm_segment = soc_shm_init_segment(raw_segment.buf_, ctrl_area_size + kMemRegionSize, 2 * kRQDepth));
+    for (uint16_t w = 0; w < kSoCWorkspaceMaxNum; w++) {
+        for (uint8_t i = 0; i < kSoCMaxTrafficClasses; i++) {
+            this->qp_for_prior->_disp_worker_queues[w][i] = this->shm_segment->get_worker_rx_queue(w, i);
+        }
+    }
+    this->qp_for_next->_collect_worker_queue = this->shm_segment->get_worker_tx_queue();
+    this->qp_for_prior->_recycle_worker_queue = this->shm_segment->get_worker_recycle_queue();
+
+    Buffer raw_mr(this->shm_segment->get_data_area(), SIZE_MAX, UINT32_MAX);
     NICC_CHECK_POINTER(this->_mr = ibv_reg_mr(this->_pd, 
                                                 raw_mr.buf_, 
                                                 kMemRegionSize, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC));
@@ -320,7 +342,7 @@ nicc_retval_t Channel_SoC::__init_rings() {
     this->_huge_alloc->add_raw_buffer(raw_mr, kMemRegionSize);
 
     /// Step 2: Initialize the ring buffer
-    if (unlikely(NICC_SUCCESS != (retval = this->__init_recvs(this->qp_for_prior)))){
+    if (unlikely(NICC_SUCCESS != (retval = this->__init_recvs(this->qp_for_prior, this->shm_segment->get_buffer_descs())))){
         NICC_WARN_C("failed to initialize the recv ring buffer for prior component block");
         return retval;
     }
@@ -328,7 +350,7 @@ nicc_retval_t Channel_SoC::__init_rings() {
         NICC_WARN_C("failed to initialize the send ring buffer for prior component block");
         return retval;
     }
-    if (unlikely(NICC_SUCCESS != (retval = this->__init_recvs(this->qp_for_next)))){
+    if (unlikely(NICC_SUCCESS != (retval = this->__init_recvs(this->qp_for_next, this->shm_segment->get_buffer_descs() + kRQDepth)))){
         NICC_WARN_C("failed to initialize the recv ring buffer for next component block");
         return retval;
     }
@@ -340,7 +362,7 @@ nicc_retval_t Channel_SoC::__init_rings() {
     return retval;
 }
 
-nicc_retval_t Channel_SoC::__init_recvs(RDMA_SoC_QP *qp) {
+nicc_retval_t Channel_SoC::__init_recvs(RDMA_SoC_QP *qp, Buffer *buffer_descs) {
     nicc_retval_t retval = NICC_SUCCESS;
     // Initialize the memory region for RECVs
     const size_t ring_extent_size = kRQDepth * kRecvMbufSize;
@@ -363,16 +385,12 @@ nicc_retval_t Channel_SoC::__init_recvs(RDMA_SoC_QP *qp) {
         qp->_recv_wr[i].wr_id = i;
         qp->_recv_wr[i].sg_list = &qp->_recv_sgl[i];
         qp->_recv_wr[i].num_sge = 1;      /// Only one SGE per recv wr
-        qp->_rx_ring[i] = new Buffer(&buf[offset], kRecvMbufSize, ring_extent->lkey_);  // RX ring entry
+        qp->_rx_ring[i] = new (&buffer_descs[i]) Buffer(&buf[offset], kRecvMbufSize, ring_extent->lkey_);  // RX ring entry
         qp->_rx_ring[i]->state_ = Buffer::kPOSTED;
+        qp->_rx_ring[i]->rx_qp_ = qp;
         qp->_recv_wr[i].next = (i < kRQDepth - 1) ? &qp->_recv_wr[i + 1] : &qp->_recv_wr[0];
     }
 
-    // Circular link rx ring
-    for (size_t i = 0; i < kRQDepth; i++) {
-        qp->_rx_ring[i]->next_ = (i < kRQDepth - 1) ? qp->_rx_ring[i + 1] : qp->_rx_ring[0];
-    }
-
     // Does not post RECVs here, because the qp has not been connected yet (i.e., qp has not been changed to RTR state)
 
     return retval;
@@ -381,6 +399,7 @@ nicc_retval_t Channel_SoC::__init_recvs(RDMA_SoC_QP *qp) {
 nicc_retval_t Channel_SoC::__init_sends(RDMA_SoC_QP *qp) {
     nicc_retval_t retval = NICC_SUCCESS;
     for (size_t i = 0; i < kSQDepth; i++) {
+        qp->_send_wr[i].wr_id = i;    // completion of a signaled wr releases the sw_ring up to its slot
         qp->_send_wr[i].opcode = IBV_WR_SEND;
         qp->_send_wr[i].send_flags = IBV_SEND_SIGNALED;
         qp->_send_wr[i].sg_list = &qp->_send_sgl[i];
@@ -496,6 +515,7 @@ nicc_retval_t Channel_SoC::__fill_recv_queue(RDMA_SoC_QP *qp) {
         return NICC_ERROR_HARDWARE_FAILURE;
     }
     qp->_recv_wr[kRQDepth - 1].next = &qp->_recv_wr[0];  // Restore circularity
+    qp->_nb_posted_recvs = kRQDepth;
     return retval;
 }
 
@@ -282,6 +282,16 @@ nicc_retval_t DatapathPipeline::__init_control_plane(device_state_t &device_stat
                                component_name.c_str(), retval);
                     goto exit;
                 }
+
+                const DAGComponent* dag_component = this->_app_dag->get_component_config(component_name);
+                if (dag_component != nullptr) {
+                    retval = soc_block->apply_datapath_config(dag_component);
+                    if (retval != NICC_SUCCESS) {
+                        NICC_ERROR_C("Failed to apply data_path config for SoC component %s: retval(%u)", 
+                                   component_name.c_str(), retval);
+                        goto exit;
+                    }
+                }
             }
 
             // Register retval-to-channel mapping based on component's ctrl_path configuration
@@ -341,6 +351,17 @@ nicc_retval_t DatapathPipeline::__init_retval_mappings(ComponentBlock* component
             try {
                 nicc_core_retval_t kernel_retval = std::stoi(retval_str);
                 
+                // Packets the kernel marks for dropping never reach a channel
+                if (action_str.find("drop") == 0) {
+                    retval = component_routing->add_retval_drop(kernel_retval);
+                    if (retval != NICC_SUCCESS) {
+                        NICC_ERROR_C("Failed to add retval drop for component %s: retval=%u: retval(%u)", 
+                                   component_name.c_str(), kernel_retval, retval);
+                        return retval;
+                    }
+                    continue;
+                }
+                
                 // Parse action to determine target channel
                 // For now, use default channel for all actions
                 // TODO: Parse action properly and get target channel
@@ -28,6 +28,12 @@ extern nicc::user_state_info soc_init_handler();
 extern nicc::nicc_retval_t soc_msg_handler(nicc::Buffer* msg, void* user_state);
 extern void soc_cleanup_handler(void* user_state);
 extern nicc::nicc_retval_t soc_pkt_handler(nicc::Buffer* pkt, void* user_state);
+// optional, registered only if the user kernel defines it
+extern void soc_msg_burst_handler(nicc::Buffer** msgs, nicc::nicc_retval_t* retvals, uint16_t nb_msgs, void* user_state)
+    __attribute__((weak));
+extern void soc_merge_handler(void* const* user_states, uint16_t nb_states) __attribute__((weak));
+extern nicc::soc_async_status_t soc_async_msg_handler(nicc::Buffer* msg, nicc::soc_async_ctx* ctx, void* user_state)
+    __attribute__((weak));
 
 #ifdef __cplusplus
     }
@@ -61,6 +67,7 @@ int main(){
     soc_init_desp->base_desp.quota = 16; 
     soc_init_desp->device_name = device_name_cstr;
     soc_init_desp->phy_port = 0;
+    soc_init_desp->core_id = 0;
     /*----------------------------------------------------------------*/
     /**
      * \brief  STEP 1: parse config file
@@ -133,18 +140,25 @@ int main(){
 
     /// SoC app context
     nicc::AppHandler soc_app_init_handler, soc_app_pkt_handler, soc_app_msg_handler, soc_app_cleanup_handler;
+    nicc::AppHandler soc_app_msg_burst_handler, soc_app_merge_handler, soc_app_async_msg_handler;
     
     // Set handler types
     soc_app_init_handler.tid = nicc::ComponentBlock_SoC::handler_typeid_t::Init;
     soc_app_pkt_handler.tid = nicc::ComponentBlock_SoC::handler_typeid_t::Pkt_Handler;
     soc_app_msg_handler.tid = nicc::ComponentBlock_SoC::handler_typeid_t::Msg_Handler;
     soc_app_cleanup_handler.tid = nicc::ComponentBlock_SoC::handler_typeid_t::Cleanup;
+    soc_app_msg_burst_handler.tid = nicc::ComponentBlock_SoC::handler_typeid_t::Msg_Burst_Handler;
+    soc_app_merge_handler.tid = nicc::ComponentBlock_SoC::handler_typeid_t::Merge_Handler;
+    soc_app_async_msg_handler.tid = nicc::ComponentBlock_SoC::handler_typeid_t::Async_Msg_Handler;
     
     // Point to fixed function names
     soc_app_init_handler.binary.soc = reinterpret_cast<void*>(&soc_init_handler);
     soc_app_pkt_handler.binary.soc = reinterpret_cast<void*>(&soc_pkt_handler);
     soc_app_msg_handler.binary.soc = reinterpret_cast<void*>(&soc_msg_handler);
     soc_app_cleanup_handler.binary.soc = reinterpret_cast<void*>(&soc_cleanup_handler);
+    soc_app_msg_burst_handler.binary.soc = reinterpret_cast<void*>(&soc_msg_burst_handler);
+    soc_app_merge_handler.binary.soc = reinterpret_cast<void*>(&soc_merge_handler);
+    soc_app_async_msg_handler.binary.soc = reinterpret_cast<void*>(&soc_async_msg_handler);
 
     nicc::ComponentDesp_SoC_t soc_block_desp = {
         .base_desp = { 
@@ -155,8 +169,21 @@ int main(){
         .phy_port = 0
     };
 
+    std::vector<nicc::AppHandler*> soc_app_handlers = {
+        &soc_app_init_handler, &soc_app_pkt_handler, &soc_app_msg_handler, &soc_app_cleanup_handler
+    };
+    if (soc_app_msg_burst_handler.binary.soc != nullptr) {
+        soc_app_handlers.push_back(&soc_app_msg_burst_handler);
+    }
+    if (soc_app_merge_handler.binary.soc != nullptr) {
+        soc_app_handlers.push_back(&soc_app_merge_handler);
+    }
+    if (soc_app_async_msg_handler.binary.soc != nullptr) {
+        soc_app_handlers.push_back(&soc_app_async_msg_handler);
+    }
+
     nicc::AppFunction soc_app_func = nicc::AppFunction(
-        /* handlers_ */ { &soc_app_init_handler, &soc_app_pkt_handler, &soc_app_msg_handler, &soc_app_cleanup_handler },
+        /* handlers_ */ std::move(soc_app_handlers),
         /* cb_desp_ */ reinterpret_cast<nicc::ComponentBaseDesp_t*>(&soc_block_desp),
         /* cid */ nicc::kComponent_SoC
     );
@@ -18,6 +18,7 @@ nicc_retval_t Component_SoC::allocate_block(ComponentBaseDesp_t* desp, Component
     nicc_retval_t retval = NICC_SUCCESS;
     ComponentDesp_SoC_t *func_input_desp;
     ComponentBlock_SoC *desired_cb;
+    uint16_t core_id;
 
     NICC_CHECK_POINTER(func_input_desp = reinterpret_cast<ComponentDesp_SoC_t*>(desp));
     NICC_CHECK_POINTER(desired_cb = reinterpret_cast<ComponentBlock_SoC*>(cb));
@@ -33,6 +34,9 @@ nicc_retval_t Component_SoC::allocate_block(ComponentBaseDesp_t* desp, Component
         retval = NICC_ERROR_EXSAUSTED;
         goto exit;
     }
+    /// the quota counts cores, blocks take consecutive cores
+    /// \todo  reuse the cores of deallocated blocks
+    core_id = this->_desp->base_desp.quota - this->_base_state->quota;
     this->_base_state->quota -= desp->quota;
     /// specific state
     /* ...... */
@@ -43,6 +47,7 @@ nicc_retval_t Component_SoC::allocate_block(ComponentBaseDesp_t* desp, Component
     /// specific descriptor
     desired_cb->_desp->device_name = func_input_desp->device_name;
     desired_cb->_desp->phy_port = func_input_desp->phy_port;
+    desired_cb->_desp->core_id = core_id;
 
     /* Step 3: set target cb's state to default */
     /// reset block state
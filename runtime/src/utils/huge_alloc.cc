@@ -28,6 +28,11 @@ HugeAlloc::~HugeAlloc() {
               shm_region.shm_key_);
       exit(-1);
     }
+    // Named regions are removed once the attached processes detach
+    if (shm_region.named_) {
+      const int shm_id = shmget(shm_region.shm_key_, 0, 0);
+      if (shm_id != -1) shmctl(shm_id, IPC_RMID, nullptr);
+    }
 #else
     rt_assert(false, "Not implemented on Windows yet");
 #endif
@@ -146,6 +151,80 @@ Buffer HugeAlloc::alloc_raw(size_t size, DoRegister do_register) {
 #endif
 }
 
+/// Whether the SHM region of \p shm_id is one of ours left by a crashed run,
+/// i.e., it starts with \p magic and nobody is attached to it any more
+static bool is_stale_named_region(int shm_id, uint64_t magic) {
+  struct shmid_ds ds;
+  if (shmctl(shm_id, IPC_STAT, &ds) != 0 || ds.shm_nattch != 0) return false;
+  if (ds.shm_segsz < sizeof(uint64_t)) return false;
+  void *probe = shmat(shm_id, nullptr, SHM_RDONLY);
+  if (probe == reinterpret_cast<void *>(-1)) return false;
+  const bool is_ours = (*static_cast<volatile uint64_t *>(probe) == magic);
+  shmdt(probe);
+  return is_ours;
+}
+
+Buffer HugeAlloc::alloc_named(const std::string &name, size_t size,
+                              uint64_t magic, DoRegister do_register) {
+#ifdef __linux__
+  std::ostringstream xmsg;  // The exception message
+  size = round_up<kHugepageSize>(size);
+  const int shm_key = shm_key_from_name(name.c_str());
+  int shm_id = shmget(shm_key, size, IPC_CREAT | IPC_EXCL | 0660 | SHM_HUGETLB);
+
+  if (shm_id == -1 && errno == EEXIST) {
+    // Left by a previous run which did not exit cleanly, or taken by a live
+    // region of another block or process, which must not be touched
+    const int stale_id = shmget(shm_key, 0, 0);
+    if (stale_id != -1 && is_stale_named_region(stale_id, magic)) {
+      NICC_WARN("HugeAlloc: Removing stale SHM region %s, key %d",
+                name.c_str(), shm_key);
+      shmctl(stale_id, IPC_RMID, nullptr);
+      shm_id = shmget(shm_key, size, IPC_CREAT | IPC_EXCL | 0660 | SHM_HUGETLB);
+    } else {
+      NICC_WARN("HugeAlloc: SHM key %d of region %s is in use by another region",
+                shm_key, name.c_str());
+      errno = EEXIST;
+    }
+  }
+
+  if (shm_id == -1) {
+    switch (errno) {
+      case ENOMEM:
+        NICC_WARN("HugeAlloc: Insufficient hugepages. Can't reserve %lu MB.\n",
+                  size / MB(1));
+        return Buffer(nullptr, 0, 0);
+
+      default:
+        xmsg << "HugeAlloc: Named SHM allocation error for " << name << ": "
+             << strerror(errno);
+        throw std::runtime_error(xmsg.str());
+    }
+  }
+
+  uint8_t *shm_buf = static_cast<uint8_t *>(shmat(shm_id, nullptr, 0));
+  rt_assert(shm_buf != reinterpret_cast<uint8_t *>(-1),
+            "HugeAlloc: shmat() failed. Key = " + std::to_string(shm_key));
+
+  // Bind the buffer to the NUMA node
+  const unsigned long nodemask =
+      (1ul << static_cast<unsigned long>(numa_node_));
+  long ret = mbind(shm_buf, size, MPOL_BIND, &nodemask, 32, 0);
+  rt_assert(ret == 0,
+            "HugeAlloc: mbind() failed. Key " + std::to_string(shm_key));
+
+  bool do_register_bool = (do_register == DoRegister::kTrue);
+  shm_list_.push_back(
+      shm_region_t(shm_key, shm_buf, size, do_register_bool, /* named */true));
+  stats_.shm_reserved_ += size;
+
+  return Buffer(shm_buf, SIZE_MAX, UINT32_MAX);
+#else
+  rt_assert(false, "Not implemented on Windows yet");
+  return Buffer(nullptr, 0, 0);
+#endif
+}
+
 Buffer * HugeAlloc::alloc(size_t size) {
   assert(size <= k_max_class_size);
 